@@ -0,0 +1,244 @@
+#pragma once
+#ifndef _BINARY_LOG_READER_H
+#define _BINARY_LOG_READER_H
+
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <string>
+
+#include "cpplog.hpp"
+
+namespace cpplog
+{
+    // Reads a file written by BinaryFileLogger, turning each message back
+    // into the text an OstreamLogger would have written for it.
+    class BinaryLogReader
+    {
+    private:
+        struct site_info
+        {
+            uint32_t        fileName;
+            unsigned long   line;
+            uint32_t        format;
+        };
+
+        std::istream&                       m_input;
+        std::map<uint32_t, std::string>     m_strings;
+        std::map<uint32_t, site_info>       m_sites;
+        std::map<unsigned int, uint32_t>    m_levels;
+        std::string                         m_data;
+        int64_t                             m_lastSeconds;
+        bool                                m_failed;
+
+        bool get(uint8_t& value)
+        {
+            char c;
+            if( !m_input.get(c) )
+                return false;
+            value = static_cast<uint8_t>(c);
+            return true;
+        }
+
+        template <typename T>
+        bool getVarint(T& value)
+        {
+            uint64_t result = 0;
+            for( unsigned int shift = 0; shift < 64; shift += 7 )
+            {
+                uint8_t byte;
+                if( !get(byte) )
+                    return false;
+
+                result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if( !(byte & 0x80) )
+                {
+                    value = static_cast<T>(result);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // The length may be damaged, so this only grows "out" as the data
+        // turns up.
+        bool getBytes(std::string& out, uint32_t length)
+        {
+            char chunk[4096];
+
+            out.clear();
+            while( length > 0 )
+            {
+                uint32_t piece = std::min<uint32_t>(length, sizeof(chunk));
+                if( !m_input.read(chunk, piece) )
+                    return false;
+                out.append(chunk, piece);
+                length -= piece;
+            }
+            return true;
+        }
+
+        const std::string& lookup(uint32_t id)
+        {
+            static const std::string s_empty;
+            std::map<uint32_t, std::string>::const_iterator it = m_strings.find(id);
+            return it != m_strings.end() ? it->second : s_empty;
+        }
+
+        bool fail()
+        {
+            m_failed = true;
+            return false;
+        }
+
+        bool readFileHeader()
+        {
+            char header[BinaryFileLogger::k_fileHeaderLength];
+            header[0] = BinaryFileLogger::fileHeader()[0];
+            if( !m_input.read(header + 1, sizeof(header) - 1) ||
+                memcmp(header, BinaryFileLogger::fileHeader(), sizeof(header)) != 0 )
+                return false;
+
+            // Each header starts a new dictionary.
+            m_strings.clear();
+            m_sites.clear();
+            m_levels.clear();
+            m_lastSeconds = 0;
+            return true;
+        }
+
+        void writeMessage(std::string& text, uint32_t siteId, uint8_t level, uint8_t flags,
+                          uint32_t idPrefix)
+        {
+            std::ostringstream out;
+
+            site_info site = { 0, 0, 0 };
+            std::map<uint32_t, site_info>::const_iterator found = m_sites.find(siteId);
+            if( found != m_sites.end() )
+                site = found->second;
+
+            if( !(flags & BinaryFileLogger::RF_RAW) )
+            {
+                std::map<unsigned int, uint32_t>::const_iterator it = m_levels.find(level);
+                std::string levelName = it != m_levels.end() ? lookup(it->second) : "OTHER";
+
+                out << lookup(idPrefix)
+                    << std::setfill(' ') << std::setw(5) << std::left << levelName << " - "
+                    << lookup(site.fileName) << "(" << site.line << "): ";
+            }
+
+            if( flags & BinaryFileLogger::RF_DEFERRED )
+            {
+#ifdef CPPLOG_DEFERRED_FORMAT
+                helpers::format_captured(out, lookup(site.format).c_str(),
+                                         m_data.data(), m_data.data() + m_data.size());
+#else
+                out << lookup(site.format);
+#endif
+                text += out.str();
+                if( text.empty() || text[text.length() - 1] != '\n' )
+                    text += '\n';
+            }
+            else
+            {
+                out << m_data;
+                text += out.str();
+            }
+        }
+
+    public:
+        explicit BinaryLogReader(std::istream& input)
+            : m_input(input), m_lastSeconds(0), m_failed(false)
+        { }
+
+        // Whether reading stopped because the file was damaged, rather than
+        // because it ended.
+        bool failed() const
+        {
+            return m_failed;
+        }
+
+        // Reads the next message into "text", optionally preceded by its
+        // (UTC) time.  Returns false once there are none left.
+        bool next(std::string& text, bool withTime = false)
+        {
+            text.clear();
+
+            char tag;
+            while( m_input.get(tag) )
+            {
+                switch( tag )
+                {
+                    case '\x7f':
+                        if( !readFileHeader() )
+                            return fail();
+                        break;
+
+                    case 'S':
+                    {
+                        uint32_t id, length;
+                        if( !getVarint(id) || !getVarint(length) || !getBytes(m_strings[id], length) )
+                            return fail();
+                        break;
+                    }
+
+                    case 'L':
+                    {
+                        uint8_t level;
+                        uint32_t name;
+                        if( !get(level) || !getVarint(name) )
+                            return fail();
+                        m_levels[level] = name;
+                        break;
+                    }
+
+                    case 'C':
+                    {
+                        uint32_t id;
+                        site_info site;
+                        if( !getVarint(id) || !getVarint(site.fileName) || !getVarint(site.line) ||
+                            !getVarint(site.format) )
+                            return fail();
+                        m_sites[id] = site;
+                        break;
+                    }
+
+                    case 'R':
+                    {
+                        uint32_t site, idPrefix, length;
+                        unsigned long nanoseconds;
+                        uint64_t delta;
+                        uint8_t level, flags;
+                        if( !getVarint(site) || !get(level) || !get(flags) || !getVarint(idPrefix) ||
+                            !getVarint(delta) || !getVarint(nanoseconds) || !getVarint(length) ||
+                            !getBytes(m_data, length) )
+                            return fail();
+
+                        // Undo the zig-zag encoding.
+                        m_lastSeconds += static_cast<int64_t>(delta >> 1) ^ -static_cast<int64_t>(delta & 1);
+                        int64_t seconds = m_lastSeconds;
+
+                        if( withTime )
+                        {
+                            char formatted[helpers::timestamp_cache::k_formattedLength + 1];
+                            helpers::timestamp_cache::format(formatted, static_cast<time_t>(seconds),
+                                                             nanoseconds, false);
+                            text += formatted;
+                            text += ' ';
+                        }
+
+                        writeMessage(text, site, level, flags, idPrefix);
+                        return true;
+                    }
+
+                    default:
+                        return fail();
+                }
+            }
+
+            return false;
+        }
+    };
+}
+
+#endif
@@ -10,14 +10,52 @@ class concurrent_queue
 {
 private:
     std::queue<Data> the_queue;
+    size_t the_capacity;
     mutable boost::mutex the_mutex;
     boost::condition_variable the_condition_variable;
+    boost::condition_variable the_not_full_condition_variable;
+
+    void popped()
+    {
+        if( the_capacity )
+            the_not_full_condition_variable.notify_all();
+    }
+
 public:
+    // A capacity of 0 means the queue is unbounded.
+    concurrent_queue()
+        : the_capacity(0)
+    { }
+
+    explicit concurrent_queue(size_t capacity)
+        : the_capacity(capacity)
+    { }
+
+    // Blocks while the queue is full.
     void push(Data const& data)
+    {
+        boost::unique_lock<boost::mutex> lock(the_mutex);
+
+        while( the_capacity && the_queue.size() >= the_capacity )
+        {
+            the_not_full_condition_variable.wait(lock);
+        }
+
+        the_queue.push(data);
+        the_condition_variable.notify_one();
+    }
+
+    bool try_push(Data const& data)
     {
         boost::lock_guard<boost::mutex> lock(the_mutex);
+        if( the_capacity && the_queue.size() >= the_capacity )
+        {
+            return false;
+        }
+
         the_queue.push(data);
         the_condition_variable.notify_one();
+        return true;
     }
 
     bool empty() const
@@ -36,6 +74,7 @@ public:
 
         popped_value = the_queue.front();
         the_queue.pop();
+        popped();
         return true;
     }
 
@@ -50,6 +89,27 @@ public:
 
         popped_value = the_queue.front();
         the_queue.pop();
+        popped();
+    }
+
+    // Waits for data, then pops everything available (up to "max" items)
+    // under a single lock.
+    template<typename Container>
+    void wait_and_pop_all(Container& popped_values, size_t max)
+    {
+        boost::unique_lock<boost::mutex> lock(the_mutex);
+
+        while( the_queue.empty() )
+        {
+            the_condition_variable.wait(lock);
+        }
+
+        while( !the_queue.empty() && max-- > 0 )
+        {
+            popped_values.push_back(the_queue.front());
+            the_queue.pop();
+        }
+        popped();
     }
 
 };
@@ -11,7 +11,13 @@
 #include <cstring>
 #include <ctime>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <limits>
 #include <cstdlib>
+#include <cstdio>
+#include <stdint.h>
 #include <streambuf>
 #include <ostream>
 
@@ -46,6 +52,34 @@
 //      # define CPPLOG_USE_OLD_BOOST
 //          Use the old Boost namespace for interprocess::ipcdetail.  Define
 //          this if you're using version 1.47 of Boost or earlier.
+//
+//      #define CPPLOG_LOGDATA_POOL
+//          Recycles LogData objects through per-thread free lists (backed by a
+//          global overflow pool) instead of allocating one for every message.
+//          NOTE: Only useful if you also #define CPPLOG_THREADING
+//
+//      #define CPPLOG_POOL_HUGE_PAGES
+//          Carves pooled LogData objects out of huge pages, where the system
+//          has any available.  Linux only.
+//          NOTE: Only useful if you also #define CPPLOG_LOGDATA_POOL
+//
+//      #define CPPLOG_METRICS
+//          Counts, for every logger, the messages (and bytes) it's given,
+//          filters out, drops and fails to write, and for BackgroundLogger
+//          its queue depth and write latencies.  See BaseLogger::getMetrics()
+//          and MetricsDumper.
+//          NOTE: Only useful if you also #define CPPLOG_THREADING
+//
+//      #define CPPLOG_WITH_SCRIBE_LOGGER
+//          Enables ScribeLogger, which needs Apache Thrift and the Thrift
+//          code generated for Scribe (gen-cpp/scribe.h).
+//          NOTE: Only useful if you also #define CPPLOG_THREADING
+//
+//      #define CPPLOG_WITH_ZLIB
+//      #define CPPLOG_WITH_ZSTD
+//          Lets LogArchiver compress rotated logs with gzip (link with -lz)
+//          or zstd (link with -lzstd).
+//          NOTE: Only useful if you also #define CPPLOG_THREADING
 
 // ------------------------------- DEFINITIONS -------------------------------
 
@@ -77,6 +111,12 @@
 #define CPPLOG_FATAL_EXIT
 //#define CPPLOG_FATAL_EXIT_DEBUG
 //#define CPPLOG_USE_OLD_BOOST
+//#define CPPLOG_LOGDATA_POOL
+//#define CPPLOG_POOL_HUGE_PAGES
+//#define CPPLOG_METRICS
+//#define CPPLOG_WITH_SCRIBE_LOGGER
+//#define CPPLOG_WITH_ZLIB
+//#define CPPLOG_WITH_ZSTD
 
 
 // ---------------------------------- CODE -----------------------------------
@@ -87,15 +127,76 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #endif
 
 #ifdef CPPLOG_THREADING
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include "concurrent_queue.hpp"
+#include "ring_queue.hpp"
+#include "per_thread_queue.hpp"
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef CPPLOG_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CPPLOG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// io_uring, for AsyncFileLogger.  It's called directly, so we only need
+// the kernel's header.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CPPLOG_HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+#endif
+
+// Metrics are kept in atomics, so they need threading support too.
+#if defined(CPPLOG_METRICS) && defined(CPPLOG_THREADING)
+#define CPPLOG_USE_METRICS
+#ifdef __linux__
+#include <sched.h>
+#endif
+#endif
+
+// The pool keeps its free lists per-thread, so it needs threading support.
+#if defined(CPPLOG_LOGDATA_POOL) && defined(CPPLOG_THREADING)
+#define CPPLOG_USE_LOGDATA_POOL
+#include <boost/thread/tss.hpp>
+#if defined(CPPLOG_POOL_HUGE_PAGES) && defined(__linux__)
+#define CPPLOG_USE_HUGE_PAGES
+#include <new>
+#include <sys/mman.h>
+#endif
+#endif
+
+// ScribeLogger sends from a background thread, so it needs threading support.
+#if defined(CPPLOG_WITH_SCRIBE_LOGGER) && !defined(CPPLOG_THREADING)
+#error "CPPLOG_WITH_SCRIBE_LOGGER needs CPPLOG_THREADING"
 #endif
 
 #ifdef _WIN32
 #include "outputdebugstream.hpp"
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 #ifdef CPPLOG_WITH_SCRIBE_LOGGER
@@ -114,6 +215,28 @@
 #define CPPLOG_NOEXCEPT_FALSE
 #endif
 
+// Thread-local storage for plain-old-data.
+#if __cplusplus >= 201103L
+#define CPPLOG_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define CPPLOG_THREAD_LOCAL __declspec(thread)
+#else
+#define CPPLOG_THREAD_LOCAL __thread
+#endif
+
+// Deferred formatting (LOGF) needs variadic templates.
+#if __cplusplus >= 201103L
+#define CPPLOG_DEFERRED_FORMAT
+#endif
+
+// Tunables for the LogData pool.
+#ifndef CPPLOG_POOL_THREAD_CACHE
+#define CPPLOG_POOL_THREAD_CACHE    32
+#endif
+#ifndef CPPLOG_POOL_GLOBAL_LIMIT
+#define CPPLOG_POOL_GLOBAL_LIMIT    1024
+#endif
+
 
 // The general concept for how logging works:
 //  - Every call to LOG(LEVEL, logger) works as follows:
@@ -185,6 +308,173 @@ namespace cpplog
 #endif
         }
 
+        // Gets the current wall-clock time, with sub-second precision where
+        // the platform has it.  On Linux, clock_gettime() is answered from
+        // the vDSO without entering the kernel, so this costs no more than
+        // reading a monotonic clock would.
+        inline void get_time(::time_t& seconds, unsigned long& nanoseconds)
+        {
+#if defined(_WIN32)
+            seconds = ::time(NULL);
+            nanoseconds = 0;
+#else
+            struct timespec now;
+            ::clock_gettime(CLOCK_REALTIME, &now);
+
+            seconds = now.tv_sec;
+            nanoseconds = static_cast<unsigned long>(now.tv_nsec);
+#endif
+        }
+
+        // Writes "value" as exactly "width" decimal digits.
+        inline void write_digits(char* out, unsigned long value, int width)
+        {
+            for( int i = width - 1; i >= 0; i-- )
+            {
+                out[i] = static_cast<char>('0' + value % 10);
+                value /= 10;
+            }
+        }
+
+        // Digit tables for the writers below.
+        inline const char* decimal_pairs()
+        {
+            return "00010203040506070809"
+                   "10111213141516171819"
+                   "20212223242526272829"
+                   "30313233343536373839"
+                   "40414243444546474849"
+                   "50515253545556575859"
+                   "60616263646566676869"
+                   "70717273747576777879"
+                   "80818283848586878889"
+                   "90919293949596979899";
+        }
+
+        inline const char* hex_digits()
+        {
+            return "0123456789abcdef";
+        }
+
+        // Writes "value" in decimal.  Returns the number of chars written;
+        // "out" needs room for 20.
+        inline size_t write_decimal(char* out, unsigned long value)
+        {
+            char temp[24];
+            char* p = temp + sizeof(temp);
+
+            while( value >= 100 )
+            {
+                const char* pair = decimal_pairs() + (value % 100) * 2;
+                value /= 100;
+                *--p = pair[1];
+                *--p = pair[0];
+            }
+            if( value >= 10 )
+            {
+                const char* pair = decimal_pairs() + value * 2;
+                *--p = pair[1];
+                *--p = pair[0];
+            }
+            else
+            {
+                *--p = static_cast<char>('0' + value);
+            }
+
+            size_t length = static_cast<size_t>(temp + sizeof(temp) - p);
+            memcpy(out, p, length);
+            return length;
+        }
+
+        // Writes "value" in lowercase hex, zero-padded to at least "minWidth"
+        // digits.  Returns the number of chars written; "out" needs room for
+        // max(minWidth, 2 * sizeof(unsigned long)).
+        inline size_t write_hex(char* out, unsigned long value, size_t minWidth)
+        {
+            size_t length = 0;
+            for( unsigned long v = value; v != 0; v >>= 4 )
+                length++;
+            if( length < minWidth )
+                length = minWidth;
+
+            for( size_t i = length; i != 0; i-- )
+            {
+                out[i - 1] = hex_digits()[value & 0xF];
+                value >>= 4;
+            }
+            return length;
+        }
+
+        // Caches the broken-down and formatted forms of the current second,
+        // per-thread, so that converting a timestamp is a comparison and a
+        // copy for every message except the first one in each second.
+        class timestamp_cache
+        {
+        private:
+            struct entry
+            {
+                bool        valid;
+                ::time_t    second;
+                ::tm        time;
+                char        text[20];       // "YYYY-MM-DD HH:MM:SS"
+            };
+
+            static entry& lookup(::time_t second, bool localTime)
+            {
+                static CPPLOG_THREAD_LOCAL entry t_entries[2];
+                entry& e = t_entries[localTime ? 1 : 0];
+
+                if( !e.valid || e.second != second )
+                {
+                    if( localTime )
+                        slocaltime(&e.time, &second);
+                    else
+                        sgmtime(&e.time, &second);
+
+                    write_digits(e.text,      e.time.tm_year + 1900, 4);
+                    e.text[4] = '-';
+                    write_digits(e.text + 5,  e.time.tm_mon + 1, 2);
+                    e.text[7] = '-';
+                    write_digits(e.text + 8,  e.time.tm_mday, 2);
+                    e.text[10] = ' ';
+                    write_digits(e.text + 11, e.time.tm_hour, 2);
+                    e.text[13] = ':';
+                    write_digits(e.text + 14, e.time.tm_min, 2);
+                    e.text[16] = ':';
+                    write_digits(e.text + 17, e.time.tm_sec, 2);
+                    e.text[19] = '\0';
+
+                    e.second = second;
+                    e.valid = true;
+                }
+
+                return e;
+            }
+
+        public:
+            // Length of the text written by format(), not counting the
+            // terminating null.
+            static const size_t k_formattedLength = 26;
+
+            // Like sgmtime() / slocaltime().
+            static void breakDown(::tm* out, ::time_t second, bool localTime)
+            {
+                memcpy(out, &lookup(second, localTime).time, sizeof(::tm));
+            }
+
+            // Writes "YYYY-MM-DD HH:MM:SS.uuuuuu" and a terminating null to
+            // "out", which must have room for k_formattedLength + 1 chars.
+            static size_t format(char* out, ::time_t second, unsigned long nanoseconds, bool localTime)
+            {
+                memcpy(out, lookup(second, localTime).text, 19);
+                out[19] = '.';
+                write_digits(out + 20, nanoseconds / 1000, 6);
+                out[k_formattedLength] = '\0';
+
+                return k_formattedLength;
+            }
+        };
+
         // Below we have a bunch of macros, typedefs and such that make getting our
         // current process/thread ID simpler.
 #ifdef CPPLOG_SYSTEM_IDS
@@ -217,6 +507,13 @@ namespace cpplog
             stream << std::setfill('0') << std::setw(8) << std::hex
                    << thread_id;
         }
+
+        // Same as print_thread_id(), without the stream.  Returns the number
+        // of chars written.
+        inline size_t write_thread_id(char* out, thread_id_t thread_id)
+        {
+            return write_hex(out, thread_id, 8);
+        }
 #else   // CPPLOG_USE_SYSCALL_FOR_THREAD_ID
 #ifdef CPPLOG_USE_OLD_BOOST
         typedef boost::interprocess::detail::OS_thread_id_t     thread_id_t;
@@ -252,7 +549,128 @@ namespace cpplog
                        << static_cast<unsigned>(sptr[i - 1]);
             }
         }
+
+        // Same as print_thread_id(), without the stream.  Returns the number
+        // of chars written.
+        inline size_t write_thread_id(char* out, thread_id_t thread_id)
+        {
+            unsigned char* sptr = static_cast<unsigned char*>(
+                                    static_cast<void*>(&thread_id)
+                                  );
+            for( size_t i = sizeof(thread_id_t); i != 0; i-- )
+            {
+                *out++ = hex_digits()[sptr[i - 1] >> 4];
+                *out++ = hex_digits()[sptr[i - 1] & 0xF];
+            }
+            return 2 * sizeof(thread_id_t);
+        }
 #endif  // CPPLOG_USE_SYSCALL_FOR_THREAD_ID
+
+        // Per-thread cache of the current process/thread ID, along with the
+        // "[pppppppp.tttttttt] " prefix the default header starts with, so
+        // that neither has to be fetched or formatted for every message.  A
+        // fork() bumps a generation count, which makes the child re-read its
+        // IDs the next time it logs.
+        class thread_ids
+        {
+        public:
+            static const size_t k_maxNameLength = 15;
+            static const size_t k_maxPrefixLength = 24 + 2 * sizeof(thread_id_t) + k_maxNameLength;
+
+            struct entry
+            {
+                bool            valid;
+                unsigned long   generation;
+                process_id_t    processId;
+                thread_id_t     threadId;
+                char            name[k_maxNameLength + 1];
+                size_t          prefixLength;
+                char            prefix[k_maxPrefixLength];
+            };
+
+            // Returns this thread's (up-to-date) entry.
+            static const entry& current()
+            {
+                entry& e = local();
+                if( !e.valid || e.generation != generation() )
+                    refresh(e);
+                return e;
+            }
+
+            // Sets a name that is shown after the IDs, in this thread's
+            // messages.  Longer names are truncated; NULL or "" clears it.
+            static void setName(const char* name)
+            {
+                entry& e = local();
+                size_t length = name ? strlen(name) : 0;
+                if( length > k_maxNameLength )
+                    length = k_maxNameLength;
+
+                if( length > 0 )
+                    memcpy(e.name, name, length);
+                e.name[length] = '\0';
+                refresh(e);
+            }
+
+            // Writes "[pppppppp.tttttttt name] " into "out", which must have
+            // room for k_maxPrefixLength chars.  Returns the number of chars
+            // written.
+            static size_t render(char* out, process_id_t processId, thread_id_t threadId,
+                                 const char* name)
+            {
+                char* p = out;
+
+                *p++ = '[';
+                p += write_hex(p, static_cast<unsigned long>(processId), 8);
+                *p++ = '.';
+                p += write_thread_id(p, threadId);
+                if( name[0] != '\0' )
+                {
+                    size_t length = strlen(name);
+                    *p++ = ' ';
+                    memcpy(p, name, length);
+                    p += length;
+                }
+                *p++ = ']';
+                *p++ = ' ';
+
+                return p - out;
+            }
+
+        private:
+            static entry& local()
+            {
+                static CPPLOG_THREAD_LOCAL entry t_entry;
+                return t_entry;
+            }
+
+            static unsigned long& generation()
+            {
+                static unsigned long s_generation = 0;
+                return s_generation;
+            }
+
+            // Only ever called in a freshly-forked child, which has a single
+            // thread at that point.
+            static void onFork()
+            {
+                generation()++;
+            }
+
+            static void refresh(entry& e)
+            {
+#ifndef _WIN32
+                static bool s_registered = (::pthread_atfork(NULL, NULL, &thread_ids::onFork) == 0);
+                (void)s_registered;
+#endif
+
+                e.generation    = generation();
+                e.processId     = get_process_id();
+                e.threadId      = get_thread_id();
+                e.prefixLength  = render(e.prefix, e.processId, e.threadId, e.name);
+                e.valid         = true;
+            }
+        };
 #endif  // CPPLOG_SYSTEM_IDS
 
         // Simple class that allows us to evaluate a stream to void - prevents compiler errors.
@@ -263,25 +681,185 @@ namespace cpplog
             void operator&(std::ostream&) { }
         };
 
-        // fixed_streambuf is a minimal implementation around std::basic_streambuf
-        // with a fixed size backing buffer. It implements additional functionality
-        // needed by cpplog and exposes the backing buffer in a safe way via c_str().
-        // This makes it possible to avoid extra copying.
-        class fixed_streambuf : public std::basic_streambuf<char, std::char_traits<char> >
+        // log_streambuf is a minimal implementation around std::basic_streambuf
+        // with a small inline backing buffer, which grows into larger pooled
+        // chunks (up to k_logBufferCapacity chars) for longer messages.  It
+        // implements additional functionality needed by cpplog and exposes
+        // the backing buffer via data() and length(), or c_str().  This
+        // makes it possible to avoid extra copying.
+        class log_streambuf : public std::basic_streambuf<char, std::char_traits<char> >
         {
         private:
-            // Constant.
+            // Constants.
             static const size_t k_logBufferCapacity = 20000;
+            static const size_t k_inlineCapacity    = 256;
+            static const int    k_numChunkSizes     = 3;
+            static const size_t k_maxPooledChunks   = 64;
+
+            static size_t chunkSize(int sizeClass)
+            {
+                static const size_t sizes[k_numChunkSizes] = { 1024, 4096, k_logBufferCapacity };
+                return sizes[sizeClass];
+            }
+
+            // Where our buffer came from.
+            // Anything else is a chunk size class.
+            enum
+            {
+                BUFFER_INLINE   = -2,       // m_inline
+                BUFFER_EXACT    = -1        // new[]'d to fit by compact()
+            };
+
             // Leave room for terminating null character in case buffer fills up.
-            char m_buffer[k_logBufferCapacity+1];
+            char    m_inline[k_inlineCapacity+1];
+            int     m_source;
+
+#ifdef CPPLOG_USE_LOGDATA_POOL
+            struct chunk_list
+            {
+                boost::mutex        lock;
+                std::vector<char*>  chunks;
+
+                chunk_list() { chunks.reserve(k_maxPooledChunks); }
+            };
+
+            static chunk_list& chunkList(int sizeClass)
+            {
+                // Never destroyed - see LogData::arena().
+                static chunk_list* s_lists = new chunk_list[k_numChunkSizes];
+                return s_lists[sizeClass];
+            }
+
+            static char* allocateChunk(int sizeClass)
+            {
+                chunk_list& list = chunkList(sizeClass);
+                {
+                    boost::lock_guard<boost::mutex> lock(list.lock);
+                    if( !list.chunks.empty() )
+                    {
+                        char* chunk = list.chunks.back();
+                        list.chunks.pop_back();
+                        return chunk;
+                    }
+                }
+
+                return new char[chunkSize(sizeClass) + 1];
+            }
+
+            static void freeChunk(char* chunk, int sizeClass)
+            {
+                chunk_list& list = chunkList(sizeClass);
+                {
+                    boost::lock_guard<boost::mutex> lock(list.lock);
+                    if( list.chunks.size() < k_maxPooledChunks )
+                    {
+                        list.chunks.push_back(chunk);
+                        return;
+                    }
+                }
+
+                delete[] chunk;
+            }
+#else
+            static char* allocateChunk(int sizeClass)
+            {
+                return new char[chunkSize(sizeClass) + 1];
+            }
+
+            static void freeChunk(char* chunk, int /* sizeClass */)
+            {
+                delete[] chunk;
+            }
+#endif
+
+            // Switches to the given buffer, keeping the first "keep" chars.
+            void setBuffer(char* buffer, size_t capacity, int source, size_t keep)
+            {
+                if( keep )
+                    memmove(buffer, pbase(), keep);
+
+                releaseBuffer();
+
+                setp(buffer, buffer + capacity);
+                pbump(static_cast<int>(keep));
+
+                // Insert terminator at buffer end.
+                buffer[capacity] = '\0';
+                m_source = source;
+            }
+
+            void releaseBuffer()
+            {
+                if( m_source == BUFFER_EXACT )
+                    delete[] pbase();
+                else if( m_source != BUFFER_INLINE )
+                    freeChunk(pbase(), m_source);
+
+                m_source = BUFFER_INLINE;
+            }
+
+        protected:
+            // Out of room - move to the next chunk size up, if there is one.
+            virtual int_type overflow(int_type c)
+            {
+                if( traits_type::eq_int_type(c, traits_type::eof()) )
+                    return traits_type::not_eof(c);
+
+                size_t used = static_cast<size_t>(length());
+                if( used >= k_logBufferCapacity )
+                    return traits_type::eof();
+
+                int sizeClass = 0;
+                while( chunkSize(sizeClass) <= used )
+                    sizeClass++;
+
+                setBuffer(allocateChunk(sizeClass), chunkSize(sizeClass), sizeClass, used);
+                return sputc(traits_type::to_char_type(c));
+            }
 
         public:
-            fixed_streambuf()
+            log_streambuf()
+                : m_source(BUFFER_INLINE)
             {
-                // Use allocated buffer as backing store.
-                setp(m_buffer, m_buffer + k_logBufferCapacity);
+                // Use inline buffer as backing store.
+                setp(m_inline, m_inline + k_inlineCapacity);
                 // Insert terminator at buffer end.
-                m_buffer[k_logBufferCapacity] = '\0';
+                m_inline[k_inlineCapacity] = '\0';
+            }
+
+            virtual ~log_streambuf()
+            {
+                releaseBuffer();
+            }
+
+            // Discard everything written so far, and go back to the inline
+            // buffer.
+            void reset()
+            {
+                releaseBuffer();
+                setp(m_inline, m_inline + k_inlineCapacity);
+            }
+
+            // Move a message that grew into a chunk much bigger than it
+            // needs into a smaller one, and give the chunk back.  Used before
+            // a message sits in a queue for a while.  A smaller pooled chunk
+            // is used if one fits; otherwise, only the largest chunks are
+            // traded for an exact-size buffer, and only if they're more than
+            // half empty.
+            void compact()
+            {
+                if( m_source < 0 )
+                    return;
+
+                size_t used = static_cast<size_t>(length());
+                int sizeClass = 0;
+                while( chunkSize(sizeClass) < used )
+                    sizeClass++;
+
+                if( sizeClass < m_source )
+                    setBuffer(allocateChunk(sizeClass), chunkSize(sizeClass), sizeClass, used);
+                else if( m_source == k_numChunkSizes - 1 && used < chunkSize(m_source) / 2 )
+                    setBuffer(new char[used + 1], used, BUFFER_EXACT, used);
             }
 
             std::streamsize length()   const { return pptr() - pbase();       }
@@ -311,746 +889,6300 @@ namespace cpplog
                 return static_cast<int>(*(pptr()-1));
             }
 
-            const char* c_str() const
+            // The message so far, not null-terminated.  Safe to call on a
+            // message shared between threads.
+            const char* data() const
+            {
+                return pbase();
+            }
+
+            // Null-terminates the message so far.  This is safe even if the
+            // buffer is full to its capacity since epptr() is inside the
+            // backing buffer.  LogMessage does this before sending a message.
+            void terminate()
             {
-                // Add terminating null character.
-                // This is safe even if the buffer is full to its capacity since
-                // epptr() is inside the backing buffer.
                 *pptr() = '\0';
+            }
+
+            // The message, null-terminated.  Messages that have been sent
+            // already are, so this only reads them and is safe to call on a
+            // shared message; whoever is still writing one gets a terminator
+            // written.
+            const char* c_str() const
+            {
+                if( *pptr() != '\0' )
+                    *pptr() = '\0';
                 return pbase();
             }
         };
-    }
 
-    // Logger data.  This is sent to a logger when a LogMessage is Flush()'ed, or
-    // when the destructor is called.
-    struct LogData
-    {
+        // Older name for log_streambuf.
+        typedef log_streambuf fixed_streambuf;
 
-        // Our streambuf & stream to log data to.
-        helpers::fixed_streambuf streamBuffer;
-        std::ostream stream;
+#ifdef CPPLOG_DEFERRED_FORMAT
+        // A LOGF() call site.  Each one lives in static storage at the call
+        // site, so its address also identifies the call site.
+        struct format_site
+        {
+            const char*     file;
+            unsigned long   line;
+            const char*     format;
+        };
 
-        // Captured data.
-        unsigned int level;
-        unsigned long line;
-        const char* fullPath;
-        const char* fileName;
-        time_t messageTime;
-        ::tm utcTime;
+        // LOGF() arguments are captured as a one-char type tag followed by
+        // the raw value, and only turned into text later on (usually on the
+        // BackgroundLogger's thread).
+        enum format_arg_tag
+        {
+            FA_SIGNED   = 'i',      // long long
+            FA_UNSIGNED = 'u',      // unsigned long long
+            FA_DOUBLE   = 'd',      // double
+            FA_CHAR     = 'c',      // char
+            FA_BOOL     = 'b',      // bool
+            FA_POINTER  = 'p',      // const void*
+            FA_STRING   = 's'       // unsigned int length, then the chars
+        };
 
-#ifdef CPPLOG_SYSTEM_IDS
-        // Process/thread ID.
-        helpers::process_id_t processId;
-        helpers::thread_id_t  threadId;
-#endif
+        inline void encode_format_arg(log_streambuf& sb, char tag, const void* value, size_t size)
+        {
+            sb.sputc(tag);
+            sb.sputn(static_cast<const char*>(value), static_cast<std::streamsize>(size));
+        }
 
+        inline void encode_format_string(log_streambuf& sb, const char* value, size_t length)
+        {
+            unsigned int stored = static_cast<unsigned int>(length);
+            encode_format_arg(sb, FA_STRING, &stored, sizeof(stored));
+            sb.sputn(value, static_cast<std::streamsize>(length));
+        }
 
-        // Constructor that initializes our stream.
-        LogData(loglevel_t logLevel)
-            : streamBuffer(), stream(&streamBuffer), level(logLevel)
-#ifdef CPPLOG_SYSTEM_IDS
-              , processId(0), threadId(0)
-#endif
+        inline void encode_format_signed(log_streambuf& sb, long long value)
         {
+            encode_format_arg(sb, FA_SIGNED, &value, sizeof(value));
         }
 
-        virtual ~LogData()
-        { }
-    };
+        inline void encode_format_unsigned(log_streambuf& sb, unsigned long long value)
+        {
+            encode_format_arg(sb, FA_UNSIGNED, &value, sizeof(value));
+        }
 
-    // Base interface for a logger.
-    class BaseLogger
-    {
-    public:
-        // All loggers must provide an interface to log a message to.
-        // The return value of this function indicates whether to delete
-        // the log message.
-        virtual bool sendLogMessage(LogData* logData) = 0;
+        inline void encode_format_value(log_streambuf& sb, bool value)              { encode_format_arg(sb, FA_BOOL, &value, sizeof(value)); }
+        inline void encode_format_value(log_streambuf& sb, char value)              { encode_format_arg(sb, FA_CHAR, &value, sizeof(value)); }
+        inline void encode_format_value(log_streambuf& sb, signed char value)       { encode_format_value(sb, static_cast<char>(value)); }
+        inline void encode_format_value(log_streambuf& sb, unsigned char value)     { encode_format_value(sb, static_cast<char>(value)); }
+        inline void encode_format_value(log_streambuf& sb, short value)             { encode_format_signed(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, int value)               { encode_format_signed(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, long value)              { encode_format_signed(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, long long value)         { encode_format_signed(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, unsigned short value)    { encode_format_unsigned(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, unsigned int value)      { encode_format_unsigned(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, unsigned long value)     { encode_format_unsigned(sb, value); }
+        inline void encode_format_value(log_streambuf& sb, unsigned long long value){ encode_format_unsigned(sb, value); }
+
+        inline void encode_format_value(log_streambuf& sb, double value)
+        {
+            encode_format_arg(sb, FA_DOUBLE, &value, sizeof(value));
+        }
 
-        virtual ~BaseLogger() { }
-    };
+        inline void encode_format_value(log_streambuf& sb, float value)             { encode_format_value(sb, static_cast<double>(value)); }
+        inline void encode_format_value(log_streambuf& sb, long double value)       { encode_format_value(sb, static_cast<double>(value)); }
 
-    // Log message - this is instantiated upon every call to LOG(logger)
-    class LogMessage
-    {
-    private:
-        BaseLogger*     m_logger;
-        bool            m_flushed;
-        bool            m_deleteMessage;
-
-    protected:
-        LogData*        m_logData;
+        inline void encode_format_value(log_streambuf& sb, const void* value)
+        {
+            encode_format_arg(sb, FA_POINTER, &value, sizeof(value));
+        }
 
-    private:
-        // Flag for if a fatal message has been logged already.
-        // This prevents us from calling exit(), which calls something,
-        // which then logs a fatal message, which cause an infinite loop.
-        // TODO: this should probably be thread-safe...
-        static bool getSetFatal(bool get, bool val)
+        template <typename T>
+        inline void encode_format_value(log_streambuf& sb, T* value)
         {
-            static bool m_fatalFlag = false;
+            encode_format_value(sb, static_cast<const void*>(value));
+        }
 
-            if( !get )
-                m_fatalFlag = val;
+        // Strings are copied, since they may be gone by the time we format.
+        inline void encode_format_value(log_streambuf& sb, const char* value)
+        {
+            if( value )
+                encode_format_string(sb, value, strlen(value));
+            else
+                encode_format_string(sb, "(null)", 6);
+        }
 
-            return m_fatalFlag;
+        inline void encode_format_value(log_streambuf& sb, char* value)
+        {
+            encode_format_value(sb, static_cast<const char*>(value));
         }
 
-    public:
-        LogMessage(const char* file, unsigned int line, loglevel_t logLevel, BaseLogger* outputLogger, bool useDefaultLogFormat=true)
-            : m_logger(outputLogger)
+        inline void encode_format_value(log_streambuf& sb, const std::string& value)
         {
-            Init(file, line, logLevel, useDefaultLogFormat);
+            encode_format_string(sb, value.data(), value.length());
         }
 
-        LogMessage(const char* file, unsigned int line, loglevel_t logLevel, BaseLogger& outputLogger, bool useDefaultLogFormat=true)
-            : m_logger(&outputLogger)
+        // Anything else is formatted right away, with its operator<<.
+        template <typename T>
+        inline void encode_format_value(log_streambuf& sb, const T& value)
         {
-            Init(file, line, logLevel, useDefaultLogFormat);
+            std::ostringstream formatted;
+            formatted << value;
+            encode_format_value(sb, formatted.str());
         }
 
-        virtual ~LogMessage() CPPLOG_NOEXCEPT_FALSE
+        inline void encode_format_args(log_streambuf& /* sb */)
+        { }
+
+        template <typename T, typename... Rest>
+        inline void encode_format_args(log_streambuf& sb, const T& value, const Rest&... rest)
         {
-            Flush();
+            encode_format_value(sb, value);
+            encode_format_args(sb, rest...);
+        }
 
-            if( m_deleteMessage )
+        // Writes the text of "format" up to the next "{}" placeholder, and
+        // steps past it.  "{{" and "}}" are written as single braces.
+        // Returns false if we reached the end of the string instead.
+        inline bool next_placeholder(std::ostream& stream, const char*& format)
+        {
+            const char* run = format;
+            for( ;; )
             {
-                delete m_logData;
+                char c = *format;
+                if( c == '\0' )
+                {
+                    stream.write(run, format - run);
+                    return false;
+                }
+                else if( (c == '{' || c == '}') && format[1] == c )
+                {
+                    stream.write(run, format - run + 1);
+                    format += 2;
+                    run = format;
+                }
+                else if( c == '{' && format[1] == '}' )
+                {
+                    stream.write(run, format - run);
+                    format += 2;
+                    return true;
+                }
+                else
+                {
+                    format++;
+                }
             }
         }
 
-        inline std::ostream& getStream()
+        // Reads "size" bytes of a captured argument.  Fails if the message
+        // was cut short.
+        inline bool read_format_arg(const char*& args, const char* end, void* out, size_t size)
         {
-            return m_logData->stream;
+            if( static_cast<size_t>(end - args) < size )
+                return false;
+
+            memcpy(out, args, size);
+            args += size;
+            return true;
         }
 
-    protected:
-        virtual void InitLogMessage()
+        // Writes one captured argument to the stream.  Returns false if
+        // there are no (complete) arguments left.
+        inline bool write_format_arg(std::ostream& stream, const char*& args, const char* end)
         {
-            // Log process ID and thread ID.
-#ifdef CPPLOG_SYSTEM_IDS
-            m_logData->stream << "["
-                        << std::right << std::setfill('0') << std::setw(8) << std::hex
-                        << m_logData->processId << ".";
-            helpers::print_thread_id(m_logData->stream, m_logData->threadId);
-            m_logData->stream << "] ";
-#endif
+            if( args >= end )
+                return false;
+
+            switch( *args++ )
+            {
+                case FA_SIGNED:
+                {
+                    long long value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_UNSIGNED:
+                {
+                    unsigned long long value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_DOUBLE:
+                {
+                    double value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_CHAR:
+                {
+                    char value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_BOOL:
+                {
+                    bool value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_POINTER:
+                {
+                    const void* value;
+                    if( !read_format_arg(args, end, &value, sizeof(value)) )
+                        return false;
+                    stream << value;
+                    return true;
+                }
+                case FA_STRING:
+                {
+                    unsigned int length;
+                    if( !read_format_arg(args, end, &length, sizeof(length)) )
+                        return false;
+
+                    // Write whatever made it into the message.
+                    if( length > static_cast<size_t>(end - args) )
+                        length = static_cast<unsigned int>(end - args);
+                    stream.write(args, length);
+                    args += length;
+                    return true;
+                }
+                default:
+                    args = end;
+                    return false;
+            }
+        }
 
-            m_logData->stream << std::setfill(' ') << std::setw(5) << std::left << std::dec
-                        << LogMessage::getLevelName(m_logData->level) << " - "
-                        << m_logData->fileName << "(" << m_logData->line << "): ";
+        // Writes "format" to the stream, with each "{}" replaced by the next
+        // captured argument from [args, end).  Extra arguments are ignored,
+        // and placeholders without one are written as-is.
+        inline void format_captured(std::ostream& stream, const char* format,
+                                    const char* args, const char* end)
+        {
+            while( next_placeholder(stream, format) )
+            {
+                if( !write_format_arg(stream, args, end) )
+                    stream << "{}";
+            }
         }
 
-    private:
-        void Init(const char* file, unsigned int line, loglevel_t logLevel, bool useDefaultLogFormat=true)
+        // Same as format_captured(), straight from the arguments.
+        inline void format_args(std::ostream& stream, const char* format)
         {
-            m_logData = new LogData(logLevel);
-            m_flushed = false;
-            m_deleteMessage = false;
+            while( next_placeholder(stream, format) )
+                stream << "{}";
+        }
 
-            // Capture data.
-            m_logData->fullPath     = file;
-            m_logData->fileName     = cpplog::helpers::fileNameFromPath(file);
-            m_logData->line         = line;
-            m_logData->messageTime  = ::time(NULL);
+        template <typename T, typename... Rest>
+        inline void format_args(std::ostream& stream, const char* format, const T& value, const Rest&... rest)
+        {
+            if( !next_placeholder(stream, format) )
+                return;
 
-            // Get current time.
-            ::tm gmt;
-            cpplog::helpers::sgmtime(&gmt, &m_logData->messageTime);
-            memcpy(&m_logData->utcTime, &gmt, sizeof(tm));
+            stream << value;
+            format_args(stream, format, rest...);
+        }
 
-#ifdef CPPLOG_SYSTEM_IDS
-            // Get process/thread ID.
-            m_logData->processId    = helpers::get_process_id();
-            m_logData->threadId     = helpers::get_thread_id();
-#endif // CPPLOG_SYSTEM_IDS
+        template <typename... Rest>
+        inline void format_args(std::ostream& stream, const char* format, const char* value, const Rest&... rest)
+        {
+            if( !next_placeholder(stream, format) )
+                return;
 
-            if( useDefaultLogFormat )
-            {
-                InitLogMessage();
-            }
+            stream << (value ? value : "(null)");
+            format_args(stream, format, rest...);
         }
+#endif  // CPPLOG_DEFERRED_FORMAT
 
-        void Flush()
+#ifdef CPPLOG_USE_HUGE_PAGES
+        // Hands out fixed-size blocks carved from huge-page-backed slabs.
+        // Slabs are never returned to the system; freed blocks are kept on a
+        // free list for the next allocation.
+        class hugepage_arena
         {
-            if( !m_flushed )
+        private:
+            static const size_t k_slabSize = 2 * 1024 * 1024;
+
+            struct free_block
             {
-                // Insert newline, if needed.
-                helpers::fixed_streambuf* const sb = &m_logData->streamBuffer;
-                if( sb->peek() != '\n' )
-                {
-                    // If buffer is full, remove last char to leave room for newline.
-                    if( sb->full() )
-                        sb->sunputc();
+                free_block* next;
+            };
 
-                    // Insert newline
-                    sb->sputc('\n');
+            boost::mutex    m_lock;
+            size_t          m_blockSize;
+            free_block*     m_freeList;
+            char*           m_slabPos;
+            char*           m_slabEnd;
+
+            bool newSlab()
+            {
+                void* slab = ::mmap(NULL, k_slabSize, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if( slab == MAP_FAILED )
+                {
+                    // No reserved huge pages - ask for transparent ones instead.
+                    slab = ::mmap(NULL, k_slabSize, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if( slab == MAP_FAILED )
+                        return false;
+#ifdef MADV_HUGEPAGE
+                    ::madvise(slab, k_slabSize, MADV_HUGEPAGE);
+#endif
                 }
 
-                // Save the log level.
-                loglevel_t savedLogLevel = m_logData->level;
+                m_slabPos = static_cast<char*>(slab);
+                m_slabEnd = m_slabPos + k_slabSize;
+                return true;
+            }
 
-                // Send the message, set flushed=true.
-                m_deleteMessage = m_logger->sendLogMessage(m_logData);
-                m_flushed = true;
+        public:
+            hugepage_arena(size_t blockSize)
+                : m_blockSize((blockSize + 63) & ~static_cast<size_t>(63)),
+                  m_freeList(NULL), m_slabPos(NULL), m_slabEnd(NULL)
+            { }
 
-                // Note: We cannot touch m_logData after the above call.  By the
-                // time it returns, we have to assume it has already been freed.
+            size_t blockSize() const { return m_blockSize; }
 
-                // If this is a fatal message...
-                if( savedLogLevel == LL_FATAL && !getSetFatal(true, true) )
-                {
-                    // Set our fatal flag.
-                    getSetFatal(false, true);
+            void* allocate()
+            {
+                boost::lock_guard<boost::mutex> lock(m_lock);
 
-#ifdef _DEBUG
-// Only exit in debug mode if CPPLOG_FATAL_EXIT_DEBUG is set.
-#if defined(CPPLOG_FATAL_EXIT_DEBUG) || defined(CPPLOG_FATAL_EXIT)
-                    std::exit(1);
-#endif
-#else //!_DEBUG
-#ifdef CPPLOG_FATAL_EXIT_DEBUG
-                    std::exit(1)
-#endif
-#endif
+                if( m_freeList )
+                {
+                    free_block* block = m_freeList;
+                    m_freeList = block->next;
+                    return block;
                 }
+
+                if( m_slabPos + m_blockSize > m_slabEnd && !newSlab() )
+                    throw std::bad_alloc();
+
+                void* block = m_slabPos;
+                m_slabPos += m_blockSize;
+                return block;
             }
-        }
 
-    public:
-        static const char* getLevelName(loglevel_t level)
-        {
-            switch( level )
+            void deallocate(void* p)
             {
-                case LL_TRACE:
-                    return "TRACE";
-                case LL_DEBUG:
-                    return "DEBUG";
-                case LL_INFO:
-                    return "INFO";
-                case LL_WARN:
-                    return "WARN";
-                case LL_ERROR:
-                    return "ERROR";
-                case LL_FATAL:
-                    return "FATAL";
-                default:
-                    return "OTHER";
-            };
+                boost::lock_guard<boost::mutex> lock(m_lock);
+
+                free_block* block = static_cast<free_block*>(p);
+                block->next = m_freeList;
+                m_freeList = block;
+            }
         };
-    };
+#endif
+    }
 
-    // Generic class - logs to a given std::ostream.
-    class OstreamLogger : public BaseLogger
+#ifdef CPPLOG_SYSTEM_IDS
+    // Gives the calling thread a name (at most 15 chars), which is shown after
+    // its IDs in the default log header.  Pass NULL or "" to remove it.
+    inline void setThreadName(const char* name)
     {
-    protected:
-        std::ostream&   m_logStream;
+        helpers::thread_ids::setName(name);
+    }
+#endif
 
-    public:
-        OstreamLogger(std::ostream& outStream)
-            : m_logStream(outStream)
-        { }
+    // Logger data.  This is sent to a logger when a LogMessage is Flush()'ed, or
+    // when the destructor is called.
+    //
+    // Once sent, a message may be shared between several loggers (and
+    // threads), so loggers must treat it as read-only.  The exceptions are
+    // materialize(), which is only ever called on a message nobody else
+    // holds (see MultiplexLogger::acceptsDeferred()), and
+    // log_streambuf::compact(), which only does anything the first time,
+    // before the message is queued anywhere.  Both leave the text
+    // null-terminated, as LogMessage does, so log_streambuf::c_str() is
+    // just a read.
+    struct LogData
+    {
 
-        virtual bool sendLogMessage(LogData* logData)
-        {
-            helpers::fixed_streambuf* const sb = &logData->streamBuffer;
-            m_logStream.write(sb->c_str(), sb->length());
-            m_logStream << std::flush;
+        // Our streambuf & stream to log data to.
+        helpers::log_streambuf streamBuffer;
+        std::ostream stream;
 
-            return true;
-        }
+        // Captured data.
+        unsigned int level;
+        unsigned long line;
+        const char* fullPath;
+        const char* fileName;
+        time_t messageTime;
+        unsigned long messageNanos;         // Sub-second part of messageTime.
+        ::tm utcTime;
 
-        virtual ~OstreamLogger() { }
-    };
+        // Length of the default header at the start of the buffer, if
+        // LogMessage::writeDefaultHeader() wrote one.
+        size_t headerLength;
 
-    // Simple implementation - logs to stderr.
-    class StdErrLogger : public OstreamLogger
-    {
-    public:
-        StdErrLogger()
-            : OstreamLogger(std::cerr)
-        { }
-    };
+#ifdef CPPLOG_SYSTEM_IDS
+        // Process/thread ID, and the thread's name (if it was given one).
+        helpers::process_id_t processId;
+        helpers::thread_id_t  threadId;
+        char threadName[helpers::thread_ids::k_maxNameLength + 1];
+#endif
 
-    // Simple implementation - logs to a string, provides the ability to get that string.
-    class StringLogger : public OstreamLogger
-    {
-    private:
-        std::ostringstream  m_stream;
-    public:
-        StringLogger()
-            : OstreamLogger(m_stream)
-        { }
 
-        std::string getString()
-        {
-            return m_stream.str();
-        }
+#ifdef CPPLOG_DEFERRED_FORMAT
+        // Set for a LOGF() message whose formatting was deferred.  Until it
+        // is materialize()'d, the buffer holds its captured arguments
+        // rather than text.
+        const helpers::format_site* formatSite;
+#endif
 
-        void clear()
+        // Next free object, while this one sits in the LogDataPool.
+        LogData* poolNext;
+
+        // Loggers holding on to this message, when it is shared between
+        // several (see retain()).  LogDataPool::release() drops one, and
+        // only takes the message back with the last.
+#ifdef CPPLOG_THREADING
+        boost::atomic<unsigned int> references;
+#else
+        unsigned int references;
+#endif
+
+        // Constructor that initializes our stream.
+        LogData(loglevel_t logLevel)
+            : streamBuffer(), stream(&streamBuffer), level(logLevel),
+              messageTime(0), messageNanos(0), headerLength(0)
+#ifdef CPPLOG_SYSTEM_IDS
+              , processId(0), threadId(0)
+#endif
+#ifdef CPPLOG_DEFERRED_FORMAT
+              , formatSite(NULL)
+#endif
+              , poolNext(NULL), references(1)
         {
-            m_stream.str("");
-            m_stream.clear();
+#ifdef CPPLOG_SYSTEM_IDS
+            threadName[0] = '\0';
+#endif
         }
-    };
 
-#ifdef _WIN32
-    class OutputDebugStringLogger : public OstreamLogger
-    {
-    private:
-        dbgwin_stream m_stream;
-    public:
-        OutputDebugStringLogger() : OstreamLogger(m_stream)
+        virtual ~LogData()
         { }
-    };
+
+        // Returns a recycled object to the state a freshly-constructed one
+        // would be in.  Note that an imbue()'d locale is not undone.
+        void reset(loglevel_t logLevel)
+        {
+            streamBuffer.reset();
+            stream.exceptions(std::ios_base::goodbit);
+            stream.clear();
+            stream.flags(std::ios_base::skipws | std::ios_base::dec);
+            stream.fill(' ');
+            stream.width(0);
+            stream.precision(6);
+
+            level = logLevel;
+            messageTime = 0;
+            messageNanos = 0;
+            headerLength = 0;
+#ifdef CPPLOG_SYSTEM_IDS
+            processId = 0;
+            threadId  = 0;
+            threadName[0] = '\0';
+#endif
+#ifdef CPPLOG_DEFERRED_FORMAT
+            formatSite = NULL;
+#endif
+            poolNext = NULL;
+            references = 1;
+        }
+
+        // Adds a reference, for handing the message to one more logger that
+        // may keep it.  Every reference is given up with
+        // LogDataPool::release().
+        void retain()
+        {
+#ifdef CPPLOG_THREADING
+            references.fetch_add(1, boost::memory_order_relaxed);
+#else
+            references++;
+#endif
+        }
+
+        // Drops a reference.  Returns true if it was the last.
+        bool unreference()
+        {
+#ifdef CPPLOG_THREADING
+            // Nobody else can add a reference to a message only we hold,
+            // so skip the atomic update in the usual, unshared case.
+            if( references.load(boost::memory_order_acquire) == 1 )
+                return true;
+            return references.fetch_sub(1, boost::memory_order_acq_rel) == 1;
+#else
+            return --references == 0;
+#endif
+        }
+
+        // Whether this message still has to be materialize()'d before its
+        // text can be used.
+        bool isDeferred() const
+        {
+#ifdef CPPLOG_DEFERRED_FORMAT
+            return formatSite != NULL;
+#else
+            return false;
+#endif
+        }
+
+        // Formats a deferred message into text, in place.  "scratch" is
+        // used to hold the captured arguments meanwhile.  Does nothing for
+        // other messages.
+        inline void materialize(std::string& scratch);
+
+        // Makes sure the message ends in a newline.
+        void endLine()
+        {
+            if( streamBuffer.peek() != '\n' )
+            {
+                // If buffer is full, remove last char to leave room for newline.
+                if( streamBuffer.full() )
+                    streamBuffer.sunputc();
+
+                streamBuffer.sputc('\n');
+            }
+        }
+
+        // Local time of the message.  Only worked out if asked for.
+        void getLocalTime(::tm* out) const
+        {
+            helpers::timestamp_cache::breakDown(out, messageTime, true);
+        }
+
+        // Writes the message's time as "YYYY-MM-DD HH:MM:SS.uuuuuu" (plus a
+        // null) into "out", which must have room for 27 chars.
+        size_t formatTime(char* out, bool localTime = false) const
+        {
+            return helpers::timestamp_cache::format(out, messageTime, messageNanos, localTime);
+        }
+
+#ifdef CPPLOG_USE_HUGE_PAGES
+        static helpers::hugepage_arena& arena()
+        {
+            // Deliberately never destroyed - threads may still be freeing
+            // messages while static destructors run.
+            static helpers::hugepage_arena* s_arena = new helpers::hugepage_arena(sizeof(LogData));
+            return *s_arena;
+        }
+
+        static void* operator new(size_t size)
+        {
+            // Derived types don't fit in our blocks.
+            if( size > arena().blockSize() )
+                return ::operator new(size);
+            return arena().allocate();
+        }
+
+        static void operator delete(void* p, size_t size)
+        {
+            if( size > arena().blockSize() )
+                ::operator delete(p);
+            else
+                arena().deallocate(p);
+        }
+#endif
+    };
+
+    // Recycles LogData objects, so that steady-state logging does not touch
+    // the heap.  Every thread keeps a small cache of free objects; when that
+    // runs dry (or overflows), objects are moved to or from a global pool in
+    // batches.  Since the background thread frees what application threads
+    // allocate, objects naturally flow back through the global pool.
+    //
+    // Without CPPLOG_LOGDATA_POOL (or CPPLOG_THREADING), this simply calls
+    // new and delete.
+    class LogDataPool
+    {
+#ifdef CPPLOG_USE_LOGDATA_POOL
+    private:
+        struct free_list
+        {
+            LogData*    head;
+            size_t      count;
+
+            free_list() : head(NULL), count(0) { }
+
+            void push(LogData* logData)
+            {
+                logData->poolNext = head;
+                head = logData;
+                count++;
+            }
+
+            LogData* pop()
+            {
+                LogData* logData = head;
+                head = logData->poolNext;
+                count--;
+                return logData;
+            }
+
+            // Moves up to "max" objects from this list to another.
+            void moveTo(free_list& other, size_t max)
+            {
+                while( head && max-- > 0 )
+                    other.push(pop());
+            }
+        };
+
+        struct global_pool
+        {
+            boost::mutex    lock;
+            free_list       objects;
+            size_t          limit;          // Most objects to keep.
+
+            global_pool() : limit(CPPLOG_POOL_GLOBAL_LIMIT) { }
+        };
+
+        static global_pool& global()
+        {
+            // Never destroyed - see LogData::arena().
+            static global_pool* s_pool = new global_pool();
+            return *s_pool;
+        }
+
+        // Frees anything past the global limit.
+        static void trimAndDelete(free_list& excess)
+        {
+            while( excess.head )
+                delete excess.pop();
+        }
+
+        static free_list*& localCache()
+        {
+            static CPPLOG_THREAD_LOCAL free_list* t_cache = NULL;
+            return t_cache;
+        }
+
+        // Called on thread exit with that thread's cache.  Anything logged
+        // after this (say, from another thread-exit destructor) starts a
+        // new one.
+        static void releaseThreadCache(free_list* cache)
+        {
+            if( localCache() == cache )
+                localCache() = NULL;
+
+            free_list excess;
+            {
+                global_pool& pool = global();
+                boost::lock_guard<boost::mutex> lock(pool.lock);
+
+                size_t room = pool.limit > pool.objects.count ?
+                              pool.limit - pool.objects.count : 0;
+                cache->moveTo(pool.objects, room);
+            }
+            cache->moveTo(excess, cache->count);
+            trimAndDelete(excess);
+
+            delete cache;
+        }
+
+        // Each thread's cache.  The raw pointer is the fast path; the
+        // thread_specific_ptr is only there so the cache is handed back to
+        // the global pool when the thread exits.
+        static free_list* threadCache()
+        {
+            static boost::thread_specific_ptr<free_list> s_cleanup(&LogDataPool::releaseThreadCache);
+
+            free_list*& cache = localCache();
+            if( !cache )
+            {
+                cache = new free_list();
+                s_cleanup.reset(cache);
+            }
+            return cache;
+        }
+
+        static boost::atomic<unsigned long>& allocationCounter()
+        {
+            static boost::atomic<unsigned long> s_allocations(0);
+            return s_allocations;
+        }
+
+    public:
+        static LogData* acquire(loglevel_t logLevel)
+        {
+            free_list* cache = threadCache();
+
+            if( !cache->head )
+            {
+                global_pool& pool = global();
+                boost::lock_guard<boost::mutex> lock(pool.lock);
+                pool.objects.moveTo(*cache, CPPLOG_POOL_THREAD_CACHE / 2);
+            }
+
+            if( cache->head )
+            {
+                LogData* logData = cache->pop();
+                logData->reset(logLevel);
+                return logData;
+            }
+
+            allocationCounter().fetch_add(1, boost::memory_order_relaxed);
+            return new LogData(logLevel);
+        }
+
+        static void release(LogData* logData)
+        {
+            if( !logData->unreference() )
+                return;
+
+            free_list* cache = threadCache();
+            cache->push(logData);
+
+            if( cache->count > CPPLOG_POOL_THREAD_CACHE )
+            {
+                free_list excess;
+                {
+                    global_pool& pool = global();
+                    boost::lock_guard<boost::mutex> lock(pool.lock);
+
+                    cache->moveTo(pool.objects, CPPLOG_POOL_THREAD_CACHE / 2);
+                    if( pool.objects.count > pool.limit )
+                        pool.objects.moveTo(excess, pool.objects.count - pool.limit);
+                }
+                trimAndDelete(excess);
+            }
+        }
+
+        // Lets the global pool keep "count" more objects, say for a queue
+        // that may hand back that many at once.  Undo with unreserve().
+        static void reserve(size_t count)
+        {
+            global_pool& pool = global();
+            boost::lock_guard<boost::mutex> lock(pool.lock);
+            pool.limit += count;
+        }
+
+        // Anything past the lowered limit is freed as objects come back.
+        static void unreserve(size_t count)
+        {
+            global_pool& pool = global();
+            boost::lock_guard<boost::mutex> lock(pool.lock);
+            pool.limit -= (std::min)(count, pool.limit - CPPLOG_POOL_GLOBAL_LIMIT);
+        }
+
+        // Number of LogData objects the pool has had to allocate so far.
+        static unsigned long allocations()
+        {
+            return allocationCounter().load(boost::memory_order_relaxed);
+        }
+#else
+    public:
+        static LogData* acquire(loglevel_t logLevel)
+        {
+            return new LogData(logLevel);
+        }
+
+        static void release(LogData* logData)
+        {
+            if( logData->unreference() )
+                delete logData;
+        }
+
+        static void reserve(size_t) { }
+        static void unreserve(size_t) { }
+#endif
+    };
+
+    // A snapshot of a logger's counters (see BaseLogger::getMetrics()).
+    struct LoggerMetrics
+    {
+        // Write latencies are counted in buckets by powers of two: bucket i
+        // holds writes that took under 2^i microseconds, and the last one
+        // holds the rest.
+        static const size_t k_latencyBuckets = 24;
+
+        uint64_t    messagesAccepted;
+        uint64_t    bytesAccepted;
+        uint64_t    messagesFiltered;       // Turned away by isEnabled() or a level.
+        uint64_t    messagesDropped;        // Lost to a full queue.
+        uint64_t    writeErrors;
+
+        // Only for loggers with a queue (BackgroundLogger).
+        bool        hasQueue;
+        uint64_t    queueDepth;
+        uint64_t    peakQueueDepth;
+        uint64_t    writes;                 // Batches handed to the next logger.
+        uint64_t    writeNanos;             // Total time they took.
+        uint64_t    writeLatency[k_latencyBuckets];
+
+        LoggerMetrics()
+        {
+            memset(this, 0, sizeof(*this));
+        }
+    };
+
+#ifdef CPPLOG_USE_METRICS
+    namespace helpers
+    {
+        inline uint64_t monotonic_nanos()
+        {
+#ifdef _WIN32
+            LARGE_INTEGER counter, frequency;
+            ::QueryPerformanceCounter(&counter);
+            ::QueryPerformanceFrequency(&frequency);
+            return static_cast<uint64_t>(counter.QuadPart / frequency.QuadPart) * 1000000000u +
+                   static_cast<uint64_t>(counter.QuadPart % frequency.QuadPart) * 1000000000u / frequency.QuadPart;
+#else
+            timespec ts;
+            ::clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+#endif
+        }
+
+        // Which copy of a counter the calling thread should update: one
+        // per CPU where we can tell, otherwise one per thread.
+        inline size_t metrics_shard()
+        {
+#if defined(__linux__)
+            int cpu = ::sched_getcpu();
+            if( cpu >= 0 )
+                return static_cast<size_t>(cpu);
+#endif
+            static boost::atomic<size_t> s_nextShard(0);
+            static CPPLOG_THREAD_LOCAL size_t t_shard = 0;      // One more than the shard.
+            if( !t_shard )
+                t_shard = s_nextShard.fetch_add(1, boost::memory_order_relaxed) + 1;
+            return t_shard - 1;
+        }
+
+        // A logger's counters.  Each is split over several cache lines, so
+        // that threads logging at the same time on different CPUs don't
+        // fight over one; reading them adds the pieces up.
+        class logger_metrics
+        {
+        private:
+            static const size_t cache_line_size = 64;
+            static const size_t k_shards = 16;
+
+            struct shard
+            {
+                boost::atomic<uint64_t> accepted;
+                boost::atomic<uint64_t> bytes;
+                boost::atomic<uint64_t> filtered;
+                boost::atomic<uint64_t> dropped;
+                boost::atomic<uint64_t> errors;
+                char                    pad[cache_line_size - (5 * sizeof(boost::atomic<uint64_t>)) % cache_line_size];
+
+                shard()
+                    : accepted(0), bytes(0), filtered(0), dropped(0), errors(0)
+                { }
+            };
+
+            void*   m_storage;
+            shard*  m_shards;
+
+            // Not copyable.
+            logger_metrics(const logger_metrics&);
+            logger_metrics& operator=(const logger_metrics&);
+
+            shard& local()
+            {
+                return m_shards[metrics_shard() % k_shards];
+            }
+
+        public:
+            logger_metrics()
+            {
+                m_storage = std::malloc(k_shards * sizeof(shard) + cache_line_size);
+                if( !m_storage )
+                    throw std::bad_alloc();
+
+                m_shards = reinterpret_cast<shard*>(
+                                (reinterpret_cast<size_t>(m_storage) + cache_line_size - 1) & ~(cache_line_size - 1)
+                           );
+                for( size_t i = 0; i < k_shards; i++ )
+                    new (&m_shards[i]) shard();
+            }
+
+            ~logger_metrics()
+            {
+                for( size_t i = 0; i < k_shards; i++ )
+                    m_shards[i].~shard();
+                std::free(m_storage);
+            }
+
+            void accepted(size_t bytes)
+            {
+                shard& s = local();
+                s.accepted.fetch_add(1, boost::memory_order_relaxed);
+                s.bytes.fetch_add(bytes, boost::memory_order_relaxed);
+            }
+
+            void filtered()
+            {
+                local().filtered.fetch_add(1, boost::memory_order_relaxed);
+            }
+
+            void dropped()
+            {
+                local().dropped.fetch_add(1, boost::memory_order_relaxed);
+            }
+
+            void writeError()
+            {
+                local().errors.fetch_add(1, boost::memory_order_relaxed);
+            }
+
+            void snapshot(LoggerMetrics& metrics) const
+            {
+                metrics = LoggerMetrics();
+                for( size_t i = 0; i < k_shards; i++ )
+                {
+                    metrics.messagesAccepted += m_shards[i].accepted.load(boost::memory_order_relaxed);
+                    metrics.bytesAccepted    += m_shards[i].bytes.load(boost::memory_order_relaxed);
+                    metrics.messagesFiltered += m_shards[i].filtered.load(boost::memory_order_relaxed);
+                    metrics.messagesDropped  += m_shards[i].dropped.load(boost::memory_order_relaxed);
+                    metrics.writeErrors      += m_shards[i].errors.load(boost::memory_order_relaxed);
+                }
+            }
+        };
+    }
+#endif
+
+    // Base interface for a logger.
+    class BaseLogger
+    {
+#ifdef CPPLOG_USE_METRICS
+    private:
+        mutable helpers::logger_metrics m_metrics;
+#endif
+
+    public:
+        // All loggers must provide an interface to log a message to.
+        // The return value of this function indicates whether to delete
+        // the log message - that is, to LogDataPool::release() the caller's
+        // reference to it.  A logger that returns false keeps that
+        // reference, and releases it when done; to keep a message it has
+        // also handed on, it must LogData::retain() it first.
+        virtual bool sendLogMessage(LogData* logData) = 0;
+
+        // Sends several messages at once.  On return, every entry the logger
+        // has taken ownership of is set to NULL; the caller deletes the rest.
+        // By default, this just calls sendLogMessage() for each message.
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            for( size_t i = 0; i < count; i++ )
+            {
+                if( !sendLogMessage(logData[i]) )
+                    logData[i] = NULL;
+            }
+        }
+
+        // Whether a message at the given level would get logged anywhere.
+        // The logging macros check this before creating a message, so
+        // loggers that filter (or forward to loggers that filter) should
+        // pass the question on.
+        virtual bool isEnabled(loglevel_t /* level */) const
+        {
+            return true;
+        }
+
+        // Whether this logger can be handed LOGF() messages that haven't
+        // been formatted yet (see LogData::materialize()).  Otherwise,
+        // they're formatted on the logging thread.
+        virtual bool acceptsDeferred() const
+        {
+            return false;
+        }
+
+        // Fills in this logger's counters.  Without CPPLOG_METRICS, they're
+        // all zero.
+        virtual void getMetrics(LoggerMetrics& metrics) const
+        {
+#ifdef CPPLOG_USE_METRICS
+            m_metrics.snapshot(metrics);
+#else
+            metrics = LoggerMetrics();
+#endif
+        }
+
+#ifdef CPPLOG_USE_METRICS
+        // For whoever hands this logger messages, and the logger itself,
+        // to count what happens to them.
+        helpers::logger_metrics& metrics() const
+        {
+            return m_metrics;
+        }
+#endif
+
+        virtual ~BaseLogger() { }
+    };
+
+    namespace helpers
+    {
+        // Used by the logging macros.  Fatal messages are always created, so
+        // that they still exit() when filtered out.
+        inline bool loggerEnabled(loglevel_t level, const BaseLogger& logger)
+        {
+            if( level >= LL_FATAL || logger.isEnabled(level) )
+                return true;
+
+#ifdef CPPLOG_USE_METRICS
+            logger.metrics().filtered();
+#endif
+            return false;
+        }
+
+        inline bool loggerEnabled(loglevel_t level, const BaseLogger* logger)
+        {
+            return loggerEnabled(level, *logger);
+        }
+
+        // As above, but returns the logger (or NULL), so that the macros
+        // only evaluate their logger argument once.
+        inline BaseLogger* enabledLogger(loglevel_t level, BaseLogger& logger)
+        {
+            return loggerEnabled(level, logger) ? &logger : NULL;
+        }
+
+        inline BaseLogger* enabledLogger(loglevel_t level, BaseLogger* logger)
+        {
+            return enabledLogger(level, *logger);
+        }
+
+        // Hands LOG_LEVEL the logger from enabledLogger() as a pointer or a
+        // reference, whichever the macro was given, so custom LOG_LEVELs
+        // that only take one of them keep working.  logger_kind() is only
+        // used inside sizeof, so the macro's argument isn't evaluated again.
+        struct logger_pointer_kind { char c[2]; };
+        logger_pointer_kind logger_kind(const BaseLogger*);
+        char logger_kind(const BaseLogger&);
+
+        template<size_t Kind> struct logger_as;
+
+        template<> struct logger_as<sizeof(char)>
+        {
+            static BaseLogger& cast(BaseLogger* logger) { return *logger; }
+        };
+
+        template<> struct logger_as<sizeof(logger_pointer_kind)>
+        {
+            static BaseLogger* cast(BaseLogger* logger) { return logger; }
+        };
+
+        // Hands messages on to another logger.  Loggers that forward
+        // messages use these, so that what each logger is given gets
+        // counted.
+        inline bool send_to(BaseLogger* logger, LogData* logData)
+        {
+#ifdef CPPLOG_USE_METRICS
+            logger->metrics().accepted(static_cast<size_t>(logData->streamBuffer.length()));
+#endif
+            return logger->sendLogMessage(logData);
+        }
+
+        inline void send_to(BaseLogger* logger, LogData** logData, size_t count)
+        {
+#ifdef CPPLOG_USE_METRICS
+            helpers::logger_metrics& metrics = logger->metrics();
+            for( size_t i = 0; i < count; i++ )
+                metrics.accepted(static_cast<size_t>(logData[i]->streamBuffer.length()));
+#endif
+            logger->sendLogMessages(logData, count);
+        }
+    }
+
+    // Log message - this is instantiated upon every call to LOG(logger)
+    class LogMessage
+    {
+    private:
+        BaseLogger*     m_logger;
+        bool            m_flushed;
+        bool            m_deleteMessage;
+
+    protected:
+        LogData*        m_logData;
+
+    private:
+        // Flag for if a fatal message has been logged already.
+        // This prevents us from calling exit(), which calls something,
+        // which then logs a fatal message, which cause an infinite loop.
+        // TODO: this should probably be thread-safe...
+        static bool getSetFatal(bool get, bool val)
+        {
+            static bool m_fatalFlag = false;
+
+            if( !get )
+                m_fatalFlag = val;
+
+            return m_fatalFlag;
+        }
+
+    public:
+        LogMessage(const char* file, unsigned int line, loglevel_t logLevel, BaseLogger* outputLogger, bool useDefaultLogFormat=true)
+            : m_logger(outputLogger)
+        {
+            Init(file, line, logLevel, useDefaultLogFormat);
+        }
+
+        LogMessage(const char* file, unsigned int line, loglevel_t logLevel, BaseLogger& outputLogger, bool useDefaultLogFormat=true)
+            : m_logger(&outputLogger)
+        {
+            Init(file, line, logLevel, useDefaultLogFormat);
+        }
+
+        virtual ~LogMessage() CPPLOG_NOEXCEPT_FALSE
+        {
+            Flush();
+
+            if( m_deleteMessage )
+            {
+                LogDataPool::release(m_logData);
+            }
+        }
+
+        inline std::ostream& getStream()
+        {
+            return m_logData->stream;
+        }
+
+    protected:
+        virtual void InitLogMessage()
+        {
+            writeDefaultHeader(m_logData);
+        }
+
+    public:
+        // Writes the default "[pid.tid] LEVEL - file(line): " header straight
+        // into a message's buffer, bypassing the stream.
+        static void writeDefaultHeader(LogData* logData)
+        {
+#ifdef CPPLOG_SYSTEM_IDS
+            char header[24 + helpers::thread_ids::k_maxPrefixLength];
+#else
+            char header[48];
+#endif
+            char* p = header;
+
+            // Log process ID and thread ID.  When the message comes from this
+            // thread (the usual case) the prefix has already been rendered.
+#ifdef CPPLOG_SYSTEM_IDS
+            const helpers::thread_ids::entry& ids = helpers::thread_ids::current();
+            if( ids.processId == logData->processId && ids.threadId == logData->threadId &&
+                strcmp(ids.name, logData->threadName) == 0 )
+            {
+                memcpy(p, ids.prefix, ids.prefixLength);
+                p += ids.prefixLength;
+            }
+            else
+            {
+                p += helpers::thread_ids::render(p, logData->processId, logData->threadId,
+                                                 logData->threadName);
+            }
+#endif
+
+            // Level name, left-aligned in 5 columns.
+            const char* levelName = LogMessage::getLevelName(logData->level);
+            size_t levelLength = strlen(levelName);
+            memcpy(p, levelName, levelLength);
+            p += levelLength;
+            for( ; levelLength < 5; levelLength++ )
+                *p++ = ' ';
+
+            memcpy(p, " - ", 3);
+            p += 3;
+
+            helpers::log_streambuf& sb = logData->streamBuffer;
+            bool atStart = sb.empty();
+            sb.sputn(header, p - header);
+            sb.sputn(logData->fileName, static_cast<std::streamsize>(strlen(logData->fileName)));
+
+            p = header;
+            *p++ = '(';
+            p += helpers::write_decimal(p, logData->line);
+            memcpy(p, "): ", 3);
+            p += 3;
+            sb.sputn(header, p - header);
+
+            if( atStart )
+                logData->headerLength = static_cast<size_t>(sb.length());
+
+            // Leave the stream's formatting the way the iostream version of
+            // this did, since callers may rely on it.
+            logData->stream.setf(std::ios_base::left, std::ios_base::adjustfield);
+        }
+
+    private:
+        void Init(const char* file, unsigned int line, loglevel_t logLevel, bool useDefaultLogFormat=true)
+        {
+            m_logData = LogDataPool::acquire(logLevel);
+            m_flushed = false;
+            m_deleteMessage = false;
+
+            // Capture data.
+            m_logData->fullPath     = file;
+            m_logData->fileName     = cpplog::helpers::fileNameFromPath(file);
+            m_logData->line         = line;
+
+            // Get current time.
+            helpers::get_time(m_logData->messageTime, m_logData->messageNanos);
+            helpers::timestamp_cache::breakDown(&m_logData->utcTime, m_logData->messageTime, false);
+
+#ifdef CPPLOG_SYSTEM_IDS
+            // Get process/thread ID (cached per thread).
+            const helpers::thread_ids::entry& ids = helpers::thread_ids::current();
+            m_logData->processId    = ids.processId;
+            m_logData->threadId     = ids.threadId;
+            if( ids.name[0] != '\0' )
+                memcpy(m_logData->threadName, ids.name, sizeof(ids.name));
+#endif // CPPLOG_SYSTEM_IDS
+
+            if( useDefaultLogFormat )
+            {
+                InitLogMessage();
+            }
+        }
+
+        void Flush()
+        {
+            if( !m_flushed )
+            {
+                // Insert newline, if needed.  Deferred messages get theirs
+                // once they're formatted.
+                if( !m_logData->isDeferred() )
+                    m_logData->endLine();
+
+                // Loggers may share the message from here on, so c_str()
+                // mustn't have to write to it.
+                m_logData->streamBuffer.terminate();
+
+                // Save the log level.
+                loglevel_t savedLogLevel = m_logData->level;
+
+                // Send the message, set flushed=true.
+                m_deleteMessage = helpers::send_to(m_logger, m_logData);
+                m_flushed = true;
+
+                // Note: We cannot touch m_logData after the above call.  By the
+                // time it returns, we have to assume it has already been freed.
+
+                // If this is a fatal message...
+                if( savedLogLevel == LL_FATAL && !getSetFatal(true, true) )
+                {
+                    // Set our fatal flag.
+                    getSetFatal(false, true);
+
+#ifdef _DEBUG
+// Only exit in debug mode if CPPLOG_FATAL_EXIT_DEBUG is set.
+#if defined(CPPLOG_FATAL_EXIT_DEBUG) || defined(CPPLOG_FATAL_EXIT)
+                    std::exit(1);
+#endif
+#else //!_DEBUG
+#ifdef CPPLOG_FATAL_EXIT_DEBUG
+                    std::exit(1)
+#endif
+#endif
+                }
+            }
+        }
+
+    public:
+        static const char* getLevelName(loglevel_t level)
+        {
+            switch( level )
+            {
+                case LL_TRACE:
+                    return "TRACE";
+                case LL_DEBUG:
+                    return "DEBUG";
+                case LL_INFO:
+                    return "INFO";
+                case LL_WARN:
+                    return "WARN";
+                case LL_ERROR:
+                    return "ERROR";
+                case LL_FATAL:
+                    return "FATAL";
+                default:
+                    return "OTHER";
+            };
+        };
+    };
+
+    inline void LogData::materialize(std::string& scratch)
+    {
+#ifdef CPPLOG_DEFERRED_FORMAT
+        if( !formatSite )
+            return;
+
+        const char* format = formatSite->format;
+        formatSite = NULL;
+
+        scratch.assign(streamBuffer.data(), static_cast<size_t>(streamBuffer.length()));
+        streamBuffer.reset();
+
+        LogMessage::writeDefaultHeader(this);
+        helpers::format_captured(stream, format, scratch.data(), scratch.data() + scratch.size());
+        endLine();
+        streamBuffer.terminate();
+#else
+        (void)scratch;
+#endif
+    }
+
+#ifdef CPPLOG_DEFERRED_FORMAT
+    // LogMessage for LOGF().  When the logger accepts deferred messages,
+    // only the arguments are captured here, and the text is formatted later
+    // (on the BackgroundLogger's thread).  Otherwise, it's formatted now.
+    // Fatal messages are always formatted right away.
+    class FormattedLogMessage : public LogMessage
+    {
+    private:
+        const helpers::format_site*     m_site;
+        bool                            m_deferred;
+
+    public:
+        FormattedLogMessage(const helpers::format_site* site, loglevel_t logLevel, BaseLogger* outputLogger)
+            : LogMessage(site->file, site->line, logLevel, outputLogger, false),
+              m_site(site), m_deferred(logLevel < LL_FATAL && outputLogger->acceptsDeferred())
+        { }
+
+        FormattedLogMessage(const helpers::format_site* site, loglevel_t logLevel, BaseLogger& outputLogger)
+            : LogMessage(site->file, site->line, logLevel, outputLogger, false),
+              m_site(site), m_deferred(logLevel < LL_FATAL && outputLogger.acceptsDeferred())
+        { }
+
+        template <typename... Args>
+        void format(const char* format, const Args&... args)
+        {
+            if( m_deferred )
+            {
+                m_logData->formatSite = m_site;
+                helpers::encode_format_args(m_logData->streamBuffer, args...);
+            }
+            else
+            {
+                writeDefaultHeader(m_logData);
+                helpers::format_args(m_logData->stream, format, args...);
+            }
+        }
+    };
+#endif
+
+    // When an OstreamLogger flushes its stream.  Any of these may be set:
+    //  everyBytes  - once at least this many bytes haven't been flushed.
+    //  everyMillis - this often, if anything hasn't been flushed (even while
+    //                no messages arrive).  Needs CPPLOG_THREADING; ignored
+    //                otherwise.
+    //  flushLevel  - right after any message at or above this level.
+    // The default flushes after every message.  Whatever the policy,
+    // OstreamLogger::flush() flushes right away.
+    struct FlushPolicy
+    {
+        static const loglevel_t k_noLevel = LL_FATAL + 1;
+
+        size_t          everyBytes;
+        unsigned long   everyMillis;
+        loglevel_t      flushLevel;
+
+        FlushPolicy(size_t bytes = 1, unsigned long millis = 0, loglevel_t level = k_noLevel)
+            : everyBytes(bytes), everyMillis(millis), flushLevel(level)
+        { }
+
+        static FlushPolicy everyMessage()
+        {
+            return FlushPolicy(1, 0, k_noLevel);
+        }
+
+        // Only flush() (and closing the stream) flushes.
+        static FlushPolicy manual()
+        {
+            return FlushPolicy(0, 0, k_noLevel);
+        }
+    };
+
+#ifdef CPPLOG_THREADING
+    namespace helpers
+    {
+        // Calls "callback" every "intervalMillis" on its own thread, until
+        // destroyed.
+        class periodic_timer
+        {
+        public:
+            typedef void (*pfCallback)(void* context);
+
+        private:
+            pfCallback                  m_callback;
+            void*                       m_context;
+            unsigned long               m_interval;
+            bool                        m_stop;
+            boost::mutex                m_mutex;
+            boost::condition_variable   m_wake;
+            boost::thread               m_thread;
+
+            // Not copyable.
+            periodic_timer(const periodic_timer&);
+            periodic_timer& operator=(const periodic_timer&);
+
+            void run()
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                while( !m_stop )
+                {
+                    m_wake.timed_wait(lock, boost::posix_time::milliseconds(m_interval));
+                    if( m_stop )
+                        break;
+
+                    lock.unlock();
+                    m_callback(m_context);
+                    lock.lock();
+                }
+            }
+
+        public:
+            periodic_timer(pfCallback callback, void* context, unsigned long intervalMillis)
+                : m_callback(callback), m_context(context), m_interval(intervalMillis),
+                  m_stop(false), m_thread(boost::bind(&periodic_timer::run, this))
+            { }
+
+            ~periodic_timer()
+            {
+                {
+                    boost::lock_guard<boost::mutex> lock(m_mutex);
+                    m_stop = true;
+                    m_wake.notify_one();
+                }
+                m_thread.join();
+            }
+        };
+
+        // Calls "callback" at "first", then at whatever time it returns,
+        // on its own thread, until destroyed.  Sleeps in between.
+        class deadline_timer
+        {
+        public:
+            typedef ::time_t (*pfCallback)(void* context);
+
+        private:
+            pfCallback                  m_callback;
+            void*                       m_context;
+            ::time_t                    m_due;
+            bool                        m_stop;
+            boost::mutex                m_mutex;
+            boost::condition_variable   m_wake;
+            boost::thread               m_thread;
+
+            // Not copyable.
+            deadline_timer(const deadline_timer&);
+            deadline_timer& operator=(const deadline_timer&);
+
+            void run()
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                while( !m_stop )
+                {
+                    // Waits on the system clock, so following any changes to it.
+                    m_wake.timed_wait(lock, boost::posix_time::from_time_t(m_due));
+                    if( m_stop )
+                        break;
+                    if( ::time(NULL) < m_due )
+                        continue;
+
+                    lock.unlock();
+                    ::time_t due = m_callback(m_context);
+                    lock.lock();
+
+                    m_due = due;
+                }
+            }
+
+        public:
+            deadline_timer(pfCallback callback, void* context, ::time_t first)
+                : m_callback(callback), m_context(context), m_due(first),
+                  m_stop(false), m_thread(boost::bind(&deadline_timer::run, this))
+            { }
+
+            ~deadline_timer()
+            {
+                {
+                    boost::lock_guard<boost::mutex> lock(m_mutex);
+                    m_stop = true;
+                    m_wake.notify_one();
+                }
+                m_thread.join();
+            }
+        };
+    }
+#endif
+
+    // Generic class - logs to a given std::ostream.
+    class OstreamLogger : public BaseLogger
+    {
+    protected:
+        std::ostream&   m_logStream;
+
+    private:
+        std::string     m_batchBuffer;
+        FlushPolicy     m_flushPolicy;
+        size_t          m_unflushed;
+
+#ifdef CPPLOG_THREADING
+        // Only taken while another thread may use the stream (such as
+        // the flush timer).  Recursive, since subclasses hold it around
+        // calls into this class.
+        boost::recursive_mutex      m_streamMutex;
+        helpers::periodic_timer*    m_flushTimer;
+        bool                        m_streamShared;
+
+        static void timerFlush(void* context)
+        {
+            static_cast<OstreamLogger*>(context)->flushIfPending();
+        }
+#endif
+
+    public:
+        OstreamLogger(std::ostream& outStream)
+            : m_logStream(outStream), m_unflushed(0)
+#ifdef CPPLOG_THREADING
+              , m_flushTimer(NULL), m_streamShared(false)
+#endif
+        { }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            stream_lock lock(*this);
+
+            helpers::log_streambuf* const sb = &logData->streamBuffer;
+            m_logStream.write(sb->data(), sb->length());
+            written(static_cast<size_t>(sb->length()), logData->level);
+
+            return true;
+        }
+
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            stream_lock lock(*this);
+            writeBatch(logData, count);
+        }
+
+        // Should be set before logging starts.
+        void setFlushPolicy(const FlushPolicy& policy)
+        {
+            stopFlushTimer();
+            m_flushPolicy = policy;
+
+#ifdef CPPLOG_THREADING
+            if( policy.everyMillis > 0 )
+                m_flushTimer = new helpers::periodic_timer(&OstreamLogger::timerFlush, this, policy.everyMillis);
+#endif
+        }
+
+        const FlushPolicy& getFlushPolicy() const
+        {
+            return m_flushPolicy;
+        }
+
+        void flush()
+        {
+            stream_lock lock(*this);
+            flushStream();
+        }
+
+    protected:
+        // Held while using the stream, so that the flush timer (if any)
+        // doesn't flush it at the same time.
+#ifdef CPPLOG_THREADING
+        class stream_lock
+        {
+        private:
+            boost::recursive_mutex*     m_mutex;
+
+        public:
+            explicit stream_lock(OstreamLogger& logger)
+                : m_mutex(logger.m_flushTimer || logger.m_streamShared ? &logger.m_streamMutex : NULL)
+            {
+                if( m_mutex )
+                    m_mutex->lock();
+            }
+
+            ~stream_lock()
+            {
+                if( m_mutex )
+                    m_mutex->unlock();
+            }
+        };
+#else
+        class stream_lock
+        {
+        public:
+            explicit stream_lock(OstreamLogger&) { }
+        };
+#endif
+
+#ifdef CPPLOG_THREADING
+        // Subclasses call this before using the stream (under a
+        // stream_lock) from a thread of their own.
+        void shareStream()
+        {
+            m_streamShared = true;
+        }
+#endif
+
+        // Subclasses that own their stream must call this in their
+        // destructor, before the stream is destroyed.
+        void stopFlushTimer()
+        {
+#ifdef CPPLOG_THREADING
+            delete m_flushTimer;
+            m_flushTimer = NULL;
+#endif
+        }
+
+        // Flushes according to the policy, after "length" bytes have been
+        // written.  "level" is the highest level among them.
+        void written(size_t length, loglevel_t level)
+        {
+            checkStream();
+            m_unflushed += length;
+
+            if( (m_flushPolicy.everyBytes > 0 && m_unflushed >= m_flushPolicy.everyBytes) ||
+                level >= m_flushPolicy.flushLevel )
+                flushStream();
+        }
+
+        // The stream now writes somewhere new, with nothing left to flush.
+        void streamReplaced()
+        {
+            m_unflushed = 0;
+        }
+
+        void flushStream()
+        {
+            m_logStream << std::flush;
+            m_unflushed = 0;
+            checkStream();
+        }
+
+        // Counts a failed write or flush, and clears the error so that
+        // later messages still get a chance to be written.
+        void checkStream()
+        {
+            if( !m_logStream.fail() )
+                return;
+
+#ifdef CPPLOG_USE_METRICS
+            metrics().writeError();
+#endif
+            m_logStream.clear();
+        }
+
+        void flushIfPending()
+        {
+            stream_lock lock(*this);
+            if( m_unflushed > 0 )
+                flushStream();
+        }
+
+        // Gathers a batch of messages into one buffer, so that the stream
+        // sees (and, for files, the OS sees) a single write.
+        void writeBatch(LogData** logData, size_t count)
+        {
+            if( count == 1 )
+            {
+                helpers::log_streambuf* const sb = &logData[0]->streamBuffer;
+                m_logStream.write(sb->data(), sb->length());
+                written(static_cast<size_t>(sb->length()), logData[0]->level);
+                return;
+            }
+
+            loglevel_t highest = LL_TRACE;
+            m_batchBuffer.clear();
+            for( size_t i = 0; i < count; i++ )
+            {
+                helpers::log_streambuf* const sb = &logData[i]->streamBuffer;
+                m_batchBuffer.append(sb->data(), static_cast<size_t>(sb->length()));
+                highest = std::max(highest, logData[i]->level);
+            }
+
+            m_logStream.write(m_batchBuffer.data(), m_batchBuffer.size());
+            written(m_batchBuffer.size(), highest);
+        }
+
+    public:
+
+        virtual ~OstreamLogger()
+        {
+            stopFlushTimer();
+        }
+    };
+
+    // Simple implementation - logs to stderr.
+    class StdErrLogger : public OstreamLogger
+    {
+    public:
+        StdErrLogger()
+            : OstreamLogger(std::cerr)
+        { }
+    };
+
+    // Simple implementation - logs to a string, provides the ability to get that string.
+    class StringLogger : public OstreamLogger
+    {
+    private:
+        std::ostringstream  m_stream;
+    public:
+        StringLogger()
+            : OstreamLogger(m_stream)
+        { }
+
+        virtual ~StringLogger()
+        {
+            stopFlushTimer();
+        }
+
+        std::string getString()
+        {
+            return m_stream.str();
+        }
+
+        void clear()
+        {
+            m_stream.str("");
+            m_stream.clear();
+        }
+    };
+
+#ifdef _WIN32
+    class OutputDebugStringLogger : public OstreamLogger
+    {
+    private:
+        dbgwin_stream m_stream;
+    public:
+        OutputDebugStringLogger() : OstreamLogger(m_stream)
+        { }
+
+        virtual ~OutputDebugStringLogger()
+        {
+            stopFlushTimer();
+        }
+    };
 #endif
 
     // Log to file.
     class FileLogger : public OstreamLogger
     {
     private:
-        std::string     m_path;
-        std::ofstream   m_outStream;
+        std::string     m_path;
+        std::ofstream   m_outStream;
+
+    public:
+        FileLogger(std::string logFilePath)
+            : OstreamLogger(m_outStream), m_path(logFilePath), m_outStream(logFilePath.c_str(), std::ios_base::out)
+        {
+        }
+
+        FileLogger(std::string logFilePath, bool append)
+            : OstreamLogger(m_outStream), m_path(logFilePath), m_outStream(logFilePath.c_str(), append ? std::ios_base::app : std::ios_base::out)
+        {
+        }
+
+        virtual ~FileLogger()
+        {
+            stopFlushTimer();
+        }
+    };
+
+#ifdef CPPLOG_THREADING
+    // How many rotated logs a LogArchiver keeps.  Zero means no limit.
+    struct RetentionPolicy
+    {
+        size_t          maxFiles;
+        uint64_t        maxBytes;
+        unsigned long   maxAgeSeconds;
+
+        RetentionPolicy(size_t files = 0, uint64_t bytes = 0, unsigned long ageSeconds = 0)
+            : maxFiles(files), maxBytes(bytes), maxAgeSeconds(ageSeconds)
+        { }
+    };
+
+    namespace helpers
+    {
+        // Lowers the calling thread's CPU (and, where possible, I/O)
+        // priority, so that background work doesn't compete with logging.
+        inline void lower_thread_priority()
+        {
+#if defined(_WIN32)
+            ::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+            // On Linux, both of these apply to just this thread.
+            const int tid = static_cast<int>(::syscall(SYS_gettid));
+            int result = ::setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+            const int ioprioWhoProcess = 1;
+            const int ioprioClassIdle = 3;
+            result = static_cast<int>(::syscall(SYS_ioprio_set, ioprioWhoProcess, tid, ioprioClassIdle << 13));
+#endif
+            (void)result;
+#endif
+        }
+
+#ifdef CPPLOG_WITH_ZLIB
+        // A piece of a file, compressed as its own gzip member.  Members
+        // can be compressed in parallel, and simply concatenated.
+        struct gzip_chunk
+        {
+            std::string     input;
+            std::string     output;
+            int             level;
+            bool            compressed;
+
+            void compress()
+            {
+                z_stream zs;
+                memset(&zs, 0, sizeof(zs));
+                compressed = false;
+
+                // 16 + 15 bits of window: gzip, rather than zlib, framing.
+                if( deflateInit2(&zs, level, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+                    return;
+
+                output.resize(deflateBound(&zs, static_cast<uLong>(input.size())));
+                zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+                zs.avail_in = static_cast<uInt>(input.size());
+                zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+                zs.avail_out = static_cast<uInt>(output.size());
+
+                compressed = (deflate(&zs, Z_FINISH) == Z_STREAM_END);
+                output.resize(zs.total_out);
+                deflateEnd(&zs);
+            }
+        };
+#endif
+    }
+
+    // Compresses rotated logs on a low-priority background thread, then
+    // deletes the oldest ones beyond its RetentionPolicy.  Hand it to
+    // SizeRotateFileLogger or TimeRotateFileLogger with setArchiver().
+    //
+    // Retention only counts the files this archiver was given (through
+    // archive() or track()), oldest first.  Age is judged by a file's
+    // modification time, and also checked once a minute.
+    class LogArchiver
+    {
+    public:
+        enum Compression
+        {
+            AC_NONE
+#ifdef CPPLOG_WITH_ZLIB
+            , AC_GZIP       // Large files are split across threads.
+#endif
+#ifdef CPPLOG_WITH_ZSTD
+            , AC_ZSTD       // Uses zstd's own worker threads.
+#endif
+        };
+
+        // Files are compressed this much at a time, per thread - each of
+        // which also holds the compressed chunk.
+        static const size_t k_chunkSize = 4 * 1024 * 1024;
+
+        // Most threads used by default, however many cores there are.
+        static const unsigned int k_defaultThreads = 4;
+
+    private:
+        struct pending_file
+        {
+            std::string     path;
+            bool            compress;
+        };
+
+        struct archived_file
+        {
+            std::string     path;
+            uint64_t        size;
+            time_t          modified;
+        };
+
+        Compression                 m_compression;
+        RetentionPolicy             m_retention;
+        unsigned int                m_threads;
+        int                         m_level;
+
+        boost::mutex                m_mutex;
+        boost::condition_variable   m_wake;
+        boost::condition_variable   m_idle;
+        std::deque<pending_file>    m_pending;
+        bool                        m_busy;
+        bool                        m_stop;
+
+        // Only touched by the worker.
+        std::deque<archived_file>   m_archived;
+        uint64_t                    m_archivedBytes;
+
+#ifdef CPPLOG_WITH_ZLIB
+        // Threads that help the worker compress each round of gzip chunks.
+        boost::mutex                m_crewMutex;
+        boost::condition_variable   m_crewWake;
+        boost::condition_variable   m_crewDone;
+        helpers::gzip_chunk*        m_round;
+        size_t                      m_roundSize;
+        size_t                      m_nextChunk;
+        size_t                      m_chunksLeft;
+        bool                        m_crewStop;
+        boost::thread_group         m_crew;
+#endif
+
+        boost::thread               m_thread;
+
+        // Not copyable.
+        LogArchiver(const LogArchiver&);
+        LogArchiver& operator=(const LogArchiver&);
+
+        static unsigned int defaultThreads()
+        {
+            unsigned int cores = std::max(1u, boost::thread::hardware_concurrency());
+            return cores < k_defaultThreads ? cores : k_defaultThreads;
+        }
+
+        void enqueue(const std::string& path, bool compress)
+        {
+            pending_file file;
+            file.path = path;
+            file.compress = compress;
+
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_pending.push_back(file);
+            m_wake.notify_one();
+        }
+
+        void run()
+        {
+            helpers::lower_thread_priority();
+
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            for( ;; )
+            {
+                if( m_pending.empty() )
+                {
+                    m_busy = false;
+                    m_idle.notify_all();
+                    if( m_stop )
+                        break;
+
+                    if( m_retention.maxAgeSeconds > 0 )
+                        m_wake.timed_wait(lock, boost::posix_time::seconds(60));
+                    else
+                        m_wake.wait(lock);
+
+                    if( m_pending.empty() )
+                    {
+                        lock.unlock();
+                        applyRetention();
+                        lock.lock();
+                    }
+                    continue;
+                }
+
+                pending_file file = m_pending.front();
+                m_pending.pop_front();
+                m_busy = true;
+
+                lock.unlock();
+                process(file);
+                applyRetention();
+                lock.lock();
+            }
+        }
+
+        void process(const pending_file& file)
+        {
+            std::string path = file.path;
+
+            if( file.compress && m_compression != AC_NONE )
+            {
+                std::string target = path + extension();
+                std::string temporary = target + ".tmp";
+
+                // If compressing fails, the log is kept as it was.
+                if( compressFile(path, temporary) && std::rename(temporary.c_str(), target.c_str()) == 0 )
+                {
+                    std::remove(path.c_str());
+                    path = target;
+                }
+                else
+                {
+                    std::remove(temporary.c_str());
+                }
+            }
+
+            struct stat info;
+            if( ::stat(path.c_str(), &info) != 0 )
+                return;
+
+            archived_file archived;
+            archived.path = path;
+            archived.size = static_cast<uint64_t>(info.st_size);
+            archived.modified = info.st_mtime;
+
+            m_archived.push_back(archived);
+            m_archivedBytes += archived.size;
+        }
+
+        void applyRetention()
+        {
+            time_t now = ::time(NULL);
+
+            while( !m_archived.empty() )
+            {
+                const archived_file& oldest = m_archived.front();
+
+                bool expired =
+                    (m_retention.maxFiles > 0 && m_archived.size() > m_retention.maxFiles) ||
+                    (m_retention.maxBytes > 0 && m_archivedBytes > m_retention.maxBytes) ||
+                    (m_retention.maxAgeSeconds > 0 &&
+                     difftime(now, oldest.modified) > static_cast<double>(m_retention.maxAgeSeconds));
+                if( !expired )
+                    break;
+
+                std::remove(oldest.path.c_str());
+                m_archivedBytes -= oldest.size;
+                m_archived.pop_front();
+            }
+        }
+
+        bool compressFile(const std::string& from, const std::string& to)
+        {
+            std::ifstream input(from.c_str(), std::ios_base::in | std::ios_base::binary);
+            std::ofstream output(to.c_str(), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+            if( !input || !output )
+                return false;
+
+            bool compressed = false;
+            switch( m_compression )
+            {
+#ifdef CPPLOG_WITH_ZLIB
+                case AC_GZIP:
+                    compressed = compressGzip(input, output);
+                    break;
+#endif
+#ifdef CPPLOG_WITH_ZSTD
+                case AC_ZSTD:
+                    compressed = compressZstd(input, output);
+                    break;
+#endif
+                default:
+                    break;
+            }
+
+            output.close();
+            return compressed && !output.fail();
+        }
+
+#ifdef CPPLOG_WITH_ZLIB
+        void crewFunction()
+        {
+            helpers::lower_thread_priority();
+
+            boost::unique_lock<boost::mutex> lock(m_crewMutex);
+            for( ;; )
+            {
+                while( !m_crewStop && m_nextChunk >= m_roundSize )
+                    m_crewWake.wait(lock);
+                if( m_nextChunk >= m_roundSize )
+                    return;
+
+                compressNext(lock);
+            }
+        }
+
+        // Compresses the round's next chunk.  Needs m_crewMutex held.
+        void compressNext(boost::unique_lock<boost::mutex>& lock)
+        {
+            helpers::gzip_chunk& chunk = m_round[m_nextChunk++];
+
+            lock.unlock();
+            chunk.compress();
+            lock.lock();
+
+            if( --m_chunksLeft == 0 )
+                m_crewDone.notify_all();
+        }
+
+        // Compresses "count" chunks, between the crew and this thread.
+        void compressRound(helpers::gzip_chunk* chunks, size_t count)
+        {
+            boost::unique_lock<boost::mutex> lock(m_crewMutex);
+            m_round = chunks;
+            m_roundSize = count;
+            m_nextChunk = 0;
+            m_chunksLeft = count;
+            m_crewWake.notify_all();
+
+            while( m_nextChunk < m_roundSize )
+                compressNext(lock);
+            while( m_chunksLeft > 0 )
+                m_crewDone.wait(lock);
+
+            m_round = NULL;
+            m_roundSize = m_nextChunk = 0;
+        }
+
+        bool compressGzip(std::istream& input, std::ostream& output)
+        {
+            std::vector<helpers::gzip_chunk> chunks(m_threads);
+            bool done = false;
+
+            while( !done )
+            {
+                // Read one chunk per thread...
+                size_t count = 0;
+                while( count < chunks.size() && !done )
+                {
+                    std::string& data = chunks[count].input;
+                    data.resize(k_chunkSize);
+                    input.read(&data[0], static_cast<std::streamsize>(k_chunkSize));
+                    data.resize(static_cast<size_t>(input.gcount()));
+
+                    done = data.size() < k_chunkSize;
+                    if( !data.empty() || count == 0 )
+                        count++;
+                }
+
+                // ... compress them at the same time...
+                for( size_t i = 0; i < count; i++ )
+                    chunks[i].level = m_level;
+                compressRound(&chunks[0], count);
+
+                // ... and write them out in order.
+                for( size_t i = 0; i < count; i++ )
+                {
+                    if( !chunks[i].compressed )
+                        return false;
+                    output.write(chunks[i].output.data(), static_cast<std::streamsize>(chunks[i].output.size()));
+                }
+            }
+
+            return !input.bad();
+        }
+#endif
+
+#ifdef CPPLOG_WITH_ZSTD
+        bool compressZstd(std::istream& input, std::ostream& output)
+        {
+            ZSTD_CCtx* context = ZSTD_createCCtx();
+            if( !context )
+                return false;
+
+            ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, m_level < 0 ? ZSTD_CLEVEL_DEFAULT : m_level);
+            if( m_threads > 1 )
+                ZSTD_CCtx_setParameter(context, ZSTD_c_nbWorkers, static_cast<int>(m_threads));
+
+            std::vector<char> inBuffer(ZSTD_CStreamInSize());
+            std::vector<char> outBuffer(ZSTD_CStreamOutSize());
+            bool compressed = true;
+            bool last = false;
+
+            while( compressed && !last )
+            {
+                input.read(&inBuffer[0], static_cast<std::streamsize>(inBuffer.size()));
+                size_t length = static_cast<size_t>(input.gcount());
+                last = length < inBuffer.size();
+
+                ZSTD_inBuffer in = { &inBuffer[0], length, 0 };
+                for( ;; )
+                {
+                    ZSTD_outBuffer out = { &outBuffer[0], outBuffer.size(), 0 };
+                    size_t remaining = ZSTD_compressStream2(context, &out, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+                    if( ZSTD_isError(remaining) )
+                    {
+                        compressed = false;
+                        break;
+                    }
+
+                    output.write(&outBuffer[0], static_cast<std::streamsize>(out.pos));
+                    if( last ? remaining == 0 : in.pos == in.size )
+                        break;
+                }
+            }
+
+            ZSTD_freeCCtx(context);
+            return compressed && !input.bad();
+        }
+#endif
+
+    public:
+        // "threads" is how many cores may compress one file (0 = one per
+        // core, up to k_defaultThreads).  A "level" of -1 means the
+        // compressor's default.
+        LogArchiver(Compression compression, const RetentionPolicy& retention,
+                    unsigned int threads = 0, int level = -1)
+            : m_compression(compression), m_retention(retention),
+              m_threads(threads > 0 ? threads : defaultThreads()),
+              m_level(level), m_busy(false), m_stop(false), m_archivedBytes(0),
+#ifdef CPPLOG_WITH_ZLIB
+              m_round(NULL), m_roundSize(0), m_nextChunk(0), m_chunksLeft(0), m_crewStop(false),
+#endif
+              m_thread(boost::bind(&LogArchiver::run, this))
+        {
+#ifdef CPPLOG_WITH_ZLIB
+            // The worker is one of the threads.
+            if( m_compression == AC_GZIP )
+            {
+                for( unsigned int i = 1; i < m_threads; i++ )
+                    m_crew.create_thread(boost::bind(&LogArchiver::crewFunction, this));
+            }
+#endif
+        }
+
+        // Finishes any files already handed over.
+        ~LogArchiver()
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                m_stop = true;
+                m_wake.notify_one();
+            }
+            m_thread.join();
+
+#ifdef CPPLOG_WITH_ZLIB
+            {
+                boost::lock_guard<boost::mutex> lock(m_crewMutex);
+                m_crewStop = true;
+                m_crewWake.notify_all();
+            }
+            m_crew.join_all();
+#endif
+        }
+
+        // What compressing adds to a file's name.
+        const char* extension() const
+        {
+            switch( m_compression )
+            {
+#ifdef CPPLOG_WITH_ZLIB
+                case AC_GZIP:   return ".gz";
+#endif
+#ifdef CPPLOG_WITH_ZSTD
+                case AC_ZSTD:   return ".zst";
+#endif
+                default:        return "";
+            }
+        }
+
+        // Compresses a finished log, then applies the retention policy.
+        void archive(const std::string& path)
+        {
+            enqueue(path, true);
+        }
+
+        // Adds a file that's already archived (say, by an earlier run) to
+        // those the retention policy applies to.
+        void track(const std::string& path)
+        {
+            enqueue(path, false);
+        }
+
+        // Waits until every file handed over so far has been dealt with.
+        void wait()
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+            while( !m_pending.empty() || m_busy )
+                m_idle.wait(lock);
+        }
+    };
+#endif
+
+    namespace helpers
+    {
+        // Creates (or truncates) a log file.  On Linux, "preallocate" bytes
+        // of disk are reserved for it up front, without changing its size.
+        inline std::filebuf* open_segment(const std::string& path, std::streamoff preallocate)
+        {
+            std::filebuf* file = new std::filebuf();
+            file->open(path.c_str(), std::ios_base::out | std::ios_base::trunc);
+
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+            if( preallocate > 0 && file->is_open() )
+            {
+                int fd = ::open(path.c_str(), O_WRONLY);
+                if( fd >= 0 )
+                {
+                    int result = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(preallocate));
+                    (void)result;
+                    ::close(fd);
+                }
+            }
+#else
+            (void)preallocate;
+#endif
+            return file;
+        }
+
+        // Closes a log file, optionally waiting until it's on disk.
+        inline void close_segment(std::filebuf* file, const std::string& path, bool sync)
+        {
+            delete file;
+
+#ifndef _WIN32
+            if( sync )
+            {
+                int fd = ::open(path.c_str(), O_WRONLY);
+                if( fd >= 0 )
+                {
+                    int result = ::fsync(fd);
+                    (void)result;
+                    ::close(fd);
+                }
+            }
+#else
+            (void)path;
+            (void)sync;
+#endif
+        }
+
+#ifdef CPPLOG_THREADING
+        // Opens a rotating log's next file ahead of time, and closes (then
+        // archives) its finished ones, on a thread of its own.  That leaves
+        // only swapping files to the logging thread.
+        class segment_worker
+        {
+        private:
+            struct retired_segment
+            {
+                std::filebuf*   file;
+                std::string     path;
+                bool            sync;
+                LogArchiver*    archiver;
+            };
+
+            boost::mutex                    m_mutex;
+            boost::condition_variable       m_wake;
+            boost::condition_variable       m_prepared;
+
+            bool                            m_prepareRequested;
+            std::string                     m_preparePath;
+            std::streamoff                  m_preallocate;
+            std::filebuf*                   m_next;
+
+            std::deque<retired_segment>     m_retired;
+            bool                            m_closing;
+            boost::condition_variable       m_closed;
+            bool                            m_stop;
+
+            boost::thread                   m_thread;
+
+            // Not copyable.
+            segment_worker(const segment_worker&);
+            segment_worker& operator=(const segment_worker&);
+
+            void run()
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                for( ;; )
+                {
+                    // The next file comes first, since logging may be
+                    // waiting for it.
+                    if( m_prepareRequested )
+                    {
+                        std::string path = m_preparePath;
+                        std::streamoff preallocate = m_preallocate;
+                        m_prepareRequested = false;
+
+                        lock.unlock();
+                        std::filebuf* next = open_segment(path, preallocate);
+                        lock.lock();
+
+                        m_next = next;
+                        m_prepared.notify_all();
+                    }
+                    else if( !m_retired.empty() )
+                    {
+                        retired_segment segment = m_retired.front();
+                        m_retired.pop_front();
+
+                        m_closing = true;
+                        lock.unlock();
+                        close_segment(segment.file, segment.path, segment.sync);
+                        if( segment.archiver )
+                            segment.archiver->archive(segment.path);
+                        lock.lock();
+
+                        m_closing = false;
+                        if( m_retired.empty() )
+                            m_closed.notify_all();
+                    }
+                    else if( m_stop )
+                    {
+                        break;
+                    }
+                    else
+                    {
+                        m_wake.wait(lock);
+                    }
+                }
+            }
+
+        public:
+            segment_worker()
+                : m_prepareRequested(false), m_preallocate(0), m_next(NULL), m_closing(false), m_stop(false),
+                  m_thread(boost::bind(&segment_worker::run, this))
+            { }
+
+            // Finishes closing (and archiving) retired files.
+            ~segment_worker()
+            {
+                {
+                    boost::lock_guard<boost::mutex> lock(m_mutex);
+                    m_stop = true;
+                    m_wake.notify_one();
+                }
+                m_thread.join();
+                delete m_next;
+            }
+
+            // Starts opening the next file.  Only one may be pending.
+            void prepare(const std::string& path, std::streamoff preallocate)
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                m_prepareRequested = true;
+                m_preparePath = path;
+                m_preallocate = preallocate;
+                m_wake.notify_one();
+            }
+
+            // Returns the file from prepare(), waiting if it isn't open yet.
+            std::filebuf* take()
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                while( !m_next )
+                    m_prepared.wait(lock);
+
+                std::filebuf* next = m_next;
+                m_next = NULL;
+                return next;
+            }
+
+            // Closes a finished file, then hands it to "archiver" (if any).
+            void retire(std::filebuf* file, const std::string& path, bool sync, LogArchiver* archiver)
+            {
+                retired_segment segment;
+                segment.file = file;
+                segment.path = path;
+                segment.sync = sync;
+                segment.archiver = archiver;
+
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                m_retired.push_back(segment);
+                m_wake.notify_one();
+            }
+
+            // Waits until every retired file has been closed (and handed
+            // to its archiver).
+            void finish()
+            {
+                boost::unique_lock<boost::mutex> lock(m_mutex);
+                while( !m_retired.empty() || m_closing )
+                    m_closed.wait(lock);
+            }
+        };
+#endif
+    }
+
+    // Log to file, rotate when the log reaches a given size.  The next file
+    // is opened ahead of time, and finished ones are closed in the
+    // background (with CPPLOG_THREADING), so rotating only swaps files.
+    // A next file that already exists (say, with names that cycle) isn't
+    // touched until it's rotated to, as without CPPLOG_THREADING.
+    class SizeRotateFileLogger : public OstreamLogger
+    {
+    public:
+        typedef void (*pfBuildFileName)(unsigned long logNumber, std::string& newFileName, void* context);
+
+    private:
+        std::streamoff  m_maxSize;
+        std::streamoff  m_size;             // Written to the current file.
+        unsigned long   m_logNumber;
+
+        SizeRotateFileLogger::pfBuildFileName m_buildFunc;
+        void*           m_context;
+
+        std::string     m_fileName;
+        std::filebuf*   m_file;
+        std::ostream    m_outStream;
+
+        bool            m_preallocate;
+        bool            m_syncOnRotate;
+
+#ifdef CPPLOG_THREADING
+        LogArchiver*    m_archiver;
+
+        // Empty unless the next file is being created by m_worker.
+        std::string     m_nextFileName;
+        helpers::segment_worker m_worker;
+#endif
+
+    public:
+        SizeRotateFileLogger(pfBuildFileName nameFunc, std::streamoff maxSize)
+            : OstreamLogger(m_outStream), m_maxSize(maxSize), m_size(0), m_logNumber(0),
+              m_buildFunc(nameFunc), m_context(NULL),
+              m_file(NULL), m_outStream(NULL),
+              m_preallocate(false), m_syncOnRotate(false)
+#ifdef CPPLOG_THREADING
+              , m_archiver(NULL)
+#endif
+        {
+            OpenFirstLog();
+        }
+
+        SizeRotateFileLogger(pfBuildFileName nameFunc, void* context,
+                std::streamoff maxSize)
+            : OstreamLogger(m_outStream), m_maxSize(maxSize), m_size(0), m_logNumber(0),
+              m_buildFunc(nameFunc), m_context(context),
+              m_file(NULL), m_outStream(NULL),
+              m_preallocate(false), m_syncOnRotate(false)
+#ifdef CPPLOG_THREADING
+              , m_archiver(NULL)
+#endif
+        {
+            OpenFirstLog();
+        }
+
+        virtual ~SizeRotateFileLogger()
+        {
+            stopFlushTimer();
+
+#ifdef CPPLOG_THREADING
+            // We created the next file, and it was never written to.
+            if( !m_nextFileName.empty() )
+            {
+                delete m_worker.take();
+
+                struct stat info;
+                if( ::stat(m_nextFileName.c_str(), &info) == 0 && info.st_size == 0 )
+                    std::remove(m_nextFileName.c_str());
+            }
+#endif
+
+            m_outStream.rdbuf(NULL);
+            helpers::close_segment(m_file, m_fileName, m_syncOnRotate);
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            stream_lock lock(*this);
+
+            // Call the actual logger.
+            bool deleteMessage = OstreamLogger::sendLogMessage(logData);
+
+            // Check if we're over our limit.
+            m_size += logData->streamBuffer.length();
+            if( m_size > m_maxSize )
+            {
+                // Yep, rotate.
+                RotateLog();
+            }
+
+            return deleteMessage;
+        }
+
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            stream_lock lock(*this);
+
+            // Split the batch wherever the log would rotate.
+            size_t first = 0;
+
+            for( size_t i = 0; i < count; i++ )
+            {
+                m_size += logData[i]->streamBuffer.length();
+                if( m_size > m_maxSize )
+                {
+                    writeBatch(&logData[first], i - first + 1);
+                    first = i + 1;
+
+                    RotateLog();
+                }
+            }
+
+            if( first < count )
+                writeBatch(&logData[first], count - first);
+        }
+
+        // Reserve each file's full size on disk when it's created (Linux
+        // only), so that appending to it never waits on block allocation.
+        // Applies to files opened from then on.
+        void setPreallocate(bool preallocate)
+        {
+            m_preallocate = preallocate;
+        }
+
+        // Wait for each finished file to reach the disk when closing it.
+        void setSyncOnRotate(bool syncOnRotate)
+        {
+            m_syncOnRotate = syncOnRotate;
+        }
+
+#ifdef CPPLOG_THREADING
+        // Each log is handed to "archiver" once rotated away from.
+        void setArchiver(LogArchiver* archiver)
+        {
+            m_archiver = archiver;
+        }
+#endif
+
+    private:
+        std::streamoff Preallocation() const
+        {
+            return m_preallocate ? m_maxSize : 0;
+        }
+
+        void OpenFirstLog()
+        {
+            m_buildFunc(m_logNumber, m_fileName, m_context);
+            m_file = helpers::open_segment(m_fileName, Preallocation());
+            m_outStream.rdbuf(m_file);
+
+            PrepareNextLog();
+        }
+
+        void PrepareNextLog()
+        {
+#ifdef CPPLOG_THREADING
+            m_buildFunc(m_logNumber + 1, m_nextFileName, m_context);
+
+            // Only a new file can be created ahead of time: one that exists
+            // may be the current file, or a finished one still being
+            // closed or archived.
+            struct stat info;
+            if( m_nextFileName == m_fileName || ::stat(m_nextFileName.c_str(), &info) == 0 )
+                m_nextFileName.clear();
+            else
+                m_worker.prepare(m_nextFileName, Preallocation());
+#endif
+        }
+
+        void RotateLog()
+        {
+            std::filebuf* oldFile = m_file;
+            std::string oldFileName = m_fileName;
+            m_logNumber++;
+
+#ifdef CPPLOG_THREADING
+            if( !m_nextFileName.empty() )
+            {
+                // Swap in the next file, and let the old one be closed
+                // (and flushed) in the background.
+                m_file = m_worker.take();
+                m_fileName = m_nextFileName;
+                m_outStream.rdbuf(m_file);
+                m_worker.retire(oldFile, oldFileName, m_syncOnRotate, m_archiver);
+
+                PrepareNextLog();
+                m_size = 0;
+                streamReplaced();
+                return;
+            }
+#endif
+
+            // Close old file, open new file.
+            m_outStream.rdbuf(NULL);
+            helpers::close_segment(oldFile, oldFileName, m_syncOnRotate);
+
+#ifdef CPPLOG_THREADING
+            // The new file may be one still being closed.
+            m_worker.finish();
+#endif
+            m_buildFunc(m_logNumber, m_fileName, m_context);
+            m_file = helpers::open_segment(m_fileName, Preallocation());
+            m_outStream.rdbuf(m_file);
+
+#ifdef CPPLOG_THREADING
+            if( m_archiver && m_fileName != oldFileName )
+                m_archiver->archive(oldFileName);
+#endif
+
+            PrepareNextLog();
+            m_size = 0;
+            streamReplaced();
+        }
+    };
+
+    // Log to file, rotate every "x" seconds.  Rotations are aligned to
+    // local midnight: an interval of 3600 rotates at the top of every hour,
+    // and 86400 at midnight, even on days the clocks change.  (Intervals
+    // that don't divide a day evenly start over at midnight; longer ones
+    // count calendar days from midnight.)
+    //
+    // Each message goes to the file for the time it was captured.  With
+    // CPPLOG_THREADING, a timer also rotates on time while nothing is
+    // being logged; it sleeps until each boundary.  Files are named after
+    // the start of their interval, except for the first one, which is named
+    // after when it was opened.
+    class TimeRotateFileLogger : public OstreamLogger
+    {
+    public:
+        typedef void (*pfBuildFileName)(::tm* time, unsigned long logNumber,
+                                        std::string& newFileName, void* context);
+
+    private:
+        unsigned long   m_rotateInterval;
+        ::time_t        m_nextRotateTime;
+        unsigned long   m_logNumber;
+
+        cpplog::TimeRotateFileLogger::pfBuildFileName m_buildFunc;
+        void* m_context;
+
+        std::string     m_fileName;
+        std::ofstream   m_outStream;
+
+#ifdef CPPLOG_THREADING
+        LogArchiver*    m_archiver;
+        helpers::deadline_timer* m_rotateTimer;
+
+        // Returns the next boundary, to be called again then.
+        static ::time_t timerRotate(void* context)
+        {
+            TimeRotateFileLogger* logger = static_cast<TimeRotateFileLogger*>(context);
+
+            stream_lock lock(*logger);
+            logger->CheckRotate(::time(NULL));
+            return logger->m_nextRotateTime;
+        }
+#endif
+
+    public:
+        TimeRotateFileLogger(pfBuildFileName nameFunc, unsigned long intervalSeconds)
+            : OstreamLogger(m_outStream), m_rotateInterval(std::max(intervalSeconds, 1ul)), m_logNumber(0),
+              m_buildFunc(nameFunc), m_context(NULL)
+#ifdef CPPLOG_THREADING
+              , m_archiver(NULL), m_rotateTimer(NULL)
+#endif
+        {
+            Start();
+        }
+
+        TimeRotateFileLogger(pfBuildFileName nameFunc, void* context, unsigned long intervalSeconds)
+            : OstreamLogger(m_outStream), m_rotateInterval(std::max(intervalSeconds, 1ul)), m_logNumber(0),
+              m_buildFunc(nameFunc), m_context(context)
+#ifdef CPPLOG_THREADING
+              , m_archiver(NULL), m_rotateTimer(NULL)
+#endif
+        {
+            Start();
+        }
+
+        virtual ~TimeRotateFileLogger()
+        {
+#ifdef CPPLOG_THREADING
+            delete m_rotateTimer;
+#endif
+            stopFlushTimer();
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            stream_lock lock(*this);
+            CheckRotate(logData->messageTime);
+
+            // Call the actual logger.
+            return OstreamLogger::sendLogMessage(logData);
+        }
+
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            stream_lock lock(*this);
+
+            // Split the batch wherever the log would rotate.
+            size_t first = 0;
+
+            for( size_t i = 0; i < count; i++ )
+            {
+                if( logData[i]->messageTime >= m_nextRotateTime )
+                {
+                    if( i > first )
+                        writeBatch(&logData[first], i - first);
+                    first = i;
+
+                    CheckRotate(logData[i]->messageTime);
+                }
+            }
+
+            writeBatch(&logData[first], count - first);
+        }
+
+#ifdef CPPLOG_THREADING
+        // Each log is handed to "archiver" once rotated away from.
+        void setArchiver(LogArchiver* archiver)
+        {
+            m_archiver = archiver;
+        }
+#endif
+
+    private:
+        void Start()
+        {
+            // "Rotate" to open our initial log.
+            ::time_t currTime = ::time(NULL);
+            RotateLog(currTime);
+            m_nextRotateTime = NextRotateTime(currTime);
+
+#ifdef CPPLOG_THREADING
+            shareStream();
+            m_rotateTimer = new helpers::deadline_timer(&TimeRotateFileLogger::timerRotate, this, m_nextRotateTime);
+#endif
+        }
+
+        static const unsigned long k_secondsPerDay = 24 * 60 * 60;
+
+        // Local midnight at the start of "time"'s day, broken down into
+        // "timeInfo" as well.
+        static ::time_t Midnight(::time_t time, ::tm& timeInfo)
+        {
+            cpplog::helpers::slocaltime(&timeInfo, &time);
+            timeInfo.tm_hour = 0;
+            timeInfo.tm_min = 0;
+            timeInfo.tm_sec = 0;
+            timeInfo.tm_isdst = -1;
+            return ::mktime(&timeInfo);
+        }
+
+        // "count" intervals of a day or more after "from", counted in
+        // calendar days (plus any leftover seconds), so that a day is still
+        // a day when the clocks change.
+        ::time_t AddDays(::time_t from, unsigned long count) const
+        {
+            ::tm timeInfo;
+            cpplog::helpers::slocaltime(&timeInfo, &from);
+            timeInfo.tm_mday += static_cast<int>(count * (m_rotateInterval / k_secondsPerDay));
+            timeInfo.tm_sec += static_cast<int>(count * (m_rotateInterval % k_secondsPerDay));
+            timeInfo.tm_isdst = -1;
+            return ::mktime(&timeInfo);
+        }
+
+        // The first boundary after "time".
+        ::time_t NextRotateTime(::time_t time) const
+        {
+            ::tm timeInfo;
+            ::time_t midnight = Midnight(time, timeInfo);
+
+            if( m_rotateInterval >= k_secondsPerDay )
+                return AddDays(midnight, 1);
+
+            unsigned long sinceMidnight = static_cast<unsigned long>(difftime(time, midnight));
+            ::time_t next = midnight + static_cast<time_t>((sinceMidnight / m_rotateInterval + 1) * m_rotateInterval);
+
+            timeInfo.tm_mday++;
+            timeInfo.tm_isdst = -1;
+            return std::min(next, ::mktime(&timeInfo));
+        }
+
+        // The latest boundary at or before "time", which is no earlier than
+        // m_nextRotateTime.
+        ::time_t LatestRotateTime(::time_t time) const
+        {
+            if( m_rotateInterval < k_secondsPerDay )
+            {
+                ::tm timeInfo;
+                ::time_t midnight = Midnight(time, timeInfo);
+                unsigned long sinceMidnight = static_cast<unsigned long>(difftime(time, midnight));
+                return std::max(m_nextRotateTime,
+                                midnight + static_cast<time_t>(sinceMidnight / m_rotateInterval * m_rotateInterval));
+            }
+
+            // Longer intervals count on from m_nextRotateTime.  Guess by the
+            // seconds in between, then fix up for any clock changes.
+            unsigned long count = static_cast<unsigned long>(difftime(time, m_nextRotateTime) / m_rotateInterval);
+            while( count > 0 && AddDays(m_nextRotateTime, count) > time )
+                count--;
+            while( AddDays(m_nextRotateTime, count + 1) <= time )
+                count++;
+            return AddDays(m_nextRotateTime, count);
+        }
+
+        void CheckRotate(::time_t time)
+        {
+            // Have we passed the end of this log's interval?
+            if( time >= m_nextRotateTime )
+            {
+                // Yep, the new log starts at the latest boundary.
+                ::time_t start = LatestRotateTime(time);
+                m_nextRotateTime = NextRotateTime(start);
+
+                m_logNumber++;
+                flushStream();
+
+                RotateLog(start);
+            }
+        }
+
+        void RotateLog(time_t startTime)
+        {
+            ::tm timeInfo;
+            cpplog::helpers::slocaltime(&timeInfo, &startTime);
+
+            // Build a new file name.
+            std::string newFileName;
+            m_buildFunc(&timeInfo, m_logNumber, newFileName, m_context);
+
+            // Close old file, open new file.
+            m_outStream.close();
+#ifdef CPPLOG_THREADING
+            if( m_archiver && !m_fileName.empty() && m_fileName != newFileName )
+                m_archiver->archive(m_fileName);
+#endif
+            m_fileName = newFileName;
+            m_outStream.open(newFileName.c_str(), std::ios_base::out);
+        }
+    };
+
+    // Log to file, in a compact binary format.  File names, formats, level
+    // names and process/thread ID prefixes are written once per file, and
+    // messages only refer to them.  Messages from LOGF() are written with
+    // their arguments, still unformatted.  Use binarylogreader.hpp (or the
+    // cpplog-decode tool) to turn a file back into text.
+    //
+    // Each entry starts with a one-char tag.  Numbers ("v") are unsigned
+    // LEB128 varints:
+    //   0x7F "CPPLOG" 0x01             - file header
+    //   'S' v id, v length, chars      - string
+    //   'L' u8 level, v name           - level name
+    //   'C' v id, v fileName, v line, v format
+    //                                  - call site
+    //   'R' v site, u8 level, u8 flags, v idPrefix, v seconds,
+    //       v nanoseconds, v length, bytes
+    //                                  - message
+    // A string ID of 0 means "none".  A message's seconds are relative to
+    // the previous message's (zig-zag encoded, so they may go backwards),
+    // starting from 0 after each file header.  Unless a message has RF_RAW
+    // set, its default header is left out.
+    class BinaryFileLogger : public BaseLogger
+    {
+    public:
+        // Message flags.
+        enum
+        {
+            RF_DEFERRED = 1,        // The bytes are captured LOGF() arguments.
+            RF_RAW      = 2         // The bytes are the whole text.
+        };
+
+        static const char* fileHeader()
+        {
+            return "\x7f" "CPPLOG" "\x01";
+        }
+
+        static const size_t k_fileHeaderLength = 8;
+
+    private:
+        struct site_key
+        {
+            const char*     file;
+            unsigned long   line;
+            const char*     format;
+
+            bool operator<(const site_key& other) const
+            {
+                if( file != other.file )
+                    return std::less<const char*>()(file, other.file);
+                if( line != other.line )
+                    return line < other.line;
+                return std::less<const char*>()(format, other.format);
+            }
+        };
+
+        typedef std::map<site_key, uint32_t>        site_map;
+        typedef std::map<const char*, uint32_t>     string_map;
+#ifdef CPPLOG_SYSTEM_IDS
+        typedef std::pair<std::pair<uint64_t, uint64_t>, std::string> ids_key;
+        typedef std::map<ids_key, uint32_t>         ids_map;
+#endif
+
+        std::string     m_path;
+        std::ofstream   m_outStream;
+        std::string     m_buffer;
+
+        // Our dictionary.  Strings are static, so they're keyed by address.
+        site_map        m_sites;
+        string_map      m_strings;
+#ifdef CPPLOG_SYSTEM_IDS
+        ids_map         m_ids;
+#endif
+        uint32_t        m_nextId;
+        int64_t         m_lastSeconds;
+
+        void put(uint8_t value)
+        {
+            m_buffer += static_cast<char>(value);
+        }
+
+        void putVarint(uint64_t value)
+        {
+            while( value >= 0x80 )
+            {
+                m_buffer += static_cast<char>((value & 0x7F) | 0x80);
+                value >>= 7;
+            }
+            m_buffer += static_cast<char>(value);
+        }
+
+        uint32_t addString(const char* str, size_t length)
+        {
+            uint32_t id = m_nextId++;
+            m_buffer += 'S';
+            putVarint(id);
+            putVarint(length);
+            m_buffer.append(str, length);
+            return id;
+        }
+
+        uint32_t stringId(const char* str)
+        {
+            string_map::iterator it = m_strings.find(str);
+            if( it != m_strings.end() )
+                return it->second;
+
+            uint32_t id = addString(str, strlen(str));
+            m_strings.insert(std::make_pair(str, id));
+            return id;
+        }
+
+        uint32_t siteId(LogData* logData, const char* format)
+        {
+            site_key key = { logData->fullPath, logData->line, format };
+            site_map::iterator it = m_sites.find(key);
+            if( it != m_sites.end() )
+                return it->second;
+
+            uint32_t fileId = stringId(logData->fileName);
+            uint32_t formatId = format ? stringId(format) : 0;
+
+            uint32_t id = m_nextId++;
+            m_buffer += 'C';
+            putVarint(id);
+            putVarint(fileId);
+            putVarint(logData->line);
+            putVarint(formatId);
+
+            m_sites.insert(std::make_pair(key, id));
+            return id;
+        }
+
+        uint32_t idPrefixId(LogData* logData)
+        {
+#ifdef CPPLOG_SYSTEM_IDS
+            uint64_t threadId = 0;
+            memcpy(&threadId, &logData->threadId,
+                   sizeof(threadId) < sizeof(logData->threadId) ? sizeof(threadId) : sizeof(logData->threadId));
+
+            ids_key key(std::make_pair(static_cast<uint64_t>(logData->processId), threadId),
+                        std::string(logData->threadName));
+            ids_map::iterator it = m_ids.find(key);
+            if( it != m_ids.end() )
+                return it->second;
+
+            char prefix[helpers::thread_ids::k_maxPrefixLength];
+            size_t length = helpers::thread_ids::render(prefix, logData->processId, logData->threadId,
+                                                        logData->threadName);
+
+            uint32_t id = addString(prefix, length);
+            m_ids.insert(std::make_pair(key, id));
+            return id;
+#else
+            (void)logData;
+            return 0;
+#endif
+        }
+
+        void writeHeader()
+        {
+            m_buffer.append(fileHeader(), k_fileHeaderLength);
+            m_lastSeconds = 0;
+
+            for( loglevel_t level = LL_TRACE; level <= LL_FATAL; level++ )
+            {
+                uint32_t nameId = stringId(LogMessage::getLevelName(level));
+                m_buffer += 'L';
+                put(static_cast<uint8_t>(level));
+                putVarint(nameId);
+            }
+        }
+
+        void writeMessage(LogData* logData)
+        {
+            const char* format = NULL;
+            uint8_t flags = 0;
+
+            const char* data = logData->streamBuffer.data();
+            size_t length = static_cast<size_t>(logData->streamBuffer.length());
+
+#ifdef CPPLOG_DEFERRED_FORMAT
+            if( logData->isDeferred() )
+            {
+                format = logData->formatSite->format;
+                flags = RF_DEFERRED;
+            }
+            else
+#endif
+            if( logData->headerLength > 0 && logData->headerLength <= length )
+            {
+                data += logData->headerLength;
+                length -= logData->headerLength;
+            }
+            else
+            {
+                flags = RF_RAW;
+            }
+
+            uint32_t site = siteId(logData, format);
+            uint32_t idPrefix = idPrefixId(logData);
+
+            int64_t seconds = static_cast<int64_t>(logData->messageTime);
+            int64_t delta = seconds - m_lastSeconds;
+            m_lastSeconds = seconds;
+
+            m_buffer += 'R';
+            putVarint(site);
+            put(static_cast<uint8_t>(logData->level));
+            put(flags);
+            putVarint(idPrefix);
+            putVarint((static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+            putVarint(logData->messageNanos);
+            putVarint(length);
+            m_buffer.append(data, length);
+        }
+
+        void writeBuffer()
+        {
+            m_outStream.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+            m_outStream.flush();
+            m_buffer.clear();
+        }
+
+    public:
+        // When appending, the file gets a new header, and the dictionary
+        // starts over.
+        BinaryFileLogger(std::string logFilePath, bool append = false)
+            : m_path(logFilePath),
+              m_outStream(logFilePath.c_str(),
+                          std::ios_base::binary | (append ? std::ios_base::app : std::ios_base::out)),
+              m_nextId(1), m_lastSeconds(0)
+        {
+            writeHeader();
+            writeBuffer();
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            writeMessage(logData);
+            writeBuffer();
+            return true;
+        }
+
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            for( size_t i = 0; i < count; i++ )
+                writeMessage(logData[i]);
+            writeBuffer();
+        }
+
+        // We store LOGF() arguments as they are.
+        virtual bool acceptsDeferred() const
+        {
+            return true;
+        }
+    };
+
+#ifndef _WIN32
+    // Log to file through a memory mapping, so that logging a message is
+    // just a memcpy.  The file is grown (and mapped) in large windows
+    // ahead of what has been written, and cut back to what was actually
+    // written when the logger is closed or reopened.  Since the kernel
+    // owns the mapped pages, messages survive the process crashing - the
+    // file is then left with trailing zeros, which are trimmed the next
+    // time it is opened for appending.  Each window's blocks are reserved
+    // up front; if that (or mapping it) fails - say, the disk is full - we
+    // carry on with plain write()s.  POSIX only.
+    class MmapFileLogger : public BaseLogger
+    {
+    public:
+        static const size_t k_defaultWindowSize = 16 * 1024 * 1024;
+
+    private:
+        std::string     m_path;
+        int             m_fd;
+        size_t          m_windowSize;
+
+        char*           m_window;
+        off_t           m_windowStart;
+        off_t           m_length;
+
+        // Only maps blocks that are really there: writing to a page of a
+        // sparse file that the disk has no room for raises SIGBUS.
+        bool mapWindow(off_t start)
+        {
+            void* window = MAP_FAILED;
+            if( posix_fallocate(m_fd, start, static_cast<off_t>(m_windowSize)) == 0 )
+                window = mmap(NULL, m_windowSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, start);
+
+            if( window == MAP_FAILED )
+            {
+#ifdef CPPLOG_USE_METRICS
+                metrics().writeError();
+#endif
+                return false;
+            }
+
+            m_window = static_cast<char*>(window);
+            m_windowStart = start;
+            return true;
+        }
+
+        void unmapWindow()
+        {
+            if( m_window )
+                munmap(m_window, m_windowSize);
+            m_window = NULL;
+        }
+
+        // Where the text in an existing file ends, ignoring any zeros left
+        // over from a window that was never filled.
+        static off_t findEnd(int fd)
+        {
+            struct stat st;
+            if( fstat(fd, &st) != 0 )
+                return 0;
+
+            char block[4096];
+            off_t end = st.st_size;
+            while( end > 0 )
+            {
+                off_t start = end > static_cast<off_t>(sizeof(block)) ? end - static_cast<off_t>(sizeof(block)) : 0;
+                ssize_t count = pread(fd, block, static_cast<size_t>(end - start), start);
+                if( count != end - start )
+                    return end;
+
+                while( count > 0 && block[count - 1] == '\0' )
+                    count--;
+                if( count > 0 )
+                    return start + count;
+                end = start;
+            }
+            return 0;
+        }
+
+        // Once there's no window, writes what's left the plain way.
+        void write(const char* data, size_t length)
+        {
+            while( length > 0 && m_window )
+            {
+                size_t used = static_cast<size_t>(m_length - m_windowStart);
+                if( used == m_windowSize )
+                {
+                    unmapWindow();
+                    mapWindow(m_windowStart + static_cast<off_t>(m_windowSize));
+                    continue;
+                }
+
+                size_t count = std::min(length, m_windowSize - used);
+                memcpy(m_window + used, data, count);
+                m_length += static_cast<off_t>(count);
+                data += count;
+                length -= count;
+            }
+
+            while( length > 0 && m_fd >= 0 )
+            {
+                ssize_t count = pwrite(m_fd, data, length, m_length);
+                if( count < 0 && errno == EINTR )
+                    continue;
+                if( count <= 0 )
+                {
+#ifdef CPPLOG_USE_METRICS
+                    metrics().writeError();
+#endif
+                    break;
+                }
+
+                m_length += static_cast<off_t>(count);
+                data += count;
+                length -= static_cast<size_t>(count);
+            }
+        }
+
+        void openFile(const std::string& logFilePath, bool append)
+        {
+            m_path = logFilePath;
+            m_fd = open(logFilePath.c_str(), O_RDWR | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+            if( m_fd < 0 )
+                return;
+
+            m_length = append ? findEnd(m_fd) : 0;
+
+            // Windows have to start on a page boundary.
+            off_t pageSize = static_cast<off_t>(sysconf(_SC_PAGESIZE));
+            mapWindow(m_length - m_length % pageSize);
+        }
+
+        void closeFile()
+        {
+            unmapWindow();
+            if( m_fd >= 0 )
+            {
+                // Nothing to be done if this fails.
+                int result = ftruncate(m_fd, m_length);
+                (void)result;
+                ::close(m_fd);
+            }
+            m_fd = -1;
+        }
+
+    public:
+        // The window size is rounded up to a whole number of pages.
+        MmapFileLogger(std::string logFilePath, bool append = false,
+                       size_t windowSize = k_defaultWindowSize)
+            : m_fd(-1), m_window(NULL), m_windowStart(0), m_length(0)
+        {
+            size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            m_windowSize = (std::max(windowSize, pageSize) + pageSize - 1) / pageSize * pageSize;
+
+            openFile(logFilePath, append);
+        }
+
+        ~MmapFileLogger()
+        {
+            closeFile();
+        }
+
+        // Closes the current file (cutting it to length), and carries on in
+        // the given one.
+        void Reopen(std::string logFilePath, bool append = false)
+        {
+            closeFile();
+            openFile(logFilePath, append);
+        }
+
+        // Number of bytes in the file so far.
+        off_t getLength() const
+        {
+            return m_length;
+        }
+
+        // Whether messages are still going through the mapping, rather
+        // than write() (see above).
+        bool isMapped() const
+        {
+            return m_window != NULL;
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            write(logData->streamBuffer.data(), static_cast<size_t>(logData->streamBuffer.length()));
+            return true;
+        }
+    };
+#endif
+
+    // Tee logger - given two loggers, will forward a message to both.
+    class TeeLogger : public BaseLogger
+    {
+    private:
+        BaseLogger* m_logger1;
+        BaseLogger* m_logger2;
+
+        bool        m_logger1Owned;
+        bool        m_logger2Owned;
+
+    public:
+        TeeLogger(BaseLogger* one, BaseLogger* two)
+            : m_logger1(one), m_logger2(two),
+              m_logger1Owned(false), m_logger2Owned(false)
+        { }
+
+        TeeLogger(BaseLogger* one, bool ownOne, BaseLogger* two, bool ownTwo)
+            : m_logger1(one), m_logger2(two),
+              m_logger1Owned(ownOne), m_logger2Owned(ownTwo)
+        { }
+
+        TeeLogger(BaseLogger& one, BaseLogger& two)
+            : m_logger1(&one), m_logger2(&two),
+              m_logger1Owned(false), m_logger2Owned(false)
+        { }
+
+        TeeLogger(BaseLogger& one, bool ownOne, BaseLogger& two, bool ownTwo)
+            : m_logger1(&one), m_logger2(&two),
+              m_logger1Owned(ownOne), m_logger2Owned(ownTwo)
+        { }
+
+        ~TeeLogger()
+        {
+            if( m_logger1Owned )
+                delete m_logger1;
+            if( m_logger2Owned )
+                delete m_logger2;
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            // The first logger gets a reference of its own, and the second
+            // our caller's (see MultiplexLogger::sendLogMessage()).
+            logData->retain();
+            if( helpers::send_to(m_logger1, logData) )
+                LogDataPool::release(logData);
+
+            return helpers::send_to(m_logger2, logData);
+        }
+
+        virtual bool isEnabled(loglevel_t level) const
+        {
+            return m_logger1->isEnabled(level) || m_logger2->isEnabled(level);
+        }
+
+        // Messages are shared, so must be formatted before we get them.
+        virtual bool acceptsDeferred() const
+        {
+            return false;
+        }
+    };
+
+#ifdef CPPLOG_THREADING
+    class BackgroundLogger;
+#endif
+
+    // Multiplex logger - will forward a log message to all loggers.  The
+    // message itself is shared between them, so several may keep it (for
+    // instance, when each is a BackgroundLogger - see addQueuedLogger()).
+    class MultiplexLogger : public BaseLogger
+    {
+        struct LoggerInfo
+        {
+            BaseLogger* logger;
+            bool        owned;
+
+            LoggerInfo(BaseLogger* l, bool o)
+                : logger(l), owned(o)
+            { }
+        };
+        std::vector<LoggerInfo> m_loggers;
+
+    public:
+        MultiplexLogger()
+        { }
+
+        MultiplexLogger(BaseLogger* one)
+        {
+            m_loggers.push_back(LoggerInfo(one, false));
+        }
+
+        MultiplexLogger(BaseLogger& one)
+        {
+            m_loggers.push_back(LoggerInfo(&one, false));
+        }
+
+        MultiplexLogger(BaseLogger* one, bool owned)
+        {
+            m_loggers.push_back(LoggerInfo(one, owned));
+        }
+
+        MultiplexLogger(BaseLogger& one, bool owned)
+        {
+            m_loggers.push_back(LoggerInfo(&one, owned));
+        }
+
+        MultiplexLogger(BaseLogger* one, BaseLogger* two)
+        {
+            m_loggers.push_back(LoggerInfo(one, false));
+            m_loggers.push_back(LoggerInfo(two, false));
+        }
+
+        MultiplexLogger(BaseLogger* one, bool ownOne, BaseLogger* two, bool ownTwo)
+        {
+            m_loggers.push_back(LoggerInfo(one, ownOne));
+            m_loggers.push_back(LoggerInfo(two, ownTwo));
+        }
+
+        MultiplexLogger(BaseLogger& one, bool ownOne, BaseLogger& two, bool ownTwo)
+        {
+            m_loggers.push_back(LoggerInfo(&one, ownOne));
+            m_loggers.push_back(LoggerInfo(&two, ownTwo));
+        }
+
+        ~MultiplexLogger()
+        {
+            for( std::vector<LoggerInfo>::iterator It = m_loggers.begin();
+                 It != m_loggers.end();
+                 It++ )
+            {
+                if( (*It).owned )
+                    delete (*It).logger;
+            }
+        }
+
+        void addLogger(BaseLogger* logger)      { m_loggers.push_back(LoggerInfo(logger, false)); }
+        void addLogger(BaseLogger& logger)      { m_loggers.push_back(LoggerInfo(&logger, false)); }
+
+        void addLogger(BaseLogger* logger, bool owned)      { m_loggers.push_back(LoggerInfo(logger, owned)); }
+        void addLogger(BaseLogger& logger, bool owned)      { m_loggers.push_back(LoggerInfo(&logger, owned)); }
+
+#ifdef CPPLOG_THREADING
+        // Sends to "logger" from a queue and thread of its own, so that a
+        // slow logger can hold up neither the others nor the caller.  The
+        // queue holds "capacity" messages (see BackgroundLogger::QE_RING),
+        // and drops new ones when full; the policy can be changed through
+        // the returned BackgroundLogger, before logging starts.
+        inline BackgroundLogger& addQueuedLogger(BaseLogger* logger, bool owned, size_t capacity = 0);
+#endif
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            if( m_loggers.empty() )
+                return true;
+
+            // Every logger but the last gets a reference of its own, which
+            // we give up straight away if it doesn't keep the message.
+            // The last one gets our caller's.
+            for( size_t i = 0; i + 1 < m_loggers.size(); i++ )
+            {
+                logData->retain();
+                if( helpers::send_to(m_loggers[i].logger, logData) )
+                    LogDataPool::release(logData);
+            }
+
+            return helpers::send_to(m_loggers.back().logger, logData);
+        }
+
+        // Hands each logger the whole batch, sharing the messages as above.
+        virtual void sendLogMessages(LogData** logData, size_t count)
+        {
+            if( m_loggers.empty() )
+                return;
+
+            std::vector<LogData*> shared;
+            for( size_t i = 0; i + 1 < m_loggers.size(); i++ )
+            {
+                shared.assign(logData, logData + count);
+                for( size_t j = 0; j < count; j++ )
+                    shared[j]->retain();
+
+                helpers::send_to(m_loggers[i].logger, &shared[0], count);
+
+                for( size_t j = 0; j < count; j++ )
+                {
+                    if( shared[j] )
+                        LogDataPool::release(shared[j]);
+                }
+            }
+
+            helpers::send_to(m_loggers.back().logger, logData, count);
+        }
+
+        virtual bool isEnabled(loglevel_t level) const
+        {
+            for( std::vector<LoggerInfo>::const_iterator It = m_loggers.begin();
+                 It != m_loggers.end();
+                 It++ )
+            {
+                if( (*It).logger->isEnabled(level) )
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Messages are shared, and one logger can't format a message in
+        // place while another may be reading it - so they must be
+        // formatted before we get them.
+        virtual bool acceptsDeferred() const
+        {
+            return false;
+        }
+    };
+
+    // Filtering logger.  Will not forward all messages less than a given level.
+    class FilteringLogger : public BaseLogger
+    {
+    private:
+        loglevel_t      m_lowestLevelAllowed;
+        BaseLogger*     m_forwardTo;
+        bool            m_owned;
+
+    public:
+        FilteringLogger(loglevel_t level, BaseLogger* forwardTo)
+            : m_lowestLevelAllowed(level), m_forwardTo(forwardTo), m_owned(false)
+        { }
+
+        FilteringLogger(loglevel_t level, BaseLogger& forwardTo)
+            : m_lowestLevelAllowed(level), m_forwardTo(&forwardTo), m_owned(false)
+        { }
+
+        FilteringLogger(loglevel_t level, BaseLogger* forwardTo, bool owned)
+            : m_lowestLevelAllowed(level), m_forwardTo(forwardTo), m_owned(owned)
+        { }
+
+        FilteringLogger(loglevel_t level, BaseLogger& forwardTo, bool owned)
+            : m_lowestLevelAllowed(level), m_forwardTo(&forwardTo), m_owned(owned)
+        { }
+
+        ~FilteringLogger()
+        {
+            if( m_owned )
+                delete m_forwardTo;
+        }
+
+        void SetLevel(loglevel_t allowed)
+        {
+            m_lowestLevelAllowed = allowed;
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            if( logData->level >= m_lowestLevelAllowed )
+                return helpers::send_to(m_forwardTo, logData);
+
+#ifdef CPPLOG_USE_METRICS
+            metrics().filtered();
+#endif
+            return true;
+        }
+
+        virtual bool isEnabled(loglevel_t level) const
+        {
+            return level >= m_lowestLevelAllowed && m_forwardTo->isEnabled(level);
+        }
+
+        virtual bool acceptsDeferred() const
+        {
+            return m_forwardTo->acceptsDeferred();
+        }
+    };
+
+    // Logger that moves all processing of log messages to a background thread.
+    // Only include if we have support for threading.
+#ifdef CPPLOG_THREADING
+    namespace helpers
+    {
+        // The queue a BackgroundLogger hands messages to its thread through.
+        // This lets us pick the queueing engine at construction.
+        class log_queue
+        {
+        public:
+            virtual void push(LogData* const& logData) = 0;
+            virtual bool try_push(LogData* const& logData) = 0;
+            virtual bool try_pop(LogData*& logData) = 0;
+            virtual void wait_and_pop(LogData*& logData) = 0;
+
+            // Pops the oldest message the calling producer may drop to make
+            // room for its own.
+            virtual bool drop_oldest(LogData*& logData) = 0;
+            virtual void wait_and_pop_all(std::vector<LogData*>& logData, size_t max) = 0;
+
+            virtual ~log_queue() { }
+        };
+
+        template<typename Queue>
+        class basic_log_queue : public log_queue
+        {
+        protected:
+            Queue   m_queue;
+
+        public:
+            explicit basic_log_queue(size_t capacity)
+                : m_queue(capacity)
+            { }
+
+            template<typename Arg>
+            basic_log_queue(size_t capacity, Arg arg)
+                : m_queue(capacity, arg)
+            { }
+
+            virtual void push(LogData* const& logData)
+            {
+                m_queue.push(logData);
+            }
+
+            virtual bool try_push(LogData* const& logData)
+            {
+                return m_queue.try_push(logData);
+            }
+
+            virtual bool try_pop(LogData*& logData)
+            {
+                return m_queue.try_pop(logData);
+            }
+
+            virtual void wait_and_pop(LogData*& logData)
+            {
+                m_queue.wait_and_pop(logData);
+            }
+
+            virtual bool drop_oldest(LogData*& logData)
+            {
+                return m_queue.try_pop(logData);
+            }
+
+            virtual void wait_and_pop_all(std::vector<LogData*>& logData, size_t max)
+            {
+                m_queue.wait_and_pop_all(logData, max);
+            }
+        };
+
+        // Counts the threads that are handing a BackgroundLogger a message,
+        // so that Stop() can wait for them.  Each thread counts itself on
+        // one of k_shards cache lines, handed out in turn, so threads only
+        // share a line once more than k_shards of them have logged.
+        class producer_count
+        {
+        private:
+            static const size_t cache_line_size = 64;
+            static const size_t k_shards = 64;
+
+            struct shard
+            {
+                boost::atomic<unsigned int> count;
+                char                        pad[cache_line_size - sizeof(boost::atomic<unsigned int>) % cache_line_size];
+
+                shard() : count(0) { }
+            };
+
+            void*   m_storage;
+            shard*  m_shards;
+
+            // Not copyable.
+            producer_count(const producer_count&);
+            producer_count& operator=(const producer_count&);
+
+            // Unlike metrics_shard(), this never changes for a thread, so
+            // it leaves the same shard it entered.
+            static size_t thread_shard()
+            {
+                static boost::atomic<size_t> s_nextShard(0);
+                static CPPLOG_THREAD_LOCAL size_t t_shard = 0;      // One more than the shard.
+                if( !t_shard )
+                    t_shard = s_nextShard.fetch_add(1, boost::memory_order_relaxed) % k_shards + 1;
+                return t_shard - 1;
+            }
+
+        public:
+            producer_count()
+            {
+                m_storage = std::malloc(k_shards * sizeof(shard) + cache_line_size);
+                if( !m_storage )
+                    throw std::bad_alloc();
+
+                m_shards = reinterpret_cast<shard*>(
+                                (reinterpret_cast<size_t>(m_storage) + cache_line_size - 1) & ~(cache_line_size - 1)
+                           );
+                for( size_t i = 0; i < k_shards; i++ )
+                    new (&m_shards[i]) shard();
+            }
+
+            ~producer_count()
+            {
+                for( size_t i = 0; i < k_shards; i++ )
+                    m_shards[i].~shard();
+                std::free(m_storage);
+            }
+
+            // Returns the shard to hand to leave().  The caller must check
+            // whether it's still welcome after this, not before.
+            size_t enter()
+            {
+                size_t i = thread_shard();
+                m_shards[i].count.fetch_add(1, boost::memory_order_seq_cst);
+                return i;
+            }
+
+            void leave(size_t i)
+            {
+                m_shards[i].count.fetch_sub(1, boost::memory_order_release);
+            }
+
+            // Waits until nobody who entered before this is still inside.
+            void wait_until_idle() const
+            {
+                for( size_t i = 0; i < k_shards; i++ )
+                {
+                    while( m_shards[i].count.load(boost::memory_order_seq_cst) != 0 )
+                        boost::this_thread::yield();
+                }
+            }
+        };
+
+        // Orders messages by the time they were captured.
+        struct log_data_before
+        {
+            bool operator()(const LogData* a, const LogData* b) const
+            {
+                if( a->messageTime != b->messageTime )
+                    return a->messageTime < b->messageTime;
+                return a->messageNanos < b->messageNanos;
+            }
+        };
+
+        // Only a thread's own buffer can be full, so that's where room is
+        // made.  The LogDataPool keeps enough messages to fill every
+        // thread's buffer.
+        class per_thread_log_queue
+            : public basic_log_queue< per_thread_queue<LogData*, log_data_before> >
+        {
+        private:
+            static void capacityChanged(std::ptrdiff_t change)
+            {
+                if( change > 0 )
+                    LogDataPool::reserve(static_cast<size_t>(change));
+                else
+                    LogDataPool::unreserve(static_cast<size_t>(-change));
+            }
+
+        public:
+            explicit per_thread_log_queue(size_t capacity)
+                : basic_log_queue< per_thread_queue<LogData*, log_data_before> >(
+                        capacity, &per_thread_log_queue::capacityChanged)
+            { }
+
+            virtual bool drop_oldest(LogData*& logData)
+            {
+                return m_queue.try_pop_local(logData);
+            }
+        };
+    }
+
+    class BackgroundLogger : public BaseLogger
+    {
+    public:
+        // Queueing engines:
+        //  QE_MUTEX - queue behind a mutex (the default).  Unbounded unless
+        //             given a capacity.
+        //  QE_RING  - bounded lock-free ring.
+        //  QE_PER_THREAD - a bounded buffer for each thread that logs to us,
+        //             merged by capture time.  Producers write nothing
+        //             another producer writes, until more than 64 threads
+        //             have logged to us.  The capacity is per thread.
+        enum QueueEngine
+        {
+            QE_MUTEX,
+            QE_RING,
+            QE_PER_THREAD
+        };
+
+        // What to do with a new message when the queue is full:
+        //  OP_BLOCK            - wait for room (the default).
+        //  OP_DROP_NEWEST      - drop the new message.
+        //  OP_DROP_OLDEST      - drop the oldest queued message to make room.
+        //  OP_DROP_BELOW_LEVEL - drop the new message if it is below a given
+        //                        level (LL_ERROR by default), otherwise wait.
+        enum OverflowPolicy
+        {
+            OP_BLOCK,
+            OP_DROP_NEWEST,
+            OP_DROP_OLDEST,
+            OP_DROP_BELOW_LEVEL
+        };
+
+        static const size_t k_defaultRingCapacity = 8192;
+        static const size_t k_defaultPerThreadCapacity = 1024;
+        static const size_t k_maxBatchSize        = 1024;
+
+    private:
+        BaseLogger*                 m_forwardTo;
+        bool                        m_owned;
+        helpers::log_queue*         m_queue;
+        size_t                      m_poolReserve;  // What we asked LogDataPool to keep.
+
+        boost::thread               m_backgroundThread;
+        LogData*                    m_dummyItem;
+        boost::atomic<bool>         m_stopped;
+        helpers::producer_count     m_producers;    // Threads in sendLogMessage().
+
+        OverflowPolicy              m_overflowPolicy;
+        loglevel_t                  m_keepLevel;
+        std::string                 m_formatScratch;
+        boost::atomic<unsigned long> m_dropped;
+        unsigned long               m_droppedReported;
+
+#ifdef CPPLOG_USE_METRICS
+        // Only written by the background thread.
+        boost::atomic<uint64_t>     m_delivered;
+        boost::atomic<uint64_t>     m_peakDepth;
+        boost::atomic<uint64_t>     m_writes;
+        boost::atomic<uint64_t>     m_writeNanos;
+        boost::atomic<uint64_t>     m_writeLatency[LoggerMetrics::k_latencyBuckets];
+
+        // Messages we've been given that are neither delivered nor dropped.
+        uint64_t queueDepth() const
+        {
+            LoggerMetrics counted;
+            BaseLogger::getMetrics(counted);
+
+            uint64_t gone = counted.messagesDropped + m_delivered.load(boost::memory_order_relaxed);
+            return counted.messagesAccepted > gone ? counted.messagesAccepted - gone : 0;
+        }
+
+        void recordWrite(uint64_t nanos)
+        {
+            size_t bucket = 0;
+            for( uint64_t micros = nanos / 1000; micros > 0 && bucket < LoggerMetrics::k_latencyBuckets - 1; micros >>= 1 )
+                bucket++;
+
+            m_writeLatency[bucket].store(m_writeLatency[bucket].load(boost::memory_order_relaxed) + 1,
+                                         boost::memory_order_relaxed);
+            m_writeNanos.store(m_writeNanos.load(boost::memory_order_relaxed) + nanos, boost::memory_order_relaxed);
+            m_writes.store(m_writes.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+        }
+#endif
+
+        // Counts a thread in while it hands us a message, so that Stop()
+        // can wait for it before queueing the dummy item.
+        class producer_scope
+        {
+        private:
+            helpers::producer_count&    m_count;
+            size_t                      m_shard;
+
+        public:
+            explicit producer_scope(helpers::producer_count& count)
+                : m_count(count), m_shard(count.enter())
+            { }
+
+            ~producer_scope()
+            {
+                m_count.leave(m_shard);
+            }
+        };
+
+        void dropMessage(LogData* logData)
+        {
+            m_dropped.fetch_add(1, boost::memory_order_relaxed);
+#ifdef CPPLOG_USE_METRICS
+            metrics().dropped();
+#endif
+            LogDataPool::release(logData);
+        }
+
+        // Tells our logger about anything that's been dropped since we last
+        // checked.  Only called from the background thread.
+        void reportDropped()
+        {
+            unsigned long dropped = m_dropped.load(boost::memory_order_relaxed);
+            if( dropped == m_droppedReported )
+                return;
+
+            LogMessage(__FILE__, __LINE__, LL_WARN, m_forwardTo).getStream()
+                << (dropped - m_droppedReported) << " messages dropped";
+            m_droppedReported = dropped;
+        }
+
+        void backgroundFunction()
+        {
+            std::vector<LogData*> batch;
+            batch.reserve(k_maxBatchSize);
+
+            bool running = true;
+            while( running )
+            {
+                // Take everything that's pending, and hand it on as one batch.
+                batch.clear();
+                m_queue->wait_and_pop_all(batch, k_maxBatchSize);
+
+                size_t count = batch.size();
+                for( size_t i = 0; i < batch.size(); i++ )
+                {
+                    if( batch[i] == m_dummyItem )
+                    {
+                        count = i;
+                        running = false;
+                        break;
+                    }
+                }
+
+                if( count > 0 )
+                {
+#ifdef CPPLOG_USE_METRICS
+                    // Everything in this batch was still queued a moment ago.
+                    uint64_t depth = queueDepth();
+                    if( depth > m_peakDepth.load(boost::memory_order_relaxed) )
+                        m_peakDepth.store(depth, boost::memory_order_relaxed);
+
+                    uint64_t started = helpers::monotonic_nanos();
+#endif
+
+                    // Format any deferred messages, unless our logger wants
+                    // them as they are.
+                    if( !m_forwardTo->acceptsDeferred() )
+                    {
+                        for( size_t i = 0; i < count; i++ )
+                            batch[i]->materialize(m_formatScratch);
+                    }
+
+                    helpers::send_to(m_forwardTo, &batch[0], count);
+
+#ifdef CPPLOG_USE_METRICS
+                    recordWrite(helpers::monotonic_nanos() - started);
+                    m_delivered.store(m_delivered.load(boost::memory_order_relaxed) + count,
+                                      boost::memory_order_relaxed);
+#endif
+                }
+
+                reportDropped();
+
+                // Free whatever the logger didn't keep, along with the dummy
+                // item.
+                for( size_t i = 0; i < batch.size(); i++ )
+                {
+                    if( batch[i] )
+                        LogDataPool::release(batch[i]);
+                }
+            }
+        }
+
+        void Init(QueueEngine engine, size_t capacity)
+        {
+            m_overflowPolicy = OP_BLOCK;
+            m_keepLevel = LL_ERROR;
+            m_dropped = 0;
+            m_droppedReported = 0;
+
+#ifdef CPPLOG_USE_METRICS
+            m_delivered = 0;
+            m_peakDepth = 0;
+            m_writes = 0;
+            m_writeNanos = 0;
+            for( size_t i = 0; i < LoggerMetrics::k_latencyBuckets; i++ )
+                m_writeLatency[i] = 0;
+#endif
+
+            switch( engine )
+            {
+                case QE_RING:
+                    m_queue = new helpers::basic_log_queue< ring_queue<LogData*> >(
+                                    capacity ? capacity : k_defaultRingCapacity);
+                    break;
+                case QE_PER_THREAD:
+                    m_queue = new helpers::per_thread_log_queue(
+                                    capacity ? capacity : k_defaultPerThreadCapacity);
+                    break;
+                case QE_MUTEX:
+                default:
+                    m_queue = new helpers::basic_log_queue< concurrent_queue<LogData*> >(capacity);
+                    break;
+            };
+
+            // Our thread frees messages in bursts as big as the queue, so
+            // the pool has to keep that many for the callers to reuse.  An
+            // unbounded queue gets as much as a default ring would.
+            // (QE_PER_THREAD reserves room for each thread's buffer as the
+            // thread turns up.)
+            m_poolReserve = 0;
+            if( engine != QE_PER_THREAD )
+                m_poolReserve = capacity ? capacity : k_defaultRingCapacity;
+            LogDataPool::reserve(m_poolReserve);
+
+            // Create dummy item.  It sorts after everything else, so that
+            // QE_PER_THREAD delivers whatever is already queued first.
+            m_dummyItem = LogDataPool::acquire(LL_TRACE);
+            m_dummyItem->messageTime = (std::numeric_limits<time_t>::max)();
+            m_dummyItem->messageNanos = 0;
+
+            // And create background thread.
+            m_backgroundThread = boost::thread(&BackgroundLogger::backgroundFunction, this);
+        }
+
+    public:
+        BackgroundLogger(BaseLogger* forwardTo)
+            : m_forwardTo(forwardTo), m_owned(false), m_stopped(false)
+        {
+            Init(QE_MUTEX, 0);
+        }
+
+        BackgroundLogger(BaseLogger& forwardTo)
+            : m_forwardTo(&forwardTo), m_owned(false), m_stopped(false)
+        {
+            Init(QE_MUTEX, 0);
+        }
+
+        // A capacity of 0 picks the engine's default - unbounded for
+        // QE_MUTEX, k_defaultRingCapacity for QE_RING, and
+        // k_defaultPerThreadCapacity for QE_PER_THREAD.
+        BackgroundLogger(BaseLogger* forwardTo, QueueEngine engine,
+                         size_t capacity = 0)
+            : m_forwardTo(forwardTo), m_owned(false), m_stopped(false)
+        {
+            Init(engine, capacity);
+        }
+
+        BackgroundLogger(BaseLogger& forwardTo, QueueEngine engine,
+                         size_t capacity = 0)
+            : m_forwardTo(&forwardTo), m_owned(false), m_stopped(false)
+        {
+            Init(engine, capacity);
+        }
+
+        // As above, deleting "forwardTo" along with us if "owned".
+        BackgroundLogger(BaseLogger* forwardTo, bool owned, QueueEngine engine = QE_MUTEX,
+                         size_t capacity = 0)
+            : m_forwardTo(forwardTo), m_owned(owned), m_stopped(false)
+        {
+            Init(engine, capacity);
+        }
+
+        void Stop()
+        {
+            // Only stop once.
+            if( m_stopped.exchange(true) )
+                return;
+
+            // Anyone who got in before that finishes queueing, so nothing
+            // ends up behind the dummy item.
+            m_producers.wait_until_idle();
+
+            // Push our "dummy" item on the queue ...
+            m_queue->push(m_dummyItem);
+
+            // ... and wait for thread to terminate.
+            m_backgroundThread.join();
+
+            // NOTE: The loop will free the dummy item for us, we can ignore it.
+        }
+
+        ~BackgroundLogger()
+        {
+            Stop();
+            delete m_queue;
+            LogDataPool::unreserve(m_poolReserve);
+
+            if( m_owned )
+                delete m_forwardTo;
+        }
+
+        // Only matters if the queue is bounded.  Not thread-safe - set this
+        // up before logging to us.
+        void setOverflowPolicy(OverflowPolicy policy, loglevel_t keepLevel = LL_ERROR)
+        {
+            m_overflowPolicy = policy;
+            m_keepLevel = keepLevel;
+        }
+
+        // Number of messages dropped so far because the queue was full.
+        unsigned long getDroppedCount() const
+        {
+            return m_dropped.load(boost::memory_order_relaxed);
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            producer_scope producing(m_producers);
+
+            // Nobody is left to deliver this - let the caller delete it.
+            if( m_stopped.load(boost::memory_order_seq_cst) )
+            {
+#ifdef CPPLOG_USE_METRICS
+                metrics().dropped();
+#endif
+                return true;
+            }
+
+            // Don't hold on to a big chunk while we're queued.
+            logData->streamBuffer.compact();
+
+            if( m_queue->try_push(logData) )
+                return false;
+
+            // The queue is full.
+            switch( m_overflowPolicy )
+            {
+                case OP_DROP_BELOW_LEVEL:
+                    if( logData->level >= m_keepLevel )
+                        break;
+                    // Fall through.
+                case OP_DROP_NEWEST:
+                    dropMessage(logData);
+                    return false;
+
+                case OP_DROP_OLDEST:
+                    // (The dummy item is only queued once every producer
+                    // is done, so it's never what we drop.)
+                    for( ;; )
+                    {
+                        LogData* oldest;
+                        if( m_queue->drop_oldest(oldest) )
+                            dropMessage(oldest);
+
+                        if( m_queue->try_push(logData) )
+                            return false;
+                    }
+
+                case OP_BLOCK:
+                default:
+                    break;
+            };
+
+            m_queue->push(logData);
+
+            // Don't delete - the background thread should handle this.
+            return false;
+        }
+
+        virtual bool isEnabled(loglevel_t level) const
+        {
+            return m_forwardTo->isEnabled(level);
+        }
+
+        // Formatting is done on our thread, instead of the caller's.
+        virtual bool acceptsDeferred() const
+        {
+            return true;
+        }
+
+        // Like sendLogMessage(), but never waits for room in the queue.
+        // Returns true if the message was queued, in which case we now own
+        // it; otherwise, the caller still does.
+        bool trySendLogMessage(LogData* logData)
+        {
+            producer_scope producing(m_producers);
+            if( m_stopped.load(boost::memory_order_seq_cst) )
+                return false;
+
+            logData->streamBuffer.compact();
+#ifdef CPPLOG_USE_METRICS
+            // Once queued, it may be gone at any moment.
+            size_t length = static_cast<size_t>(logData->streamBuffer.length());
+#endif
+            if( !m_queue->try_push(logData) )
+                return false;
+
+#ifdef CPPLOG_USE_METRICS
+            // Nobody else counts these, since they don't come through
+            // helpers::send_to().
+            metrics().accepted(length);
+#endif
+            return true;
+        }
+
+        virtual void getMetrics(LoggerMetrics& metrics) const
+        {
+            BaseLogger::getMetrics(metrics);
+
+#ifdef CPPLOG_USE_METRICS
+            metrics.hasQueue = true;
+            metrics.queueDepth = queueDepth();
+            metrics.peakQueueDepth = std::max(metrics.queueDepth, m_peakDepth.load(boost::memory_order_relaxed));
+            metrics.writes = m_writes.load(boost::memory_order_relaxed);
+            metrics.writeNanos = m_writeNanos.load(boost::memory_order_relaxed);
+            for( size_t i = 0; i < LoggerMetrics::k_latencyBuckets; i++ )
+                metrics.writeLatency[i] = m_writeLatency[i].load(boost::memory_order_relaxed);
+#endif
+        }
+    };
+
+    inline BackgroundLogger& MultiplexLogger::addQueuedLogger(BaseLogger* logger, bool owned, size_t capacity)
+    {
+        BackgroundLogger* queue = new BackgroundLogger(logger, owned, BackgroundLogger::QE_RING, capacity);
+        queue->setOverflowPolicy(BackgroundLogger::OP_DROP_NEWEST);
+        addLogger(queue, true);
+        return *queue;
+    }
+
+    // When a BatchingLogger sends what it has gathered: once a batch holds
+    // "maxMessages" messages or "maxBytes" bytes, or its first message is
+    // "maxDelayMillis" old.  Up to "inFlight" batches are sent before
+    // waiting for a reply, and up to "maxPending" wait to be sent; past
+    // that, the oldest are dropped.  After TRY_LATER or a failure, it waits
+    // "retryMinMillis", doubling each time up to "retryMaxMillis".  When
+    // the logger is destroyed, it keeps trying for "shutdownMillis".
+    struct BatchPolicy
+    {
+        size_t          maxMessages;
+        size_t          maxBytes;
+        unsigned long   maxDelayMillis;
+        size_t          inFlight;
+        size_t          maxPending;
+        unsigned long   retryMinMillis;
+        unsigned long   retryMaxMillis;
+        unsigned long   shutdownMillis;
+
+        BatchPolicy(size_t messages = 1000, size_t bytes = 1024 * 1024, unsigned long delayMillis = 100)
+            : maxMessages(messages), maxBytes(bytes), maxDelayMillis(delayMillis),
+              inFlight(4), maxPending(256), retryMinMillis(50), retryMaxMillis(5000),
+              shutdownMillis(5000)
+        { }
+    };
+
+    // Somewhere a BatchingLogger sends batches of messages to, such as a
+    // Scribe node (see ScribeLogger).  Only used from the logger's sender
+    // thread.
+    class BatchTransport
+    {
+    public:
+        enum Result
+        {
+            BT_OK,
+            BT_TRY_LATER,           // Refused for now; send it again later.
+            BT_FAILED               // The connection failed.
+        };
+
+        struct Batch
+        {
+            std::string                 category;
+            std::vector<std::string>    messages;
+            size_t                      bytes;
+
+            Batch() : bytes(0) { }
+        };
+
+        // Connects, if not connected already.  Returns false if it can't.
+        virtual bool open() = 0;
+
+        // Drops the connection, after a failure.
+        virtual void close() = 0;
+
+        // Sends a batch, without waiting for the reply.  Returns false if
+        // the connection failed.
+        virtual bool send(const Batch& batch) = 0;
+
+        // Waits for the reply to the oldest batch not yet answered.
+        virtual Result receive() = 0;
+
+        virtual ~BatchTransport() { }
+    };
+
+    namespace helpers
+    {
+        // A file that batches are kept in while they can't be sent, oldest
+        // first.  Batches read back from it stay in the file until
+        // commit()'ed, so that they can be read again after a failed send.
+        // The file is emptied once everything in it has been sent, and is
+        // picked up again by the next process to open it, from the first
+        // batch not commit()'ed.
+        //
+        // The file starts with the (64-bit) offset of that batch.  Each
+        // batch is stored as its length, its category (length and chars),
+        // and its message count followed by each message (length and
+        // chars), all lengths being 32-bit.
+        //
+        // Only used from a BatchingLogger's sender thread, so it isn't
+        // locked.
+        class spool_file
+        {
+        private:
+            typedef BatchTransport::Batch Batch;
+
+            std::string     m_path;
+            uint64_t        m_maxBytes;
+            std::fstream    m_file;
+            uint64_t        m_read;
+            uint64_t        m_committed;
+            uint64_t        m_write;
+
+            static const uint64_t k_headerBytes = sizeof(uint64_t);
+
+            void putU32(size_t value)
+            {
+                uint32_t v = static_cast<uint32_t>(value);
+                m_file.write(reinterpret_cast<const char*>(&v), sizeof(v));
+            }
+
+            bool getU32(uint32_t& value, uint64_t& left)
+            {
+                if( left < sizeof(value) || !m_file.read(reinterpret_cast<char*>(&value), sizeof(value)) )
+                    return false;
+                left -= sizeof(value);
+                return true;
+            }
+
+            bool getString(std::string& value, uint64_t& left)
+            {
+                uint32_t length;
+                if( !getU32(length, left) || length > left )
+                    return false;
+
+                value.resize(length);
+                if( length > 0 && !m_file.read(&value[0], length) )
+                    return false;
+                left -= length;
+                return true;
+            }
+
+            // Reads the batch at m_read into "batch", or at least as much of
+            // it as there is.
+            bool readRecord(Batch& batch, uint64_t& length)
+            {
+                uint64_t left = m_write - m_read;
+                uint32_t recordLength, count;
+
+                m_file.clear();
+                m_file.seekg(static_cast<std::streamoff>(m_read));
+                if( !getU32(recordLength, left) || recordLength > left )
+                    return false;
+
+                left = recordLength;
+                if( !getString(batch.category, left) || !getU32(count, left) || count > left / sizeof(uint32_t) )
+                    return false;
+
+                batch.messages.resize(count);
+                batch.bytes = 0;
+                for( uint32_t i = 0; i < count; i++ )
+                {
+                    if( !getString(batch.messages[i], left) )
+                        return false;
+                    batch.bytes += batch.messages[i].length();
+                }
+
+                length = sizeof(recordLength) + recordLength;
+                return true;
+            }
+
+            void truncate()
+            {
+                m_file.close();
+                m_file.open(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+                m_read = m_committed = m_write = 0;
+            }
+
+            void writeHeader()
+            {
+                m_file.clear();
+                m_file.seekp(0);
+                m_file.write(reinterpret_cast<const char*>(&m_committed), sizeof(m_committed));
+                m_file.flush();
+            }
+
+        public:
+            spool_file(const std::string& path, uint64_t maxBytes)
+                : m_path(path), m_maxBytes(maxBytes), m_read(0), m_committed(0), m_write(0)
+            {
+                m_file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+                if( !m_file.is_open() )
+                {
+                    m_file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+                    return;
+                }
+
+                m_file.seekg(0, std::ios::end);
+                m_write = static_cast<uint64_t>(m_file.tellg());
+
+                // Start after what was sent last time.
+                uint64_t committed = 0;
+                m_file.seekg(0);
+                if( m_write < k_headerBytes ||
+                    !m_file.read(reinterpret_cast<char*>(&committed), sizeof(committed)) ||
+                    committed < k_headerBytes || committed > m_write )
+                {
+                    truncate();
+                    return;
+                }
+                m_read = m_committed = committed;
+            }
+
+            bool is_open() const
+            {
+                return m_file.is_open();
+            }
+
+            // Adds a batch to the end.  Returns false if it doesn't fit.
+            bool append(const Batch& batch)
+            {
+
+                uint64_t length = 3 * sizeof(uint32_t) + batch.category.length() +
+                                  batch.messages.size() * sizeof(uint32_t) + batch.bytes;
+                uint64_t start = m_write;
+                if( start == 0 )
+                    start = k_headerBytes;
+                if( start + length > m_maxBytes )
+                    return false;
+
+                if( m_write == 0 )
+                {
+                    m_read = m_committed = m_write = k_headerBytes;
+                    writeHeader();
+                }
+
+                m_file.clear();
+                m_file.seekp(static_cast<std::streamoff>(m_write));
+                putU32(length - sizeof(uint32_t));
+                putU32(batch.category.length());
+                m_file.write(batch.category.data(), batch.category.length());
+                putU32(batch.messages.size());
+                for( size_t i = 0; i < batch.messages.size(); i++ )
+                {
+                    putU32(batch.messages[i].length());
+                    m_file.write(batch.messages[i].data(), batch.messages[i].length());
+                }
+                m_file.flush();
+
+                if( m_file.fail() )
+                    return false;
+                m_write += length;
+                return true;
+            }
+
+            // Reads the next batches of one category into "batch", up to
+            // about "maxBytes" of messages.  "end" is what to commit() once
+            // it has been sent.  Returns false if there's nothing left to read.
+            bool read(Batch& batch, size_t maxBytes, uint64_t& end)
+            {
+
+                Batch record;
+                uint64_t length;
+                while( m_read < m_write && batch.bytes < maxBytes )
+                {
+                    if( !readRecord(record, length) )
+                    {
+                        // Cut short (say, by a crash while writing) - give
+                        // up on the rest.
+                        m_write = m_read;
+                        break;
+                    }
+
+                    if( !batch.messages.empty() && record.category != batch.category )
+                        break;
+
+                    batch.category.swap(record.category);
+                    batch.messages.insert(batch.messages.end(), record.messages.begin(), record.messages.end());
+                    batch.bytes += record.bytes;
+                    m_read += length;
+                }
+
+                end = m_read;
+                return !batch.messages.empty();
+            }
+
+            // Everything up to "end" has been sent.  (Until this is
+            // written out, a crash means sending it again.)
+            void commit(uint64_t end)
+            {
+                m_committed = std::max(m_committed, end);
+                if( m_committed == m_write && m_read == m_write && m_write > 0 )
+                    truncate();
+                else
+                    writeHeader();
+            }
+
+            // Goes back to reading from the first batch not commit()'ed.
+            void rewind()
+            {
+                m_read = m_committed;
+            }
+
+            // Whether everything written has been sent.
+            bool drained() const
+            {
+                return m_committed == m_write;
+            }
+
+            bool unread() const
+            {
+                return m_read < m_write;
+            }
+        };
+    }
+
+    // Gathers messages into batches, which a thread of its own sends
+    // through a BatchTransport, several at a time.  Logging only ever
+    // waits to add the message to the current batch - never on the
+    // network or the disk.  While batches can't be sent, they can be kept
+    // on disk (see setSpool()); the sender thread writes them there.
+    class BatchingLogger : public BaseLogger
+    {
+    public:
+        typedef BatchTransport::Batch Batch;
+
+    private:
+        // A batch on its way out, and where it came from.
+        struct outgoing
+        {
+            Batch*      batch;
+            bool        spooled;        // Read back from the spool, to be
+            uint64_t    spoolEnd;       // commit()'ed up to here once sent.
+
+            explicit outgoing(Batch* b, bool s = false)
+                : batch(b), spooled(s), spoolEnd(0)
+            { }
+        };
+        typedef std::deque<outgoing> outgoing_list;
+
+        BatchTransport*             m_transport;
+        bool                        m_owned;
+        std::string                 m_category;
+        BatchPolicy                 m_policy;
+
+        boost::mutex                m_mutex;
+        boost::condition_variable   m_wake;
+        Batch*                      m_current;
+        boost::system_time          m_currentStarted;
+        std::deque<Batch*>          m_pending;
+        std::deque<Batch*>          m_toSpool;      // For the sender to write to the spool.
+        bool                        m_healthy;
+        bool                        m_stopping;
+        boost::system_time          m_deadline;
+
+        helpers::spool_file*        m_spool;
+        size_t                      m_replayBytes;
+
+        boost::atomic<unsigned long> m_sent;
+        boost::atomic<unsigned long> m_dropped;
+        boost::thread               m_sender;
+
+        // Not copyable.
+        BatchingLogger(const BatchingLogger&);
+        BatchingLogger& operator=(const BatchingLogger&);
+
+        void dropBatch(Batch* batch)
+        {
+#ifdef CPPLOG_USE_METRICS
+            for( size_t i = 0; i < batch->messages.size(); i++ )
+                metrics().dropped();
+#endif
+            m_dropped.fetch_add(static_cast<unsigned long>(batch->messages.size()), boost::memory_order_relaxed);
+            delete batch;
+        }
+
+        // The following need m_mutex held.
+
+        // Hands a batch to the sender to add to the end of the spool.
+        void spoolBatch(Batch* batch)
+        {
+            m_toSpool.push_back(batch);
+            m_wake.notify_one();
+        }
+
+        // Writes out what spoolBatch() was given, unlocked, dropping what
+        // doesn't fit.  Only called from the sender thread.
+        void writeSpool(boost::unique_lock<boost::mutex>& lock)
+        {
+            std::deque<Batch*> batches;
+            batches.swap(m_toSpool);
+
+            lock.unlock();
+            for( size_t i = 0; i < batches.size(); i++ )
+            {
+                if( !m_spool->append(*batches[i]) )
+                    dropBatch(batches[i]);
+                else
+                    delete batches[i];
+            }
+            lock.lock();
+        }
+
+        void sealBatch()
+        {
+            Batch* batch = m_current;
+            m_current = NULL;
+
+            // While we can't get through, new batches queue up on disk,
+            // behind whatever is there already.
+            if( m_spool && !m_healthy )
+            {
+                spoolBatch(batch);
+            }
+            else
+            {
+                m_pending.push_back(batch);
+                while( m_pending.size() > m_policy.maxPending )
+                {
+                    if( m_spool )
+                        spoolBatch(m_pending.front());
+                    else
+                        dropBatch(m_pending.front());
+                    m_pending.pop_front();
+                }
+                m_wake.notify_one();
+            }
+
+            // Up to maxPending wait for the sender to write them out; past
+            // that (say, while it waits on the network), the oldest are
+            // dropped.
+            while( m_toSpool.size() > m_policy.maxPending )
+            {
+                dropBatch(m_toSpool.front());
+                m_toSpool.pop_front();
+            }
+        }
+
+        // Puts batches that didn't get through back in line, ahead of the
+        // rest: spooled ones are still in the spool, to be read again, and
+        // others go back to the front of the queue (or, if we have a
+        // spool, to the spool - along with the queue behind them).
+        void sendFailed(outgoing_list& unsent)
+        {
+            bool rewind = false;
+            std::deque<Batch*> batches;
+            for( size_t i = 0; i < unsent.size(); i++ )
+            {
+                if( unsent[i].spooled )
+                {
+                    rewind = true;
+                    delete unsent[i].batch;
+                }
+                else
+                {
+                    batches.push_back(unsent[i].batch);
+                }
+            }
+            unsent.clear();
+
+            if( rewind )
+                m_spool->rewind();
+
+            if( m_spool )
+            {
+                batches.insert(batches.end(), m_pending.begin(), m_pending.end());
+                m_pending.clear();
+                for( size_t i = 0; i < batches.size(); i++ )
+                    spoolBatch(batches[i]);
+            }
+            else
+            {
+                m_pending.insert(m_pending.begin(), batches.begin(), batches.end());
+            }
+
+            m_healthy = false;
+        }
+
+        // Out of time while stopping: keeps what's left in the spool, if
+        // there is one, and otherwise gives up on it.
+        void abandon(outgoing_list& unsent)
+        {
+            sendFailed(unsent);
+
+            if( m_current )
+                m_pending.push_back(m_current);
+            m_current = NULL;
+
+            for( size_t i = 0; i < m_pending.size(); i++ )
+            {
+                if( m_spool )
+                    spoolBatch(m_pending[i]);
+                else
+                    dropBatch(m_pending[i]);
+            }
+            m_pending.clear();
+        }
+
+        bool outOfTime() const
+        {
+            return m_stopping && boost::get_system_time() >= m_deadline;
+        }
+
+        // Waits "millis" before trying again.  Returns false if we're
+        // stopping and run out of time.
+        bool backOff(boost::unique_lock<boost::mutex>& lock, unsigned long millis)
+        {
+            boost::system_time until = boost::get_system_time() + boost::posix_time::milliseconds(millis);
+            while( boost::get_system_time() < until && !outOfTime() )
+            {
+                if( !m_toSpool.empty() )
+                    writeSpool(lock);
+                else
+                    m_wake.timed_wait(lock, m_stopping ? std::min(until, m_deadline) : until);
+            }
+
+            return !outOfTime();
+        }
+
+        // Waits for batches to send, and takes up to "room" of them - from
+        // the spool, until it has all got through, and then from the
+        // queue.  Only waits if "idle" (nothing is in flight).  Returns
+        // false once there's nothing left to do, or no time left to do it.
+        bool takeBatches(boost::unique_lock<boost::mutex>& lock, outgoing_list& toSend, size_t room, bool idle)
+        {
+            for( ;; )
+            {
+                if( outOfTime() )
+                    return false;
+
+                if( m_current && (m_stopping ||
+                                  boost::get_system_time() >= m_currentStarted +
+                                        boost::posix_time::milliseconds(m_policy.maxDelayMillis)) )
+                    sealBatch();
+
+                if( !m_toSpool.empty() )
+                {
+                    writeSpool(lock);
+                    continue;
+                }
+
+                if( m_spool && !m_spool->drained() )
+                {
+                    if( m_spool->unread() || !idle )
+                        break;
+                }
+                else if( !m_pending.empty() || !idle )
+                {
+                    break;
+                }
+
+                if( m_stopping )
+                    return false;
+
+                if( m_current )
+                    m_wake.timed_wait(lock, m_currentStarted + boost::posix_time::milliseconds(m_policy.maxDelayMillis));
+                else
+                    m_wake.wait(lock);
+            }
+
+            if( m_spool && !m_spool->drained() )
+            {
+                // One at a time, so that a batch sent again can't arrive
+                // after the one behind it.  Nobody else uses the spool, so
+                // this can be done unlocked.
+                if( idle && room > 0 )
+                {
+                    lock.unlock();
+                    outgoing next(new Batch(), true);
+                    if( m_spool->read(*next.batch, m_replayBytes, next.spoolEnd) )
+                        toSend.push_back(next);
+                    else
+                        delete next.batch;
+                    lock.lock();
+                }
+                return true;
+            }
+
+            while( toSend.size() < room && !m_pending.empty() )
+            {
+                toSend.push_back(outgoing(m_pending.front()));
+                m_pending.pop_front();
+            }
+            return true;
+        }
+
+        // Only called from the sender thread.  Spooled batches are only
+        // commit()'ed if everything before them got through too.
+        void delivered(const outgoing& out, bool commit)
+        {
+            if( out.spooled && commit )
+                m_spool->commit(out.spoolEnd);
+            delete out.batch;
+            m_sent.fetch_add(1, boost::memory_order_relaxed);
+
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_healthy = true;
+        }
+
+        void senderFunction()
+        {
+            outgoing_list inFlight, toSend;
+            unsigned long retryMillis = 0;
+
+            for( ;; )
+            {
+                {
+                    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+                    // (Nothing is in flight after a failure.)
+                    size_t room = std::max(m_policy.inFlight, size_t(1)) - inFlight.size();
+                    if( (retryMillis && !backOff(lock, retryMillis)) ||
+                        !takeBatches(lock, toSend, room, inFlight.empty()) )
+                    {
+                        inFlight.insert(inFlight.end(), toSend.begin(), toSend.end());
+                        abandon(inFlight);
+                        if( m_spool )
+                            writeSpool(lock);
+                        return;
+                    }
+                }
+
+                bool failed = !m_transport->open();
+                while( !failed && !toSend.empty() )
+                {
+                    if( !m_transport->send(*toSend.front().batch) )
+                    {
+                        failed = true;
+                        break;
+                    }
+                    inFlight.push_back(toSend.front());
+                    toSend.pop_front();
+                }
+
+                // Take one reply, then go back for more to send.
+                bool retry = failed;
+                if( !failed && !inFlight.empty() )
+                {
+                    switch( m_transport->receive() )
+                    {
+                        case BatchTransport::BT_OK:
+                            delivered(inFlight.front(), true);
+                            inFlight.pop_front();
+                            retryMillis = 0;
+                            break;
+
+                        case BatchTransport::BT_TRY_LATER:
+                        {
+                            // Collect the rest of the replies, keeping the
+                            // refused batches (in order) to send again.
+                            outgoing_list refused;
+                            refused.push_back(inFlight.front());
+                            inFlight.pop_front();
+
+                            while( !failed && !inFlight.empty() )
+                            {
+                                BatchTransport::Result result = m_transport->receive();
+                                if( result == BatchTransport::BT_FAILED )
+                                {
+                                    failed = true;
+                                    break;
+                                }
+
+                                if( result == BatchTransport::BT_OK )
+                                    delivered(inFlight.front(), false);
+                                else
+                                    refused.push_back(inFlight.front());
+                                inFlight.pop_front();
+                            }
+
+                            refused.insert(refused.end(), inFlight.begin(), inFlight.end());
+                            inFlight.swap(refused);
+                            retry = true;
+                            break;
+                        }
+
+                        case BatchTransport::BT_FAILED:
+                        default:
+                            failed = retry = true;
+                            break;
+                    }
+                }
+
+                if( retry )
+                {
+                    if( failed )
+                    {
+#ifdef CPPLOG_USE_METRICS
+                        metrics().writeError();
+#endif
+                        m_transport->close();
+                    }
+
+                    // Anything unanswered is sent again, which may deliver
+                    // it twice.
+                    inFlight.insert(inFlight.end(), toSend.begin(), toSend.end());
+                    toSend.clear();
+                    {
+                        boost::lock_guard<boost::mutex> lock(m_mutex);
+                        sendFailed(inFlight);
+                    }
+
+                    retryMillis = retryMillis ? std::min(retryMillis * 2, m_policy.retryMaxMillis)
+                                              : m_policy.retryMinMillis;
+                }
+            }
+        }
+
+    public:
+        // Sends to "transport" (deleting it along with us, if "owned"),
+        // tagging messages with "category".
+        BatchingLogger(BatchTransport* transport, bool owned, const std::string& category,
+                       const BatchPolicy& policy = BatchPolicy())
+            : m_transport(transport), m_owned(owned), m_category(category), m_policy(policy),
+              m_current(NULL), m_healthy(true), m_stopping(false), m_spool(NULL), m_replayBytes(0),
+              m_sent(0), m_dropped(0)
+        {
+            m_sender = boost::thread(&BatchingLogger::senderFunction, this);
+        }
+
+        virtual ~BatchingLogger()
+        {
+            Stop();
+            delete m_spool;
+            if( m_owned )
+                delete m_transport;
+        }
+
+        // Keeps batches in a file at "path" (up to "maxBytes" of it) while
+        // they can't be sent, rather than in memory, and sends them (in
+        // order, ahead of anything newer) once they can - "replayBytes" at
+        // a time, one batch in flight at a time.  Anything left there by an
+        // earlier run is sent too, starting after the last batch it got an
+        // answer for; the batch that was in flight may be sent twice.
+        // Should be set before logging starts.  Returns false if the file
+        // can't be opened.
+        bool setSpool(const std::string& path, uint64_t maxBytes, size_t replayBytes = 4 * 1024 * 1024)
+        {
+            helpers::spool_file* spool = new helpers::spool_file(path, maxBytes);
+            if( !spool->is_open() )
+            {
+                delete spool;
+                return false;
+            }
+
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            delete m_spool;
+            m_spool = spool;
+            m_replayBytes = replayBytes;
+            m_wake.notify_one();
+            return true;
+        }
+
+        // Sends whatever is left, giving up after the policy's
+        // shutdownMillis.  What's still unsent then is kept in the spool,
+        // if there is one.
+        void Stop()
+        {
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                if( m_stopping )
+                    return;
+
+                m_stopping = true;
+                m_deadline = boost::get_system_time() + boost::posix_time::milliseconds(m_policy.shutdownMillis);
+                m_wake.notify_one();
+            }
+            m_sender.join();
+        }
+
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            helpers::log_streambuf* const sb = &logData->streamBuffer;
+
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            if( m_stopping )
+                return true;
+
+            if( !m_current )
+            {
+                m_current = new Batch();
+                m_current->category = m_category;
+                m_currentStarted = boost::get_system_time();
+            }
+
+            m_current->messages.push_back(std::string(sb->data(), static_cast<size_t>(sb->length())));
+            m_current->bytes += static_cast<size_t>(sb->length());
+
+            if( m_current->messages.size() >= m_policy.maxMessages || m_current->bytes >= m_policy.maxBytes )
+                sealBatch();
+            else if( m_current->messages.size() == 1 )
+                m_wake.notify_one();        // Start the clock on it.
+
+            return true;
+        }
 
-    public:
-        FileLogger(std::string logFilePath)
-            : OstreamLogger(m_outStream), m_path(logFilePath), m_outStream(logFilePath.c_str(), std::ios_base::out)
+        // Sends the current batch now, rather than waiting for it to fill.
+        void flush()
         {
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            if( m_current )
+                sealBatch();
         }
 
-        FileLogger(std::string logFilePath, bool append)
-            : OstreamLogger(m_outStream), m_path(logFilePath), m_outStream(logFilePath.c_str(), append ? std::ios_base::app : std::ios_base::out)
+        // Number of batches delivered so far.
+        unsigned long getSentCount() const
+        {
+            return m_sent.load(boost::memory_order_relaxed);
+        }
+
+        // Number of messages given up on so far.
+        unsigned long getDroppedCount() const
         {
+            return m_dropped.load(boost::memory_order_relaxed);
         }
     };
 
-    // Log to file, rotate when the log reaches a given size.
-    class SizeRotateFileLogger : public OstreamLogger
+    // How a PooledTransport spreads batches over its endpoints, and how it
+    // treats endpoints that fail.
+    struct PoolPolicy
     {
-    public:
-        typedef void (*pfBuildFileName)(unsigned long logNumber, std::string& newFileName, void* context);
+        // Send all batches of a category to the same endpoint (picked by
+        // consistent hashing, so that losing one endpoint only moves its
+        // own categories), rather than spreading them over all of them.
+        // A BatchingLogger has just one category, so this pins each logger
+        // to one endpoint - it only spreads loggers with different
+        // categories sharing the endpoints.
+        bool            byCategory;
+
+        // Connections to keep open to each endpoint (for loggers that make
+        // the connections, like ScribeLogger).
+        size_t          connectionsPerEndpoint;
+
+        // A failed endpoint is left alone for probeMinMillis, then sent a
+        // batch to see whether it's back, doubling the wait after each
+        // failure up to probeMaxMillis.
+        unsigned long   probeMinMillis;
+        unsigned long   probeMaxMillis;
+
+        explicit PoolPolicy(bool category = false, size_t connections = 2)
+            : byCategory(category), connectionsPerEndpoint(connections),
+              probeMinMillis(1000), probeMaxMillis(30000)
+        { }
+    };
 
+    // Sends batches over a pool of connections to several endpoints, each
+    // reached through one or more BatchTransports of its own.  An endpoint
+    // whose connection fails is dropped from the pool (batches sent there
+    // and not yet answered are refused, to be sent again elsewhere) until a
+    // probe - a single batch at a time - gets through to it again.  Batches
+    // sent to different connections may arrive out of order.
+    class PooledTransport : public BatchTransport
+    {
     private:
-        std::streamoff  m_maxSize;
-        unsigned long   m_logNumber;
+        struct endpoint
+        {
+            std::string                 name;
+            std::vector<BatchTransport*> connections;
+            size_t                      next;           // Connection to use next.
+            unsigned int                failures;       // In a row; 0 if healthy.
+            boost::system_time          probeAt;
+            bool                        probing;        // A probe is unanswered.
+            unsigned long               generation;     // Bumped when ejected.
+        };
 
-        SizeRotateFileLogger::pfBuildFileName m_buildFunc;
-        void*           m_context;
+        // Where a batch went (refused() for nowhere).
+        struct sent
+        {
+            size_t          endpoint;
+            size_t          connection;
+            unsigned long   generation;
+        };
 
-        std::ofstream   m_outStream;
+        static size_t refused()
+        {
+            return static_cast<size_t>(-1);
+        }
 
-    public:
-        SizeRotateFileLogger(pfBuildFileName nameFunc, std::streamoff maxSize)
-            : OstreamLogger(m_outStream), m_maxSize(maxSize), m_logNumber(0),
-              m_buildFunc(nameFunc), m_context(NULL),
-              m_outStream()
+        PoolPolicy                                  m_policy;
+        std::vector<endpoint>                       m_endpoints;
+        std::vector<std::pair<uint32_t, size_t> >   m_ring;         // Hash to endpoint.
+        size_t                                      m_next;         // Endpoint to use next.
+        std::deque<sent>                            m_unanswered;
+        std::vector<size_t>                         m_candidates;
+
+        // Not copyable.
+        PooledTransport(const PooledTransport&);
+        PooledTransport& operator=(const PooledTransport&);
+
+        // FNV-1a.
+        static uint32_t hash(const std::string& value)
         {
-            // "Rotate" to open our initial log.
-            RotateLog();
+            uint32_t result = 2166136261u;
+            for( size_t i = 0; i < value.length(); i++ )
+            {
+                result ^= static_cast<unsigned char>(value[i]);
+                result *= 16777619u;
+            }
+            return result;
         }
 
-        SizeRotateFileLogger(pfBuildFileName nameFunc, void* context,
-                std::streamoff maxSize)
-            : OstreamLogger(m_outStream), m_maxSize(maxSize), m_logNumber(0),
-              m_buildFunc(nameFunc), m_context(context),
-              m_outStream()
+        // An ejected endpoint only gets one probe at a time.
+        bool usable(const endpoint& e, const boost::system_time& now) const
         {
-            // "Rotate" to open our initial log.
-            RotateLog();
+            return e.failures == 0 || (!e.probing && now >= e.probeAt);
         }
 
-        virtual ~SizeRotateFileLogger()
+        void closeEndpoint(endpoint& e)
+        {
+            for( size_t i = 0; i < e.connections.size(); i++ )
+                e.connections[i]->close();
+        }
+
+        void eject(size_t index)
+        {
+            endpoint& e = m_endpoints[index];
+            unsigned long wait = m_policy.probeMinMillis;
+            for( unsigned int i = 0; i < e.failures && wait < m_policy.probeMaxMillis; i++ )
+                wait *= 2;
+
+            e.failures++;
+            e.probeAt = boost::get_system_time() +
+                        boost::posix_time::milliseconds(std::min(wait, m_policy.probeMaxMillis));
+            e.probing = false;
+            e.generation++;
+            closeEndpoint(e);
+        }
+
+        // Fills m_candidates with the endpoints to try for "batch", best
+        // first.
+        void findCandidates(const Batch& batch)
+        {
+            m_candidates.clear();
+
+            if( !m_policy.byCategory )
+            {
+                for( size_t i = 0; i < m_endpoints.size(); i++ )
+                    m_candidates.push_back((m_next + i) % m_endpoints.size());
+                return;
+            }
+
+            // Each endpoint in the order met, going round the ring from
+            // where the category lands.
+            std::vector<std::pair<uint32_t, size_t> >::const_iterator start =
+                std::lower_bound(m_ring.begin(), m_ring.end(), std::make_pair(hash(batch.category), size_t(0)));
+            for( size_t i = 0; i < m_ring.size() && m_candidates.size() < m_endpoints.size(); i++ )
+            {
+                size_t index = (static_cast<size_t>(start - m_ring.begin()) + i) % m_ring.size();
+                if( std::find(m_candidates.begin(), m_candidates.end(), m_ring[index].second) == m_candidates.end() )
+                    m_candidates.push_back(m_ring[index].second);
+            }
+        }
+
+    public:
+        explicit PooledTransport(const PoolPolicy& policy = PoolPolicy())
+            : m_policy(policy), m_next(0)
         { }
 
-        virtual bool sendLogMessage(LogData* logData)
+        virtual ~PooledTransport()
         {
-            // Call the actual logger.
-            bool deleteMessage = OstreamLogger::sendLogMessage(logData);
+            for( size_t i = 0; i < m_endpoints.size(); i++ )
+            {
+                for( size_t j = 0; j < m_endpoints[i].connections.size(); j++ )
+                    delete m_endpoints[i].connections[j];
+            }
+        }
 
-            // Check if we're over our limit.
-            if( m_outStream.tellp() > m_maxSize )
+        // Adds an endpoint, reached through "connections" (which we take
+        // ownership of).  "name" places it on the hash ring, so should stay
+        // the same from run to run - say, "host:port".
+        void addEndpoint(const std::string& name, const std::vector<BatchTransport*>& connections)
+        {
+            if( connections.empty() )
+                return;
+
+            endpoint e;
+            e.name = name;
+            e.connections = connections;
+            e.next = 0;
+            e.failures = 0;
+            e.probing = false;
+            e.generation = 0;
+            m_endpoints.push_back(e);
+
+            for( int i = 0; i < 64; i++ )
             {
-                // Yep, increment our log number and rotate.
-                m_logNumber++;
-                m_outStream << std::flush;
+                std::ostringstream point;
+                point << name << "#" << i;
+                m_ring.push_back(std::make_pair(hash(point.str()), m_endpoints.size() - 1));
+            }
+            std::sort(m_ring.begin(), m_ring.end());
+        }
 
-                RotateLog();
+        // Number of endpoints currently in the pool (not ejected).
+        size_t healthyEndpoints() const
+        {
+            size_t healthy = 0;
+            for( size_t i = 0; i < m_endpoints.size(); i++ )
+            {
+                if( m_endpoints[i].failures == 0 )
+                    healthy++;
             }
+            return healthy;
+        }
 
-            return deleteMessage;
+        // Connections are opened as batches are sent; this just checks
+        // there's somewhere to send them (or a probe to wait for).
+        virtual bool open()
+        {
+            boost::system_time now = boost::get_system_time();
+            for( size_t i = 0; i < m_endpoints.size(); i++ )
+            {
+                if( usable(m_endpoints[i], now) || m_endpoints[i].probing )
+                    return true;
+            }
+            return false;
         }
 
+        virtual void close()
+        {
+            for( size_t i = 0; i < m_endpoints.size(); i++ )
+            {
+                m_endpoints[i].probing = false;
+                m_endpoints[i].generation++;
+                closeEndpoint(m_endpoints[i]);
+            }
+            m_unanswered.clear();
+        }
 
-    private:
-        void RotateLog()
+        // Sends to the first usable endpoint that takes it, ejecting any
+        // that fail along the way.  Only fails if none of them take it -
+        // unless a probe is still unanswered, in which case the batch is
+        // refused (once its turn to be answered comes), to be sent again
+        // after the probe.
+        virtual bool send(const Batch& batch)
         {
-            // Build the file name.
-            std::string newFileName;
-            m_buildFunc(m_logNumber, newFileName, m_context);
+            findCandidates(batch);
 
-            // Close old file, open new file.
-            m_outStream.close();
-            m_outStream.open(newFileName.c_str(), std::ios_base::out);
+            boost::system_time now = boost::get_system_time();
+            bool probing = false;
+            for( size_t i = 0; i < m_candidates.size(); i++ )
+            {
+                size_t index = m_candidates[i];
+                endpoint& e = m_endpoints[index];
+                probing = probing || e.probing;
+                if( !usable(e, now) )
+                    continue;
+
+                size_t connection = e.next++ % e.connections.size();
+                if( !e.connections[connection]->open() || !e.connections[connection]->send(batch) )
+                {
+                    eject(index);
+                    continue;
+                }
+
+                e.probing = e.failures > 0;
+                sent s = { index, connection, e.generation };
+                m_unanswered.push_back(s);
+                m_next = index + 1;
+                return true;
+            }
+
+            if( !probing )
+                return false;
+
+            sent s = { refused(), 0, 0 };
+            m_unanswered.push_back(s);
+            return true;
+        }
+
+        virtual Result receive()
+        {
+            if( m_unanswered.empty() )
+                return BT_FAILED;
+
+            sent s = m_unanswered.front();
+            m_unanswered.pop_front();
+            if( s.endpoint == refused() )
+                return BT_TRY_LATER;
+
+            // Its connection has been dropped since.
+            endpoint& e = m_endpoints[s.endpoint];
+            if( s.generation != e.generation )
+                return BT_TRY_LATER;
+
+            Result result = e.connections[s.connection]->receive();
+            if( result == BT_FAILED )
+            {
+                eject(s.endpoint);
+                return BT_TRY_LATER;
+            }
+
+            e.probing = false;
+            if( result == BT_OK )
+                e.failures = 0;
+            return result;
         }
     };
 
-    // Log to file, rotate every "x" seconds.
-    class TimeRotateFileLogger : public OstreamLogger
+#ifdef CPPLOG_WITH_SCRIBE_LOGGER
+    namespace helpers
     {
-    public:
-        typedef void (*pfBuildFileName)(::tm* time, unsigned long logNumber,
-                                        std::string& newFileName, void* context);
+        // Sends batches to a Scribe node over Thrift.  Batches are
+        // pipelined: each is sent without waiting for the reply to the last.
+        // NOTE: Untested against a real node - "make scribe-check" only
+        // compiles it.  BatchingLogger and PooledTransport are tested with
+        // a stand-in transport instead.
+        class scribe_transport : public BatchTransport
+        {
+        private:
+            std::string                                                 m_host;
+            unsigned short                                              m_port;
+            int                                                         m_timeout;
+            bool                                                        m_compactProtocol;
+            boost::shared_ptr<apache::thrift::transport::TTransport>    m_transport;
+            boost::shared_ptr<scribe::thrift::scribeClient>             m_client;
+            std::vector<scribe::thrift::LogEntry>                       m_entries;
 
-    private:
-        unsigned long   m_rotateInterval;
-        ::time_t        m_lastRotateTime;
-        unsigned long   m_logNumber;
+        public:
+            scribe_transport(const std::string& host, unsigned short port, int timeout, bool compactProtocol)
+                : m_host(host), m_port(port), m_timeout(timeout), m_compactProtocol(compactProtocol)
+            { }
 
-        cpplog::TimeRotateFileLogger::pfBuildFileName m_buildFunc;
-        void* m_context;
+            virtual ~scribe_transport()
+            {
+                close();
+            }
 
-        std::ofstream   m_outStream;
+            virtual bool open()
+            {
+                if( m_client && m_transport->isOpen() )
+                    return true;
 
-    public:
-        TimeRotateFileLogger(pfBuildFileName nameFunc, unsigned long intervalSeconds)
-            : OstreamLogger(m_outStream), m_rotateInterval(intervalSeconds), m_logNumber(0),
-              m_buildFunc(nameFunc), m_context(NULL)
+                using namespace apache::thrift;
+                try
+                {
+                    boost::shared_ptr<transport::TSocket> socket(new transport::TSocket(m_host, m_port));
+                    socket->setConnTimeout(m_timeout);
+                    socket->setRecvTimeout(m_timeout);
+                    socket->setSendTimeout(m_timeout);
+                    m_transport.reset(new transport::TFramedTransport(socket));
+
+                    boost::shared_ptr<protocol::TProtocol> proto;
+                    if( m_compactProtocol )
+                        proto.reset(new protocol::TCompactProtocol(m_transport));
+                    else
+                        proto.reset(new protocol::TBinaryProtocol(m_transport));
+
+                    m_client.reset(new scribe::thrift::scribeClient(proto));
+                    m_transport->open();
+                }
+                catch( TException& )
+                {
+                    close();
+                    return false;
+                }
+                return true;
+            }
+
+            virtual void close()
+            {
+                if( m_transport )
+                {
+                    try
+                    {
+                        m_transport->close();
+                    }
+                    catch( apache::thrift::TException& ) { }
+                }
+
+                m_client.reset();
+                m_transport.reset();
+            }
+
+            virtual bool send(const Batch& batch)
+            {
+                m_entries.resize(batch.messages.size());
+                for( size_t i = 0; i < batch.messages.size(); i++ )
+                {
+                    m_entries[i].category = batch.category;
+                    m_entries[i].message = batch.messages[i];
+                }
+
+                try
+                {
+                    m_client->send_Log(m_entries);
+                }
+                catch( apache::thrift::TException& )
+                {
+                    return false;
+                }
+                return true;
+            }
+
+            virtual Result receive()
+            {
+                try
+                {
+                    int result = m_client->recv_Log();
+                    return result == scribe::thrift::OK ? BT_OK : BT_TRY_LATER;
+                }
+                catch( apache::thrift::TException& )
+                {
+                    return BT_FAILED;
+                }
+            }
+        };
+
+        // A pool of connections to each of "endpoints" ("host:port", the
+        // port defaulting to Scribe's usual 1463).
+        inline BatchTransport* scribe_pool(const std::vector<std::string>& endpoints, int timeout,
+                                           const PoolPolicy& pool, bool compactProtocol)
         {
-            // "Rotate" to open our initial log.
-            RotateLog(::time(NULL));
+            PooledTransport* transport = new PooledTransport(pool);
+            for( size_t i = 0; i < endpoints.size(); i++ )
+            {
+                size_t colon = endpoints[i].rfind(':');
+                std::string host = endpoints[i].substr(0, colon);
+                unsigned short port = static_cast<unsigned short>(
+                    colon == std::string::npos ? 1463 : std::strtoul(endpoints[i].c_str() + colon + 1, NULL, 10));
+
+                std::vector<BatchTransport*> connections;
+                for( size_t j = 0; j < std::max(pool.connectionsPerEndpoint, size_t(1)); j++ )
+                    connections.push_back(new scribe_transport(host, port, timeout, compactProtocol));
+                transport->addEndpoint(endpoints[i], connections);
+            }
+            return transport;
         }
+    }
+
+    // Given a Scribe node, will send log messages there with the given
+    // category, in batches (see BatchingLogger).  The compact protocol is
+    // smaller on the wire, but the node must be set up to expect it.
+    class ScribeLogger : public BatchingLogger
+    {
+    public:
+        ScribeLogger(std::string host, unsigned short port, std::string category, int timeout,
+                     const BatchPolicy& policy = BatchPolicy(), bool compactProtocol = false)
+            : BatchingLogger(new helpers::scribe_transport(host, port, timeout, compactProtocol), true,
+                             category, policy)
+        { }
+
+        // Spreads batches over a pool of connections to several Scribe
+        // nodes, given as "host:port" (see PooledTransport).  The policy's
+        // inFlight limits how many connections are busy at once.
+        ScribeLogger(const std::vector<std::string>& endpoints, std::string category, int timeout,
+                     const BatchPolicy& policy = BatchPolicy(), const PoolPolicy& pool = PoolPolicy(),
+                     bool compactProtocol = false)
+            : BatchingLogger(helpers::scribe_pool(endpoints, timeout, pool, compactProtocol), true,
+                             category, policy)
+        { }
+    };
+#endif
+
+#ifndef _WIN32
+    namespace helpers
+    {
+        // Writes buffers to a file in the background.  A buffer is taken
+        // with acquire(), filled, and handed back with submit(); it becomes
+        // free again once it has been written.  Only to be used from one
+        // thread at a time.
+        class async_writer
+        {
+        protected:
+            struct write_info
+            {
+                off_t   offset;
+                size_t  length;
+            };
+
+            int                         m_fd;
+            size_t                      m_bufferSize;
+            std::vector<char*>          m_buffers;
+            std::vector<write_info>     m_writes;
+            boost::atomic<unsigned long> m_failures;
+#ifdef CPPLOG_USE_METRICS
+            logger_metrics*             m_metrics;
+#endif
+
+            // Synchronously writes whatever is left of a buffer's write.
+            // What can't be written is given up on, and counted.
+            void writeRest(int index, size_t written)
+            {
+                const write_info& info = m_writes[index];
+                while( written < info.length )
+                {
+                    ssize_t count = pwrite(m_fd, m_buffers[index] + written, info.length - written,
+                                           info.offset + static_cast<off_t>(written));
+                    if( count < 0 && errno == EINTR )
+                        continue;
+                    if( count <= 0 )
+                    {
+                        m_failures.fetch_add(1, boost::memory_order_relaxed);
+#ifdef CPPLOG_USE_METRICS
+                        if( m_metrics )
+                            m_metrics->writeError();
+#endif
+                        break;
+                    }
+                    written += static_cast<size_t>(count);
+                }
+            }
+
+        public:
+            async_writer(int fd, size_t bufferCount, size_t bufferSize)
+                : m_fd(fd), m_bufferSize(bufferSize), m_buffers(bufferCount), m_writes(bufferCount),
+                  m_failures(0)
+#ifdef CPPLOG_USE_METRICS
+                  , m_metrics(NULL)
+#endif
+            {
+                for( size_t i = 0; i < bufferCount; i++ )
+                {
+                    void* buffer = NULL;
+                    if( posix_memalign(&buffer, 4096, bufferSize) != 0 )
+                        throw std::bad_alloc();
+                    m_buffers[i] = static_cast<char*>(buffer);
+                }
+            }
+
+            // Derived classes must wait() before we get here.
+            virtual ~async_writer()
+            {
+                for( size_t i = 0; i < m_buffers.size(); i++ )
+                    free(m_buffers[i]);
+            }
+
+            size_t bufferSize() const       { return m_bufferSize; }
+            char* buffer(int index) const   { return m_buffers[index]; }
+
+            // Number of writes that failed, or were cut short.
+            unsigned long failures() const
+            {
+                return m_failures.load(boost::memory_order_relaxed);
+            }
+
+#ifdef CPPLOG_USE_METRICS
+            // Also counts failures as write errors here.  Set before
+            // submitting anything.
+            void setMetrics(logger_metrics* metrics)
+            {
+                m_metrics = metrics;
+            }
+#endif
+
+            // Index of a free buffer.  Waits for one, if need be.
+            virtual int acquire() = 0;
+
+            // Writes the first "length" bytes of a buffer at "offset".
+            virtual void submit(int index, size_t length, off_t offset) = 0;
+
+            // Waits for every submitted write to finish.
+            virtual void wait() = 0;
+        };
+
+#ifdef CPPLOG_HAVE_IO_URING
+        // Submits writes through io_uring, with the buffers registered up
+        // front.  Use create(), which fails where io_uring can't be used.
+        class uring_writer : public async_writer
+        {
+        private:
+            int                 m_ringFd;
+            void*               m_sqRing;
+            size_t              m_sqRingSize;
+            void*               m_cqRing;
+            size_t              m_cqRingSize;
+            io_uring_sqe*       m_sqes;
+            size_t              m_sqesSize;
+
+            unsigned*           m_sqTail;
+            unsigned*           m_sqMask;
+            unsigned*           m_sqArray;
+            unsigned*           m_cqHead;
+            unsigned*           m_cqTail;
+            unsigned*           m_cqMask;
+            io_uring_cqe*       m_cqes;
+
+            bool                m_fixedBuffers;
+            std::vector<int>    m_free;
+            size_t              m_inFlight;
+
+            uring_writer(int fd, size_t bufferCount, size_t bufferSize)
+                : async_writer(fd, bufferCount, bufferSize),
+                  m_ringFd(-1), m_sqRing(MAP_FAILED), m_sqRingSize(0),
+                  m_cqRing(MAP_FAILED), m_cqRingSize(0), m_sqes(NULL), m_sqesSize(0),
+                  m_fixedBuffers(false), m_inFlight(0)
+            {
+                for( size_t i = 0; i < bufferCount; i++ )
+                    m_free.push_back(static_cast<int>(i));
+            }
+
+            bool setup()
+            {
+                io_uring_params params;
+                memset(&params, 0, sizeof(params));
+
+                m_ringFd = static_cast<int>(syscall(__NR_io_uring_setup,
+                                                    static_cast<unsigned>(m_buffers.size()), &params));
+                if( m_ringFd < 0 )
+                    return false;
+
+                m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+                if( singleMap )
+                    m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+                m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                m_ringFd, IORING_OFF_SQ_RING);
+                if( m_sqRing == MAP_FAILED )
+                    return false;
+
+                if( singleMap )
+                {
+                    m_cqRing = m_sqRing;
+                }
+                else
+                {
+                    m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    m_ringFd, IORING_OFF_CQ_RING);
+                    if( m_cqRing == MAP_FAILED )
+                        return false;
+                }
+
+                m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+                void* sqes = mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  m_ringFd, IORING_OFF_SQES);
+                if( sqes == MAP_FAILED )
+                    return false;
+                m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+                char* sq = static_cast<char*>(m_sqRing);
+                m_sqTail  = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                m_sqMask  = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+                char* cq = static_cast<char*>(m_cqRing);
+                m_cqHead  = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                m_cqTail  = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                m_cqMask  = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                m_cqes    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+                // Registering the buffers saves the kernel mapping them for
+                // every write.  Carry on without, if it won't let us.
+                std::vector<iovec> iovecs(m_buffers.size());
+                for( size_t i = 0; i < m_buffers.size(); i++ )
+                {
+                    iovecs[i].iov_base = m_buffers[i];
+                    iovecs[i].iov_len  = m_bufferSize;
+                }
+                m_fixedBuffers = syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_BUFFERS,
+                                         &iovecs[0], static_cast<unsigned>(iovecs.size())) == 0;
+                return true;
+            }
+
+            int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+            {
+                int result;
+                do
+                {
+                    result = static_cast<int>(syscall(__NR_io_uring_enter, m_ringFd, toSubmit,
+                                                      minComplete, flags, NULL, 0));
+                } while( result < 0 && errno == EINTR );
+                return result;
+            }
+
+            // Handles finished writes, waiting for at least "minComplete".
+            void reap(unsigned minComplete)
+            {
+                if( minComplete > 0 )
+                    enter(0, minComplete, IORING_ENTER_GETEVENTS);
+
+                unsigned head = *m_cqHead;
+                while( head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) )
+                {
+                    const io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+                    int index = static_cast<int>(cqe.user_data);
+
+                    // Finish short (or failed) writes ourselves.
+                    size_t written = cqe.res > 0 ? static_cast<size_t>(cqe.res) : 0;
+                    if( written < m_writes[index].length )
+                        writeRest(index, written);
+
+                    m_free.push_back(index);
+                    m_inFlight--;
+                    head++;
+                }
+                __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            }
+
+        public:
+            // Returns NULL if io_uring isn't available.
+            static uring_writer* create(int fd, size_t bufferCount, size_t bufferSize)
+            {
+                uring_writer* writer = new uring_writer(fd, bufferCount, bufferSize);
+                if( !writer->setup() )
+                {
+                    delete writer;
+                    return NULL;
+                }
+                return writer;
+            }
+
+            virtual ~uring_writer()
+            {
+                if( m_sqes )
+                    wait();
+
+                if( m_sqes )
+                    munmap(m_sqes, m_sqesSize);
+                if( m_cqRing != MAP_FAILED && m_cqRing != m_sqRing )
+                    munmap(m_cqRing, m_cqRingSize);
+                if( m_sqRing != MAP_FAILED )
+                    munmap(m_sqRing, m_sqRingSize);
+                if( m_ringFd >= 0 )
+                    ::close(m_ringFd);
+            }
+
+            virtual int acquire()
+            {
+                reap(0);
+                while( m_free.empty() )
+                    reap(1);
+
+                int index = m_free.back();
+                m_free.pop_back();
+                return index;
+            }
+
+            virtual void submit(int index, size_t length, off_t offset)
+            {
+                m_writes[index].offset = offset;
+                m_writes[index].length = length;
+
+                // There's a submission entry for every buffer, so there is
+                // always room.
+                unsigned tail = *m_sqTail;
+                unsigned slot = tail & *m_sqMask;
+
+                io_uring_sqe* sqe = &m_sqes[slot];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode     = m_fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                sqe->fd         = m_fd;
+                sqe->off        = static_cast<__u64>(offset);
+                sqe->addr       = reinterpret_cast<__u64>(m_buffers[index]);
+                sqe->len        = static_cast<__u32>(length);
+                sqe->buf_index  = m_fixedBuffers ? static_cast<__u16>(index) : 0;
+                sqe->user_data  = static_cast<__u64>(index);
+
+                m_sqArray[slot] = slot;
+                __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+                m_inFlight++;
+
+                if( enter(1, 0, 0) < 0 )
+                {
+                    // Couldn't submit - take it back, and write it here.
+                    __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+                    m_inFlight--;
+                    writeRest(index, 0);
+                    m_free.push_back(index);
+                }
+            }
+
+            virtual void wait()
+            {
+                while( m_inFlight > 0 )
+                    reap(1);
+            }
+        };
+#endif  // CPPLOG_HAVE_IO_URING
 
-        TimeRotateFileLogger(pfBuildFileName nameFunc, void* context, unsigned long intervalSeconds)
-            : OstreamLogger(m_outStream), m_rotateInterval(intervalSeconds), m_logNumber(0),
-              m_buildFunc(nameFunc), m_context(context)
+        // Hands writes to a small pool of threads.
+        class pool_writer : public async_writer
         {
-            // "Rotate" to open our initial log.
-            RotateLog(::time(NULL));
-        }
+        private:
+            boost::mutex                m_lock;
+            boost::condition_variable   m_written;
+            std::vector<int>            m_free;
+            size_t                      m_inFlight;
 
-        virtual ~TimeRotateFileLogger()
-        {
-        }
+            concurrent_queue<int>       m_jobs;
+            boost::thread_group         m_threads;
+            size_t                      m_threadCount;
 
-        virtual bool sendLogMessage(LogData* logData)
-        {
-            // Get the current time.
-            ::time_t currTime;
-            ::time(&currTime);
+            void writerFunction()
+            {
+                for( ;; )
+                {
+                    int index;
+                    m_jobs.wait_and_pop(index);
+                    if( index < 0 )
+                        break;
 
-            unsigned long timeDiff = static_cast<unsigned long>(
-                                        difftime(currTime, m_lastRotateTime)
-                                     );
+                    writeRest(index, 0);
+
+                    boost::lock_guard<boost::mutex> lock(m_lock);
+                    m_free.push_back(index);
+                    m_inFlight--;
+                    m_written.notify_all();
+                }
+            }
 
-            // Is the difference greater than our number of seconds?
-            if( timeDiff > m_rotateInterval )
+        public:
+            pool_writer(int fd, size_t bufferCount, size_t bufferSize, size_t threadCount)
+                : async_writer(fd, bufferCount, bufferSize), m_inFlight(0), m_threadCount(threadCount)
             {
-                // Yep, increment our log number and rotate.
-                m_logNumber++;
-                m_outStream << std::flush;
+                for( size_t i = 0; i < bufferCount; i++ )
+                    m_free.push_back(static_cast<int>(i));
 
-                RotateLog(currTime);
+                for( size_t i = 0; i < threadCount; i++ )
+                    m_threads.create_thread(boost::bind(&pool_writer::writerFunction, this));
             }
 
-            // Call the actual logger.
-            return OstreamLogger::sendLogMessage(logData);
-        }
+            virtual ~pool_writer()
+            {
+                wait();
 
-    private:
-        void RotateLog(time_t currTime)
-        {
-            // Get the current time.
-            ::tm timeInfo;
-            cpplog::helpers::slocaltime(&timeInfo, &currTime);
+                for( size_t i = 0; i < m_threadCount; i++ )
+                    m_jobs.push(-1);
+                m_threads.join_all();
+            }
 
-            // Build a new file name.
-            std::string newFileName;
-            m_buildFunc(&timeInfo, m_logNumber, newFileName, m_context);
+            virtual int acquire()
+            {
+                boost::unique_lock<boost::mutex> lock(m_lock);
+                while( m_free.empty() )
+                    m_written.wait(lock);
 
-            // Close old file, open new file.
-            m_outStream.close();
-            m_outStream.open(newFileName.c_str(), std::ios_base::out);
+                int index = m_free.back();
+                m_free.pop_back();
+                return index;
+            }
 
-            // Reset the rotate time.
-            ::time(&m_lastRotateTime);
-        }
-    };
+            virtual void submit(int index, size_t length, off_t offset)
+            {
+                m_writes[index].offset = offset;
+                m_writes[index].length = length;
 
-#ifdef CPPLOG_WITH_SCRIBE_LOGGER
-    // Given a Scribe node, will send log messages there with the given category.
-    class ScribeLogger : public OstreamLogger
+                {
+                    boost::lock_guard<boost::mutex> lock(m_lock);
+                    m_inFlight++;
+                }
+                m_jobs.push(index);
+            }
+
+            virtual void wait()
+            {
+                boost::unique_lock<boost::mutex> lock(m_lock);
+                while( m_inFlight > 0 )
+                    m_written.wait(lock);
+            }
+        };
+    }
+
+    // Log to file without waiting on the disk.  Messages are copied into
+    // one of a set of buffers, and a buffer is written in the background
+    // once it's full, or sooner if the flush policy says so (see
+    // FlushPolicy - "flushing" here hands the buffer over to be written),
+    // with several writes in flight at once.  We only wait when every
+    // buffer is still being written.  On Linux, writes go through io_uring,
+    // using registered buffers; where that isn't available, a small pool of
+    // threads does the writing instead.  Writes that fail are dropped, and
+    // counted as write errors.
+    // Like the other file loggers, this isn't thread-safe.  Put it behind a
+    // BackgroundLogger.
+    class AsyncFileLogger : public BaseLogger
     {
-    private:
-        scribe_stream m_outStream;
     public:
-        ScribeLogger(std::string host, unsigned short port, std::string category, int timeout)
-            : OstreamLogger(m_outStream)
-        {
-            m_outStream.open(host, port, category, timeout);
-        }
-    };
-#endif
+        static const size_t         k_defaultBufferCount  = 8;
+        static const size_t         k_defaultBufferSize   = 256 * 1024;
+        static const unsigned long  k_defaultFlushMillis  = 100;
+        static const size_t         k_writerThreads       = 2;
 
-    // Tee logger - given two loggers, will forward a message to both.
-    class TeeLogger : public BaseLogger
-    {
     private:
-        BaseLogger* m_logger1;
-        BaseLogger* m_logger2;
-
-        bool        m_logger1Owned;
-        bool        m_logger2Owned;
-
-    public:
-        TeeLogger(BaseLogger* one, BaseLogger* two)
-            : m_logger1(one), m_logger2(two),
-              m_logger1Owned(false), m_logger2Owned(false)
-        { }
+        int                     m_fd;
+        helpers::async_writer*  m_writer;
+        bool                    m_usingIoUring;
 
-        TeeLogger(BaseLogger* one, bool ownOne, BaseLogger* two, bool ownTwo)
-            : m_logger1(one), m_logger2(two),
-              m_logger1Owned(ownOne), m_logger2Owned(ownTwo)
-        { }
+        off_t                   m_offset;
+        int                     m_current;
+        size_t                  m_used;
 
-        TeeLogger(BaseLogger& one, BaseLogger& two)
-            : m_logger1(&one), m_logger2(&two),
-              m_logger1Owned(false), m_logger2Owned(false)
-        { }
+        FlushPolicy                 m_flushPolicy;
+        boost::mutex                m_mutex;
+        helpers::periodic_timer*    m_flushTimer;
 
-        TeeLogger(BaseLogger& one, bool ownOne, BaseLogger& two, bool ownTwo)
-            : m_logger1(&one), m_logger2(&two),
-              m_logger1Owned(ownOne), m_logger2Owned(ownTwo)
-        { }
+        static void timerFlush(void* context)
+        {
+            AsyncFileLogger* logger = static_cast<AsyncFileLogger*>(context);
+            boost::lock_guard<boost::mutex> lock(logger->m_mutex);
+            logger->submit();
+        }
 
-        ~TeeLogger()
+        void stopFlushTimer()
         {
-            if( m_logger1Owned )
-                delete m_logger1;
-            if( m_logger2Owned )
-                delete m_logger2;
+            delete m_flushTimer;
+            m_flushTimer = NULL;
         }
 
-        virtual bool sendLogMessage(LogData* logData)
+        void append(const char* data, size_t length)
         {
-            bool deleteMessage = true;
+            while( length > 0 )
+            {
+                if( m_current < 0 )
+                    m_current = m_writer->acquire();
 
-            deleteMessage = deleteMessage && m_logger1->sendLogMessage(logData);
-            deleteMessage = deleteMessage && m_logger2->sendLogMessage(logData);
+                size_t count = std::min(length, m_writer->bufferSize() - m_used);
+                memcpy(m_writer->buffer(m_current) + m_used, data, count);
+                m_used += count;
+                data += count;
+                length -= count;
 
-            return deleteMessage;
+                if( m_used == m_writer->bufferSize() )
+                    submit();
+            }
         }
-    };
 
-    // Multiplex logger - will forward a log message to all loggers.
-    class MultiplexLogger : public BaseLogger
-    {
-        struct LoggerInfo
+        // Submits the current buffer early, if the policy says so, after
+        // messages up to "level" have been appended.
+        void appended(loglevel_t level)
         {
-            BaseLogger* logger;
-            bool        owned;
+            if( (m_flushPolicy.everyBytes > 0 && m_used >= m_flushPolicy.everyBytes) ||
+                level >= m_flushPolicy.flushLevel )
+                submit();
+        }
 
-            LoggerInfo(BaseLogger* l, bool o)
-                : logger(l), owned(o)
-            { }
-        };
-        std::vector<LoggerInfo> m_loggers;
+        void submit()
+        {
+            if( m_current < 0 )
+                return;
 
-    public:
-        MultiplexLogger()
-        { }
+            m_writer->submit(m_current, m_used, m_offset);
+            m_offset += static_cast<off_t>(m_used);
+            m_current = -1;
+            m_used = 0;
+        }
 
-        MultiplexLogger(BaseLogger* one)
+    public:
+        // By default, a buffer that isn't full is written once it's
+        // k_defaultFlushMillis old (see setFlushPolicy()).
+        AsyncFileLogger(std::string logFilePath, bool append = false,
+                        size_t bufferCount = k_defaultBufferCount,
+                        size_t bufferSize = k_defaultBufferSize,
+                        bool allowIoUring = true)
+            : m_writer(NULL), m_usingIoUring(false), m_offset(0), m_current(-1), m_used(0),
+              m_flushPolicy(0, 0), m_flushTimer(NULL)
         {
-            m_loggers.push_back(LoggerInfo(one, false));
+            m_fd = open(logFilePath.c_str(), O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+            if( m_fd >= 0 && append )
+                m_offset = lseek(m_fd, 0, SEEK_END);
+
+#ifdef CPPLOG_HAVE_IO_URING
+            if( allowIoUring )
+                m_writer = helpers::uring_writer::create(m_fd, bufferCount, bufferSize);
+            m_usingIoUring = (m_writer != NULL);
+#else
+            (void)allowIoUring;
+#endif
+            if( !m_writer )
+                m_writer = new helpers::pool_writer(m_fd, bufferCount, bufferSize, k_writerThreads);
+
+#ifdef CPPLOG_USE_METRICS
+            // Without a file, every write fails (and is counted) too.
+            m_writer->setMetrics(&metrics());
+            if( m_fd < 0 )
+                metrics().writeError();
+#endif
+
+            setFlushPolicy(FlushPolicy(0, k_defaultFlushMillis));
         }
 
-        MultiplexLogger(BaseLogger& one)
+        ~AsyncFileLogger()
         {
-            m_loggers.push_back(LoggerInfo(&one, false));
+            stopFlushTimer();
+            submit();
+            delete m_writer;
+
+            if( m_fd >= 0 )
+                ::close(m_fd);
         }
 
-        MultiplexLogger(BaseLogger* one, bool owned)
+        // Whether the file could be opened.  If not, messages are dropped.
+        bool is_open() const
         {
-            m_loggers.push_back(LoggerInfo(one, owned));
+            return m_fd >= 0;
         }
 
-        MultiplexLogger(BaseLogger& one, bool owned)
+        // Number of writes that failed (or were cut short), and so lost
+        // messages.
+        unsigned long failedWrites() const
         {
-            m_loggers.push_back(LoggerInfo(&one, owned));
+            return m_writer->failures();
         }
 
-        MultiplexLogger(BaseLogger* one, BaseLogger* two)
+        // Whether writes go through io_uring, rather than the thread pool.
+        bool usingIoUring() const
         {
-            m_loggers.push_back(LoggerInfo(one, false));
-            m_loggers.push_back(LoggerInfo(two, false));
+            return m_usingIoUring;
         }
 
-        MultiplexLogger(BaseLogger* one, bool ownOne, BaseLogger* two, bool ownTwo)
+        // Should be set before logging starts.  A buffer is always written
+        // once it's full; FlushPolicy::everyMessage() writes each call to
+        // sendLogMessage(s) on its own.
+        void setFlushPolicy(const FlushPolicy& policy)
         {
-            m_loggers.push_back(LoggerInfo(one, ownOne));
-            m_loggers.push_back(LoggerInfo(two, ownTwo));
+            stopFlushTimer();
+            m_flushPolicy = policy;
+
+            if( policy.everyMillis > 0 )
+                m_flushTimer = new helpers::periodic_timer(&AsyncFileLogger::timerFlush, this, policy.everyMillis);
         }
 
-        MultiplexLogger(BaseLogger& one, bool ownOne, BaseLogger& two, bool ownTwo)
+        const FlushPolicy& getFlushPolicy() const
         {
-            m_loggers.push_back(LoggerInfo(&one, ownOne));
-            m_loggers.push_back(LoggerInfo(&two, ownTwo));
+            return m_flushPolicy;
         }
 
-        ~MultiplexLogger()
+        // Waits until everything logged so far has been written.
+        void Flush()
         {
-            for( std::vector<LoggerInfo>::iterator It = m_loggers.begin();
-                 It != m_loggers.end();
-                 It++ )
-            {
-                if( (*It).owned )
-                    delete (*It).logger;
-            }
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            submit();
+            m_writer->wait();
         }
 
-        void addLogger(BaseLogger* logger)      { m_loggers.push_back(LoggerInfo(logger, false)); }
-        void addLogger(BaseLogger& logger)      { m_loggers.push_back(LoggerInfo(&logger, false)); }
+        virtual bool sendLogMessage(LogData* logData)
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex, boost::defer_lock);
+            if( m_flushTimer )
+                lock.lock();
 
-        void addLogger(BaseLogger* logger, bool owned)      { m_loggers.push_back(LoggerInfo(logger, owned)); }
-        void addLogger(BaseLogger& logger, bool owned)      { m_loggers.push_back(LoggerInfo(&logger, owned)); }
+            append(logData->streamBuffer.data(), static_cast<size_t>(logData->streamBuffer.length()));
+            appended(logData->level);
+            return true;
+        }
 
-        virtual bool sendLogMessage(LogData* logData)
+        virtual void sendLogMessages(LogData** logData, size_t count)
         {
-            bool deleteMessage = true;
+            boost::unique_lock<boost::mutex> lock(m_mutex, boost::defer_lock);
+            if( m_flushTimer )
+                lock.lock();
 
-            for( std::vector<LoggerInfo>::iterator It = m_loggers.begin();
-                 It != m_loggers.end();
-                 It++ )
+            loglevel_t highest = LL_TRACE;
+            for( size_t i = 0; i < count; i++ )
             {
-                deleteMessage = deleteMessage && (*It).logger->sendLogMessage(logData);
+                append(logData[i]->streamBuffer.data(), static_cast<size_t>(logData[i]->streamBuffer.length()));
+                highest = std::max(highest, logData[i]->level);
             }
-
-            return deleteMessage;
+            appended(highest);
         }
     };
+#endif  // _WIN32
 
-    // Filtering logger.  Will not forward all messages less than a given level.
-    class FilteringLogger : public BaseLogger
+#ifdef CPPLOG_USE_METRICS
+    // Writes the metrics of a set of loggers in Prometheus' text format,
+    // either on request or every so often to a file (for instance, for the
+    // node exporter's textfile collector to pick up).
+    class MetricsDumper
     {
-    private:
-        loglevel_t      m_lowestLevelAllowed;
-        BaseLogger*     m_forwardTo;
-        bool            m_owned;
-
     public:
-        FilteringLogger(loglevel_t level, BaseLogger* forwardTo)
-            : m_lowestLevelAllowed(level), m_forwardTo(forwardTo), m_owned(false)
-        { }
+        typedef std::vector< std::pair<std::string, LoggerMetrics> > snapshot_list;
 
-        FilteringLogger(loglevel_t level, BaseLogger& forwardTo)
-            : m_lowestLevelAllowed(level), m_forwardTo(&forwardTo), m_owned(false)
-        { }
+    private:
+        typedef std::vector< std::pair<std::string, const BaseLogger*> > logger_list;
 
-        FilteringLogger(loglevel_t level, BaseLogger* forwardTo, bool owned)
-            : m_lowestLevelAllowed(level), m_forwardTo(forwardTo), m_owned(owned)
-        { }
+        std::string                 m_path;
+        boost::mutex                m_mutex;
+        logger_list                 m_loggers;
+        helpers::periodic_timer*    m_timer;
 
-        FilteringLogger(loglevel_t level, BaseLogger& forwardTo, bool owned)
-            : m_lowestLevelAllowed(level), m_forwardTo(&forwardTo), m_owned(owned)
-        { }
+        // Not copyable.
+        MetricsDumper(const MetricsDumper&);
+        MetricsDumper& operator=(const MetricsDumper&);
 
-        ~FilteringLogger()
+        static void timerDump(void* context)
         {
-            if( m_owned )
-                delete m_forwardTo;
+            static_cast<MetricsDumper*>(context)->dump();
         }
 
-        void SetLevel(loglevel_t allowed)
+        static void writeLabel(std::ostream& out, const std::string& name)
         {
-            m_lowestLevelAllowed = allowed;
+            out << "{logger=\"";
+            for( size_t i = 0; i < name.length(); i++ )
+            {
+                switch( name[i] )
+                {
+                    case '\\':  out << "\\\\";      break;
+                    case '"':   out << "\\\"";      break;
+                    case '\n':  out << "\\n";       break;
+                    default:    out << name[i];     break;
+                }
+            }
+            out << "\"";
         }
 
-        virtual bool sendLogMessage(LogData* logData)
+        static void writeHeader(std::ostream& out, const char* name, const char* type, const char* help)
         {
-            if( logData->level >= m_lowestLevelAllowed )
-                return m_forwardTo->sendLogMessage(logData);
-            else
-                return true;
+            out << "# HELP " << name << " " << help << "\n"
+                << "# TYPE " << name << " " << type << "\n";
         }
-    };
-
-    // Logger that moves all processing of log messages to a background thread.
-    // Only include if we have support for threading.
-#ifdef CPPLOG_THREADING
-    class BackgroundLogger : public BaseLogger
-    {
-    private:
-        BaseLogger*                 m_forwardTo;
-        concurrent_queue<LogData*>  m_queue;
 
-        boost::thread               m_backgroundThread;
-        LogData*                    m_dummyItem;
-
-        void backgroundFunction()
+        static void writeSeries(std::ostream& out, const snapshot_list& snapshots, const char* name,
+                                 const char* type, const char* help, uint64_t LoggerMetrics::*field,
+                                 bool queuesOnly = false)
         {
-            LogData* nextLogEntry;
-            bool deleteMessage = true;
-
-            do
+            writeHeader(out, name, type, help);
+            for( size_t i = 0; i < snapshots.size(); i++ )
             {
-                m_queue.wait_and_pop(nextLogEntry);
-
-                if( nextLogEntry != m_dummyItem )
-                    deleteMessage = m_forwardTo->sendLogMessage(nextLogEntry);
+                if( queuesOnly && !snapshots[i].second.hasQueue )
+                    continue;
 
-                if( deleteMessage )
-                    delete nextLogEntry;
-            } while( nextLogEntry != m_dummyItem );
+                out << name;
+                writeLabel(out, snapshots[i].first);
+                out << "} " << snapshots[i].second.*field << "\n";
+            }
         }
 
-        void Init()
+    public:
+        // With an interval of 0, the file is only written by dump().
+        MetricsDumper(const std::string& path, unsigned long intervalMillis = 0)
+            : m_path(path), m_timer(NULL)
         {
-            // Create dummy item.
-            m_dummyItem = new LogData(LL_TRACE);
-
-            // And create background thread.
-            m_backgroundThread = boost::thread(&BackgroundLogger::backgroundFunction, this);
+            if( intervalMillis > 0 )
+                m_timer = new helpers::periodic_timer(&MetricsDumper::timerDump, this, intervalMillis);
         }
 
-    public:
-        BackgroundLogger(BaseLogger* forwardTo)
-            : m_forwardTo(forwardTo)
+        ~MetricsDumper()
         {
-            Init();
+            delete m_timer;
         }
 
-        BackgroundLogger(BaseLogger& forwardTo)
-            : m_forwardTo(&forwardTo)
+        // The logger must outlive us (or at least, our last dump).
+        void add(const std::string& name, const BaseLogger& logger)
         {
-            Init();
+            boost::lock_guard<boost::mutex> lock(m_mutex);
+            m_loggers.push_back(std::make_pair(name, &logger));
         }
 
-        void Stop()
+        void write(std::ostream& out)
         {
-            // Push our "dummy" item on the queue ...
-            m_queue.push(m_dummyItem);
-
-            // ... and wait for thread to terminate.
-            m_backgroundThread.join();
+            snapshot_list snapshots;
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                snapshots.resize(m_loggers.size());
+                for( size_t i = 0; i < m_loggers.size(); i++ )
+                {
+                    snapshots[i].first = m_loggers[i].first;
+                    m_loggers[i].second->getMetrics(snapshots[i].second);
+                }
+            }
 
-            // NOTE: The loop will free the dummy item for us, we can ignore it.
+            writePrometheus(out, snapshots);
         }
 
-        ~BackgroundLogger()
+        // Writes everything to our file, replacing it in one go so that
+        // nobody reads it half-written.
+        bool dump()
         {
-            Stop();
+            std::string tempPath = m_path + ".tmp";
+            {
+                std::ofstream out(tempPath.c_str(), std::ios::out | std::ios::trunc);
+                write(out);
+                out.close();
+                if( out.fail() )
+                {
+                    std::remove(tempPath.c_str());
+                    return false;
+                }
+            }
+
+#ifdef _WIN32
+            std::remove(m_path.c_str());
+#endif
+            return std::rename(tempPath.c_str(), m_path.c_str()) == 0;
         }
 
-        virtual bool sendLogMessage(LogData* logData)
+        static void writePrometheus(std::ostream& out, const snapshot_list& snapshots)
         {
-            m_queue.push(logData);
+            writeSeries(out, snapshots, "cpplog_messages_accepted_total", "counter",
+                         "Messages given to the logger.", &LoggerMetrics::messagesAccepted);
+            writeSeries(out, snapshots, "cpplog_bytes_accepted_total", "counter",
+                         "Bytes of messages given to the logger.", &LoggerMetrics::bytesAccepted);
+            writeSeries(out, snapshots, "cpplog_messages_filtered_total", "counter",
+                         "Messages turned away by level.", &LoggerMetrics::messagesFiltered);
+            writeSeries(out, snapshots, "cpplog_messages_dropped_total", "counter",
+                         "Messages dropped because the queue was full.", &LoggerMetrics::messagesDropped);
+            writeSeries(out, snapshots, "cpplog_write_errors_total", "counter",
+                         "Failed writes and flushes.", &LoggerMetrics::writeErrors);
+            writeSeries(out, snapshots, "cpplog_queue_depth", "gauge",
+                         "Messages waiting in the queue.", &LoggerMetrics::queueDepth, true);
+            writeSeries(out, snapshots, "cpplog_queue_peak_depth", "gauge",
+                         "Most messages seen waiting in the queue.", &LoggerMetrics::peakQueueDepth, true);
+
+            const char* name = "cpplog_write_seconds";
+            writeHeader(out, name, "histogram", "Time taken to hand a batch of queued messages on.");
+
+            std::streamsize oldPrecision = out.precision(9);
+            for( size_t i = 0; i < snapshots.size(); i++ )
+            {
+                const LoggerMetrics& metrics = snapshots[i].second;
+                if( !metrics.hasQueue )
+                    continue;
 
-            // Don't delete - the background thread should handle this.
-            return false;
-        }
+                uint64_t cumulative = 0;
+                for( size_t b = 0; b < LoggerMetrics::k_latencyBuckets; b++ )
+                {
+                    cumulative += metrics.writeLatency[b];
+
+                    out << name << "_bucket";
+                    writeLabel(out, snapshots[i].first);
+                    if( b + 1 < LoggerMetrics::k_latencyBuckets )
+                        out << ",le=\"" << static_cast<double>(uint64_t(1) << b) / 1e6 << "\"";
+                    else
+                        out << ",le=\"+Inf\"";
+                    out << "} " << cumulative << "\n";
+                }
 
+                out << name << "_sum";
+                writeLabel(out, snapshots[i].first);
+                out << "} " << static_cast<double>(metrics.writeNanos) / 1e9 << "\n";
+
+                out << name << "_count";
+                writeLabel(out, snapshots[i].first);
+                out << "} " << metrics.writes << "\n";
+            }
+            out.precision(oldPrecision);
+        }
     };
+#endif
 
 #endif
 
@@ -1074,9 +7206,22 @@ namespace cpplog
             virtual bool sendLogMessage(LogData* logData)
             {
                 if( logData->level >= lowestLevel )
-                    return m_forwardTo->sendLogMessage(logData);
-                else
-                    return true;
+                    return helpers::send_to(m_forwardTo, logData);
+
+#ifdef CPPLOG_USE_METRICS
+                metrics().filtered();
+#endif
+                return true;
+            }
+
+            virtual bool isEnabled(loglevel_t level) const
+            {
+                return level >= lowestLevel && m_forwardTo->isEnabled(level);
+            }
+
+            virtual bool acceptsDeferred() const
+            {
+                return m_forwardTo->acceptsDeferred();
             }
         };
 
@@ -1093,39 +7238,51 @@ namespace cpplog
 #endif
 #define LOG_NOTHING(level, logger)  true ? (void)0 : cpplog::helpers::VoidStreamClass() & LOG_LEVEL(level, logger)
 
+// Logs only if the logger would do anything with the message.  Otherwise, no
+// LogMessage is created and the streamed arguments are never evaluated.
+// "logger" is evaluated once.  This is a statement (the loop runs at most
+// once), so it can't be used inside an expression.
+#define CPPLOG_LOGGER_AS(logger, enabled)                                                           \
+    cpplog::helpers::logger_as<sizeof(cpplog::helpers::logger_kind(logger))>::cast(enabled)
+
+#define LOG_IF_ENABLED(level, logger)                                                               \
+    for( cpplog::BaseLogger* cpplog_logger = cpplog::helpers::enabledLogger((level), logger);      \
+         cpplog_logger; cpplog_logger = NULL )                                                      \
+        LOG_LEVEL(level, CPPLOG_LOGGER_AS(logger, cpplog_logger))
+
 // Series of debug macros, depending on what we log.
 #if CPPLOG_FILTER_LEVEL <= LL_TRACE
-#define LOG_TRACE(logger)   LOG_LEVEL(LL_TRACE, logger)
+#define LOG_TRACE(logger)   LOG_IF_ENABLED(LL_TRACE, logger)
 #else
 #define LOG_TRACE(logger)   LOG_NOTHING(LL_TRACE, logger)
 #endif
 
 #if CPPLOG_FILTER_LEVEL <= LL_DEBUG
-#define LOG_DEBUG(logger)   LOG_LEVEL(LL_DEBUG, logger)
+#define LOG_DEBUG(logger)   LOG_IF_ENABLED(LL_DEBUG, logger)
 #else
 #define LOG_DEBUG(logger)   LOG_NOTHING(LL_DEBUG, logger)
 #endif
 
 #if CPPLOG_FILTER_LEVEL <= LL_INFO
-#define LOG_INFO(logger)    LOG_LEVEL(LL_INFO, logger)
+#define LOG_INFO(logger)    LOG_IF_ENABLED(LL_INFO, logger)
 #else
 #define LOG_INFO(logger)    LOG_NOTHING(LL_INFO, logger)
 #endif
 
 #if CPPLOG_FILTER_LEVEL <= LL_WARN
-#define LOG_WARN(logger)    LOG_LEVEL(LL_WARN, logger)
+#define LOG_WARN(logger)    LOG_IF_ENABLED(LL_WARN, logger)
 #else
 #define LOG_WARN(logger)    LOG_NOTHING(LL_WARN, logger)
 #endif
 
 #if CPPLOG_FILTER_LEVEL <= LL_ERROR
-#define LOG_ERROR(logger)   LOG_LEVEL(LL_ERROR, logger)
+#define LOG_ERROR(logger)   LOG_IF_ENABLED(LL_ERROR, logger)
 #else
 #define LOG_ERROR(logger)   LOG_NOTHING(LL_ERROR, logger)
 #endif
 
 // Note: Always logged.
-#define LOG_FATAL(logger)   LOG_LEVEL(LL_FATAL, logger)
+#define LOG_FATAL(logger)   LOG_IF_ENABLED(LL_FATAL, logger)
 
 
 
@@ -1170,19 +7327,50 @@ namespace cpplog
 #define DLOG(level, logger) DLOG_##level(logger)
 
 
+// Formatted logging, where each "{}" in the format is replaced by the next
+// argument:
+//      LOGF(LL_INFO, logger, "Request {} took {} ms", id, elapsed)
+// The format must be a string literal (anything else won't compile), as
+// it's kept with the call site.  Sent to a BackgroundLogger, only the
+// arguments are captured here - the text is formatted on the logger's
+// thread.  Requires C++11.
+#ifdef CPPLOG_DEFERRED_FORMAT
+#define CPPLOG_EXPAND(x)                x
+#define CPPLOG_FIRST_ARG(...)           CPPLOG_EXPAND(CPPLOG_FIRST_ARG_(__VA_ARGS__, 0))
+#define CPPLOG_FIRST_ARG_(first, ...)   first
+
+#define LOGF(level, logger, ...)                                                                    \
+    do                                                                                              \
+    {                                                                                               \
+        cpplog::BaseLogger* cpplog_logger = NULL;                                                   \
+        if( ((level) >= CPPLOG_FILTER_LEVEL || (level) >= LL_FATAL) &&                              \
+            (cpplog_logger = cpplog::helpers::enabledLogger((level), logger)) != NULL )             \
+        {                                                                                           \
+            static const cpplog::helpers::format_site cpplog_format_site =                          \
+                { __FILE__, __LINE__, "" CPPLOG_FIRST_ARG(__VA_ARGS__) "" };                        \
+            cpplog::FormattedLogMessage(&cpplog_format_site, (level), cpplog_logger)                \
+                .format(__VA_ARGS__);                                                               \
+        }                                                                                           \
+    } while( false )
+#endif
+
+
 // Log conditions.
-#define LOG_IF(level, logger, condition)        !(condition) ? (void)0 : cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
-#define LOG_IF_NOT(level, logger, condition)    !!(condition) ? (void)0 : cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
+// Note: LOG_##level(logger) may be a statement (see LOG_IF_ENABLED), so it
+// goes in the "else" of an empty "if", which also keeps a caller's own
+// "else" bound to the caller's "if".
+#define LOG_IF(level, logger, condition)        if( !(condition) ) { } else LOG_##level(logger)
+#define LOG_IF_NOT(level, logger, condition)    if( !!(condition) ) { } else LOG_##level(logger)
 
 // Debug conditions.
 #ifdef _DEBUG
-#define DLOG_IF(level, logger, condition)       !(condition) ? (void)0 : cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
-#define DLOG_IF_NOT(level, logger, condition)   !!(condition) ? (void)0 : cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
+#define DLOG_IF(level, logger, condition)       if( !(condition) ) { } else LOG_##level(logger)
+#define DLOG_IF_NOT(level, logger, condition)   if( !!(condition) ) { } else LOG_##level(logger)
 #else
-#define DLOG_IF(level, logger, condition)       (true || !(condition)) ? (void)0 : \
-                                                    cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
-#define DLOG_IF_NOT(level, logger, condition)       (true || !!(condition)) ? (void)0 : \
-                                                    cpplog::helpers::VoidStreamClass() & LOG_##level(logger)
+#define DLOG_IF(level, logger, condition)       if( true || !(condition) ) { } else \
+                                                    LOG_##level(logger)
+#define DLOG_IF_NOT(level, logger, condition)       if( true || !!(condition) ) { } else \
+                                                    LOG_##level(logger)
 #endif
 
 
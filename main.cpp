@@ -3,8 +3,16 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
 
 #include "cpplog.hpp"
+#include "binarylogreader.hpp"
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
 
 #ifdef CPPLOG_SYSTEM_IDS
 #include <boost/interprocess/detail/os_thread_functions.hpp>
@@ -13,6 +21,10 @@ using namespace boost::interprocess::detail;
 #else
 using namespace boost::interprocess::ipcdetail;
 #endif
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 #endif
 
 using namespace cpplog;
@@ -307,237 +319,3080 @@ int TestTeeLogger()
     return failed;
 }
 
-#ifdef CPPLOG_THREADING
-int TestBackgroundLogger()
+int g_evaluations = 0;
+
+int countEvaluation()
 {
-    int failed = 0, line;
-    StringLogger slogger;
-    string expectedValue;
+    return ++g_evaluations;
+}
 
-    cout << "Testing BackgroundLogger... ";
+BaseLogger& countedLogger(BaseLogger& logger)
+{
+    countEvaluation();
+    return logger;
+}
 
-    // Scoped, such that when the object is destructed we wait for the log
-    // messages to be flushed to the StringLogger.
-    {
-        BackgroundLogger blog(slogger);
-        LOG_WARN(blog) << "Background message here." << endl;   line = __LINE__;
+int TestRuntimeFiltering()
+{
+    int failed = 0;
+    StringLogger slog;
+    FilteringLogger flog(LL_WARN, slog);
+    templated::TFilteringLogger<LL_ERROR> tlog(&slog);
 
-        // Stop the logger...
-        blog.Stop();
+    cout << "Testing runtime filtering... ";
 
-        // And send another message that doesn't get logged.
-        LOG_WARN(blog) << "This message will not get logged." << endl;
-    }
+#define TEST_EVALUATED(expected)                                                                        \
+            if( g_evaluations != (expected) )                                                           \
+            {                                                                                           \
+                cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)          \
+                     << "(" << __LINE__ << "): " << g_evaluations << " evaluations" << endl;           \
+                failed++;                                                                               \
+            }                                                                                           \
+            g_evaluations = 0;                                                                          \
+            slog.clear()
+
+    // Filtered messages never evaluate their arguments.
+    LOG_INFO(flog) << countEvaluation();                 TEST_EVALUATED(0);
+    LOG_WARN(flog) << countEvaluation();                 TEST_EVALUATED(1);
+    LOG_WARN(tlog) << countEvaluation();                 TEST_EVALUATED(0);
+    LOG_ERROR(&tlog) << countEvaluation();               TEST_EVALUATED(1);
+    LOG_IF(LL_INFO, flog, true) << countEvaluation();    TEST_EVALUATED(0);
+    LOG_IF(LL_ERROR, flog, true) << countEvaluation();   TEST_EVALUATED(1);
+
+    // Composite loggers log if any of their children would.
+    FilteringLogger flog2(LL_ERROR, slog);
+    TeeLogger teelog(flog, flog2);
+    MultiplexLogger mlog(flog, false, flog2, false);
+
+    LOG_INFO(teelog) << countEvaluation();               TEST_EVALUATED(0);
+    LOG_WARN(teelog) << countEvaluation();               TEST_EVALUATED(1);
+    LOG_INFO(mlog) << countEvaluation();                 TEST_EVALUATED(0);
+    LOG_WARN(mlog) << countEvaluation();                 TEST_EVALUATED(1);
+
+    // Runtime changes take effect immediately.
+    flog.SetLevel(LL_TRACE);
+    LOG_INFO(flog) << countEvaluation();                 TEST_EVALUATED(1);
+
+    // The logger expression is evaluated once, whether or not it logs.
+    flog.SetLevel(LL_WARN);
+    LOG_INFO(countedLogger(flog)) << "Filtered";         TEST_EVALUATED(1);
+    LOG_WARN(countedLogger(flog)) << "Logged";           TEST_EVALUATED(1);
+    LOG_WARN(&countedLogger(flog)) << "Logged";          TEST_EVALUATED(1);
+    LOG_IF(LL_WARN, countedLogger(flog), true) << "";    TEST_EVALUATED(1);
+#ifdef CPPLOG_DEFERRED_FORMAT
+    LOGF(LL_WARN, countedLogger(flog), "Logged");        TEST_EVALUATED(1);
+#endif
 
-    getLogHeader(expectedValue, LL_WARN, __FILE__, line);
-    expectedValue += "Background message here.\n";
-    if( expectedValue != slogger.getString() )
+    // A caller's "else" still belongs to the caller's "if".
+    bool elseTaken = false;
+    if( false )
+        LOG_IF(LL_WARN, flog, true) << "Not logged";
+    else
+        elseTaken = true;
+
+    if( !elseTaken || !slog.getString().empty() )
     {
-        cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)
-             << "(" << line << ")" << endl;
+        cerr << "LOG_IF took the caller's else" << endl;
         failed++;
     }
 
+#undef TEST_EVALUATED
+
     cout << "done!" << endl;
     return failed;
 }
 
-class CountingLogger : public BaseLogger
+// Keeps the timestamps of the last message it was sent.
+class TimeCapturingLogger : public BaseLogger
 {
-private:
-    int         m_logMessageCount;
-
 public:
-    CountingLogger()
-        : m_logMessageCount(0)
-    { }
-
-    virtual bool sendLogMessage(LogData* /* logData */)
+    time_t          messageTime;
+    unsigned long   messageNanos;
+    ::tm            utcTime;
+    ::tm            localTime;
+    char            formattedUtc[32];
+    char            formattedLocal[32];
+
+    virtual bool sendLogMessage(LogData* logData)
     {
-        m_logMessageCount++;
+        messageTime = logData->messageTime;
+        messageNanos = logData->messageNanos;
+        utcTime = logData->utcTime;
+        logData->getLocalTime(&localTime);
+        logData->formatTime(formattedUtc);
+        logData->formatTime(formattedLocal, true);
         return true;
     }
-
-    int getCount()
-    {
-        return m_logMessageCount;
-    }
 };
 
-int TestBackgroundLoggerConcurrency()
+int TestTimestamps()
 {
     int failed = 0;
-    CountingLogger clog;
-    const int numMessages = 100000;
+    TimeCapturingLogger tlog;
 
-    cout << "Testing BackgroundLogger for consistency... " << flush;
+    cout << "Testing timestamps... ";
 
-    // Scoped!
+    // Twice, so that the second message comes from the cache.
+    for( int i = 0; i < 2; i++ )
     {
-        BackgroundLogger blog(clog);
+        time_t before = time(NULL);
+        LOG_INFO(tlog) << "Timestamp";
+        time_t after = time(NULL);
 
-        for( int i = 0; i < numMessages; i++ )
+        if( tlog.messageTime < before || tlog.messageTime > after || tlog.messageNanos >= 1000000000UL )
         {
-            LOG_INFO(blog) << "Message " << i << std::endl;
+            cerr << "Message time out of range" << endl;
+            failed++;
         }
-    }
 
-    // Validate the number of messages sent.
-    if( clog.getCount() != numMessages )
-    {
-        cerr << "Mismatch detected!  Sent: " << numMessages << ", Received: " << clog.getCount() << endl;
-        failed++;
+        ::tm expectedUtc, expectedLocal;
+        cpplog::helpers::sgmtime(&expectedUtc, &tlog.messageTime);
+        cpplog::helpers::slocaltime(&expectedLocal, &tlog.messageTime);
+
+        char expected[64];
+        strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S", &expectedUtc);
+        sprintf(expected + strlen(expected), ".%06lu", tlog.messageNanos / 1000);
+        if( strcmp(expected, tlog.formattedUtc) != 0 || mktime(&tlog.utcTime) != mktime(&expectedUtc) )
+        {
+            cerr << "UTC time mismatch: \"" << tlog.formattedUtc << "\" != \"" << expected << "\"" << endl;
+            failed++;
+        }
+
+        strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S", &expectedLocal);
+        sprintf(expected + strlen(expected), ".%06lu", tlog.messageNanos / 1000);
+        if( strcmp(expected, tlog.formattedLocal) != 0 || mktime(&tlog.localTime) != mktime(&expectedLocal) )
+        {
+            cerr << "Local time mismatch: \"" << tlog.formattedLocal << "\" != \"" << expected << "\"" << endl;
+            failed++;
+        }
     }
 
     cout << "done!" << endl;
-
     return failed;
 }
-#endif
 
-void SizeNameFunc(unsigned long logNumber, std::string& newFileName, void* /* context */)
+int TestMessageSizes()
 {
-    std::ostringstream fileName;
+    int failed = 0;
+    StringLogger log;
+    string expectedValue;
 
-    fileName << "SizeRotateFileLogger_test_" << logNumber << ".log";
+    cout << "Testing message sizes... ";
 
-    newFileName = fileName.str();
-}
+    // Short, medium (past the inline buffer), long (into the largest chunk),
+    // and too long to fit at all.
+    const size_t sizes[] = { 10, 300, 5000, 19000, 25000 };
+    for( size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++ )
+    {
+        string payload(sizes[i], 'a' + static_cast<char>(i));
 
-void TimeNameFunc(::tm* time, unsigned long /* logNumber */,
-                  std::string& newFileName, void* /* context */)
-{
-    std::ostringstream fileName;
+        LOG_INFO(log) << payload; int line = __LINE__;
 
-    fileName << "TimeRotateFileLogger_test_";
+        getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+        expectedValue += payload;
 
-    fileName << setfill('0');
+        // Overly-long messages are cut short to make room for the newline.
+        if( expectedValue.length() >= 20000 )
+            expectedValue.resize(19999);
+        expectedValue += "\n";
 
-    fileName << setw(4) << (time->tm_year + 1900) << "-"
-             << setw(2) << time->tm_mon           << "-"
-             << setw(2) << time->tm_mday
-             << "_"
-             << setw(2) << time->tm_hour << "-"
-             << setw(2) << time->tm_min  << "-"
-             << setw(2) << time->tm_sec
-             << ".log";
+        if( expectedValue != log.getString() )
+        {
+            cerr << "Mismatch detected for a " << sizes[i] << "-byte message: got "
+                 << log.getString().length() << " bytes, expected " << expectedValue.length() << endl;
+            failed++;
+        }
+        log.clear();
+    }
 
-    newFileName = fileName.str();
+    // The header leaves the stream left-aligned, as it always has.
+    LOG_INFO(log) << setw(4) << 7 << "|"; int line = __LINE__;
+    getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+    expectedValue += "7   |\n";
+    if( expectedValue != log.getString() )
+    {
+        cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)
+             << "(" << line << "): \"" << log.getString() << "\" != \""
+             << expectedValue << "\"" << endl;
+        failed++;
+    }
+    log.clear();
+
+    // Compacting keeps the contents, and the buffer can still grow after.
+    LogData* logData = LogDataPool::acquire(LL_INFO);
+    string payload(3000, 'x');
+    logData->stream << payload;
+    const char* before = logData->streamBuffer.c_str();
+    logData->streamBuffer.compact();
+    if( logData->streamBuffer.c_str() != before )
+    {
+        cerr << "Compacting moved a message that already fits its chunk" << endl;
+        failed++;
+    }
+    logData->stream << payload;
+    if( string(logData->streamBuffer.c_str()) != payload + payload )
+    {
+        cerr << "Mismatch detected after compacting a message" << endl;
+        failed++;
+    }
+    LogDataPool::release(logData);
+
+    cout << "done!" << endl;
+    return failed;
 }
 
-int TestRotatingLoggers()
+#ifdef CPPLOG_SYSTEM_IDS
+int TestSystemIds()
 {
     int failed = 0;
+    StringLogger log;
+    string expectedValue;
 
-    cout << "Testing auto-rotating loggers... ";
-
-    // We rotate at 100 bytes.
-    cpplog::SizeRotateFileLogger srlog(SizeNameFunc, 200);
-
-    // Log two messages...
-    LOG_INFO(srlog) << "Size rotated 1";
-    LOG_INFO(srlog) << "Size rotated 2";
-
-    // ... and force a rotation.
-    LOG_INFO(srlog) << "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
-                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
-                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
-                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";        // 200 * 'a'
+    cout << "Testing process/thread IDs... ";
 
-    // Log to the new file.
-    LOG_INFO(srlog) << "After size rotation 1";
-    LOG_INFO(srlog) << "After size rotation 2";
+    // A named thread gets its name after the IDs.
+    setThreadName("worker");
+    LOG_INFO(log) << "Named"; int line = __LINE__;
+    setThreadName(NULL);
 
-    // Rotate every 10 seconds.
-    cpplog::TimeRotateFileLogger trlog(TimeNameFunc, 10);
+    getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+    expectedValue.insert(expectedValue.find(']'), " worker");
+    expectedValue += "Named\n";
+    if( expectedValue != log.getString() )
+    {
+        cerr << "Mismatch detected for a named thread: \"" << log.getString()
+             << "\" != \"" << expectedValue << "\"" << endl;
+        failed++;
+    }
+    log.clear();
 
-    // Log two messages...
-    LOG_INFO(trlog) << "Time rotated 1";
-    LOG_INFO(trlog) << "Time rotated 2";
+    // ... and loses it again once it is cleared.
+    LOG_INFO(log) << "Unnamed"; line = __LINE__;
+    getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+    expectedValue += "Unnamed\n";
+    if( expectedValue != log.getString() )
+    {
+        cerr << "Mismatch detected for an unnamed thread: \"" << log.getString()
+             << "\" != \"" << expectedValue << "\"" << endl;
+        failed++;
+    }
+    log.clear();
 
-    // ... and wait for 11 seconds (to eliminate the rare edge case).
-    cout << "(waiting) " << flush;
-    time_t startTime = time(NULL);
-    while( difftime(time(NULL), startTime) < 11.0 )
+#ifndef _WIN32
+    // A forked child must log its own process ID, not its parent's.
+    int fds[2];
+    if( pipe(fds) != 0 )
     {
-        ;
+        cerr << "Unable to create a pipe" << endl;
+        return failed + 1;
     }
 
-    // Log another two now.
-    LOG_WARN(trlog) << "After rotation 1";
-    LOG_WARN(trlog) << "After rotation 2";
+    pid_t child = fork();
+    if( child == 0 )
+    {
+        close(fds[0]);
+        LOG_INFO(log) << "Child";
+        string output = log.getString();
+        ssize_t written = write(fds[1], output.c_str(), output.length());
+        _exit(written == static_cast<ssize_t>(output.length()) ? 0 : 1);
+    }
+    close(fds[1]);
+
+    string childOutput;
+    char buffer[256];
+    ssize_t count;
+    while( (count = read(fds[0], buffer, sizeof(buffer))) > 0 )
+        childOutput.append(buffer, count);
+    close(fds[0]);
+    waitpid(child, NULL, 0);
+
+    ostringstream expectedPrefix;
+    expectedPrefix << "[" << setfill('0') << setw(8) << hex << child << ".";
+    if( childOutput.compare(0, expectedPrefix.str().length(), expectedPrefix.str()) != 0 )
+    {
+        cerr << "Mismatch detected in a forked child: \"" << childOutput
+             << "\" doesn't start with \"" << expectedPrefix.str() << "\"" << endl;
+        failed++;
+    }
+#endif
 
-    // TODO: Verify that files exist with correct data.
     cout << "done!" << endl;
     return failed;
 }
+#endif
 
-int TestOtherLogging()
+#ifdef CPPLOG_DEFERRED_FORMAT
+// Takes LOGF() messages unformatted, and formats them itself.
+class DeferredLogger : public BaseLogger
+{
+public:
+    string  output;
+    int     deferred;
+
+    DeferredLogger() : deferred(0) { }
+
+    virtual bool sendLogMessage(LogData* logData)
+    {
+        string scratch;
+        if( logData->isDeferred() )
+            deferred++;
+        logData->materialize(scratch);
+        output.append(logData->streamBuffer.data(), static_cast<size_t>(logData->streamBuffer.length()));
+        return true;
+    }
+
+    virtual bool acceptsDeferred() const
+    {
+        return true;
+    }
+};
+
+int TestFormattedLogging()
 {
     int failed = 0;
+    string expectedValue;
     StringLogger log;
-#ifdef _DEBUG
-    bool debug = true;
-#else
-    bool debug = false;
-#endif
+    DeferredLogger dlog;
 
-    cout << "Testing other logging macros... ";
+    cout << "Testing formatted logging... ";
 
-#define TEST_EXPECTED(logged)                                                                           \
-            if( logged )                                                                                \
-            {                                                                                           \
-                if( log.getString().find("Assertion failed: ") == string::npos )                        \
-                {                                                                                       \
-                    cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)      \
-                         << "(" << __LINE__ << ")" << endl;                                             \
-                    failed++;                                                                           \
-                }                                                                                       \
-            } else                                                                                      \
+#define TEST_FORMATTED(logOutput, str)                                                                  \
+            getLogHeader(expectedValue, LL_INFO, __FILE__, line);                                       \
+            expectedValue += str;                                                                       \
+            expectedValue += "\n";                                                                      \
+            if( expectedValue != (logOutput) )                                                          \
             {                                                                                           \
-                if( log.getString().length() > 0 )                                                      \
-                {                                                                                       \
-                    cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)      \
-                         << "(" << __LINE__ << ")" << endl;                                             \
-                    failed++;                                                                           \
-                }                                                                                       \
-            }                                                                                           \
-            log.clear();
+                cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)          \
+                     << "(" << line << "): \"" << (logOutput) << "\" != \""                             \
+                     << expectedValue << "\"" << endl;                                                  \
+                failed++;                                                                               \
+            }
 
-    LOG_ASSERT(log, 1 == 1);    TEST_EXPECTED(false);
-    LOG_ASSERT(log, 1 == 2);    TEST_EXPECTED(true);
+    // Formatted on the spot.
+    int line;
+    LOGF(LL_INFO, log, "{} + {} = {}", 1, 2u, 3.5);                 line = __LINE__;
+    TEST_FORMATTED(log.getString(), "1 + 2 = 3.5");
+    log.clear();
 
-    DLOG_ASSERT(log, 1 == 1);   TEST_EXPECTED(false);
-    DLOG_ASSERT(log, 1 == 2);   TEST_EXPECTED(true && debug);
+    LOGF(LL_INFO, log, "{{}} {} {}", "literal", string("string"));  line = __LINE__;
+    TEST_FORMATTED(log.getString(), "{} literal string");
+    log.clear();
 
-    // Windows-only tests.
-#ifdef _WIN32
-    OutputDebugStringLogger dlog;
+    // Missing arguments leave the placeholder; extra ones are ignored.
+    LOGF(LL_INFO, log, "a={} b={}", 'x');                           line = __LINE__;
+    TEST_FORMATTED(log.getString(), "a=x b={}");
+    log.clear();
 
-    LOG_INFO(dlog) << "Test log to debug output" << endl;
+    LOGF(LL_INFO, log, "no placeholders", 1, 2);                    line = __LINE__;
+    TEST_FORMATTED(log.getString(), "no placeholders");
+    log.clear();
+
+    // Deferred - the same output, once formatted.
+    string changing("before");
+    LOGF(LL_INFO, dlog, "{} + {} = {}", 1, 2u, 3.5);                line = __LINE__;
+    TEST_FORMATTED(dlog.output, "1 + 2 = 3.5");
+    dlog.output.clear();
+
+    LOGF(LL_INFO, dlog, "{}|{}|{}|{}|{}", true, -7L, changing, (short)4, 1.5f);  line = __LINE__;
+    TEST_FORMATTED(dlog.output, "1|-7|before|4|1.5");
+    dlog.output.clear();
+
+    LOGF(LL_INFO, dlog, "{{}} {} {}", 'c', static_cast<const char*>(NULL));     line = __LINE__;
+    TEST_FORMATTED(dlog.output, "{} c (null)");
+    dlog.output.clear();
+
+    if( dlog.deferred != 3 )
+    {
+        cerr << "Expected 3 deferred messages, got " << dlog.deferred << endl;
+        failed++;
+    }
+
+#ifdef CPPLOG_THREADING
+    // Formatted on the background thread, after the arguments have changed.
+    {
+        BackgroundLogger blog(log);
+        LOGF(LL_INFO, blog, "value: {}", changing);                 line = __LINE__;
+        changing = "after";
+    }
+    TEST_FORMATTED(log.getString(), "value: before");
+    log.clear();
 #endif
 
+#undef TEST_FORMATTED
+
     cout << "done!" << endl;
     return failed;
 }
+#endif
 
-int TestLogging()
+int TestBinaryFileLogger()
 {
-    int totalFailures = 0;
+    int failed = 0, line;
+    string expectedValue;
+    vector<string> expected;
 
-    totalFailures += TestLogLevels();
-    totalFailures += TestDebugLogLevels();
-    totalFailures += TestConditionMacros();
-#ifdef CPPLOG_HELPER_MACROS
-    totalFailures += TestCheckMacros();
-#endif
-    totalFailures += TestTeeLogger();
-    totalFailures += TestRotatingLoggers();
-    totalFailures += TestOtherLogging();
+    cout << "Testing BinaryFileLogger... ";
 
-#ifdef CPPLOG_THREADING
-    totalFailures += TestBackgroundLogger();
-    totalFailures += TestBackgroundLoggerConcurrency();
+    {
+        BinaryFileLogger blog("binary.log");
+
+        LOG_INFO(blog) << "Text message " << 1;                     line = __LINE__;
+        getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+        expected.push_back(expectedValue + "Text message 1\n");
+
+        for( int i = 0; i < 2; i++ )
+        {
+            LOG_WARN(blog) << "Repeated " << i;                     line = __LINE__;
+            getLogHeader(expectedValue, LL_WARN, __FILE__, line);
+            ostringstream text;
+            text << expectedValue << "Repeated " << i << "\n";
+            expected.push_back(text.str());
+        }
+
+#ifdef CPPLOG_DEFERRED_FORMAT
+        LOGF(LL_ERROR, blog, "Formatted {} and {}", 42, "text");   line = __LINE__;
+        getLogHeader(expectedValue, LL_ERROR, __FILE__, line);
+        expected.push_back(expectedValue + "Formatted 42 and text\n");
+#endif
+
+        // No default header.
+        LogMessage(__FILE__, __LINE__, LL_INFO, blog, false).getStream() << "Custom";
+        expected.push_back("Custom\n");
+    }
+
+    // Appending starts a new dictionary.
+    {
+        BinaryFileLogger blog("binary.log", true);
+        LOG_INFO(blog) << "Appended";                               line = __LINE__;
+        getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+        expected.push_back(expectedValue + "Appended\n");
+    }
+
+    ifstream input("binary.log", ios_base::in | ios_base::binary);
+    BinaryLogReader reader(input);
+
+    size_t count = 0;
+    string text;
+    while( reader.next(text) )
+    {
+        if( count >= expected.size() || text != expected[count] )
+        {
+            cerr << "Mismatch detected in decoded message " << count << ": \"" << text << "\" != \""
+                 << (count < expected.size() ? expected[count] : string()) << "\"" << endl;
+            failed++;
+        }
+        count++;
+    }
+
+    if( reader.failed() || count != expected.size() )
+    {
+        cerr << "Decoded " << count << " of " << expected.size() << " messages" << endl;
+        failed++;
+    }
+
+    // A damaged length is reported, not trusted.
+    {
+        string damaged(BinaryFileLogger::fileHeader(), BinaryFileLogger::k_fileHeaderLength);
+        damaged += "S\x01\xF0\xFF\xFF\xFF\x0F" "short";
+        istringstream damagedInput(damaged);
+        BinaryLogReader damagedReader(damagedInput);
+
+        if( damagedReader.next(text) || !damagedReader.failed() )
+        {
+            cerr << "A damaged string length wasn't reported" << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#ifndef _WIN32
+string readFile(const char* path)
+{
+    ifstream input(path, ios_base::in | ios_base::binary);
+    ostringstream contents;
+    contents << input.rdbuf();
+    return contents.str();
+}
+
+bool fileExists(const string& path)
+{
+    return ifstream(path.c_str()).good();
+}
+
+int TestMmapFileLogger()
+{
+    int failed = 0;
+    StringLogger slog;
+
+    cout << "Testing MmapFileLogger... ";
+
+    // A small window, so that messages cross from one to the next.
+    {
+        MmapFileLogger mlog("mmap.log", false, 1);
+        TeeLogger tlog(mlog, slog);
+        for( int i = 0; i < 500; i++ )
+            LOG_INFO(tlog) << "Message number " << i << " " << string(i % 50, '.');
+    }
+
+    string contents = readFile("mmap.log");
+    if( contents != slog.getString() )
+    {
+        cerr << "Mismatch detected in mmap.log: got " << contents.length()
+             << " bytes, expected " << slog.getString().length() << endl;
+        failed++;
+    }
+
+    // Leftover zeros, as from a crash, are dropped when appending.
+    {
+        ofstream padding("mmap.log", ios_base::out | ios_base::app | ios_base::binary);
+        padding << string(5000, '\0');
+    }
+    {
+        MmapFileLogger mlog("mmap.log", true);
+        TeeLogger tlog(mlog, slog);
+        LOG_INFO(tlog) << "Appended";
+    }
+
+    contents = readFile("mmap.log");
+    if( contents != slog.getString() )
+    {
+        cerr << "Mismatch detected in mmap.log after appending: got " << contents.length()
+             << " bytes, expected " << slog.getString().length() << endl;
+        failed++;
+    }
+
+    // With no room for a window (here, past a file size limit), messages
+    // are written the plain way.
+    {
+        struct rlimit saved, limited;
+        getrlimit(RLIMIT_FSIZE, &saved);
+        limited = saved;
+        limited.rlim_cur = 64 * 1024;
+        void (*oldHandler)(int) = signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limited);
+
+        bool mapped;
+        slog.clear();
+        {
+            MmapFileLogger mlog("mmap.log", false, 1024 * 1024);
+            TeeLogger tlog(mlog, slog);
+            for( int i = 0; i < 100; i++ )
+                LOG_INFO(tlog) << "Message number " << i;
+            mapped = mlog.isMapped();
+        }
+
+        setrlimit(RLIMIT_FSIZE, &saved);
+        signal(SIGXFSZ, oldHandler);
+
+        contents = readFile("mmap.log");
+        if( mapped || contents != slog.getString() )
+        {
+            cerr << "Mismatch detected in mmap.log without a mapping: got " << contents.length()
+                 << " bytes, expected " << slog.getString().length() << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+void SizeRotationNameFunc(unsigned long logNumber, std::string& newFileName, void* /* context */)
+{
+    std::ostringstream fileName;
+
+    fileName << "SizeRotation_test_" << logNumber << ".log";
+
+    newFileName = fileName.str();
+}
+
+// Two files, used in turn.
+void CyclicNameFunc(unsigned long logNumber, std::string& newFileName, void* /* context */)
+{
+    newFileName = (logNumber % 2) ? "SizeRotation_cyclic_1.log" : "SizeRotation_cyclic_0.log";
+}
+
+int TestSizeRotation()
+{
+    int failed = 0;
+
+    cout << "Testing size rotation... ";
+
+    // Single messages, then batches, preallocating files and syncing
+    // them as they're finished.
+    for( int pass = 0; pass < 2; pass++ )
+    {
+        StringLogger slog;
+        {
+            SizeRotateFileLogger srlog(SizeRotationNameFunc, 1000);
+            srlog.setPreallocate(pass == 1);
+            srlog.setSyncOnRotate(pass == 1);
+
+            if( pass == 0 )
+            {
+                TeeLogger tlog(srlog, slog);
+                for( int i = 0; i < 100; i++ )
+                    LOG_INFO(tlog) << "Rotated message number " << i;
+            }
+            else
+            {
+                LogData* batch[10];
+                for( int b = 0; b < 10; b++ )
+                {
+                    for( int i = 0; i < 10; i++ )
+                    {
+                        batch[i] = new LogData(LL_INFO);
+                        batch[i]->stream << "Batched message number " << (b * 10 + i) << " " << string(40, '.') << "\n";
+                        slog.sendLogMessage(batch[i]);
+                    }
+                    srlog.sendLogMessages(batch, 10);
+                    for( int i = 0; i < 10; i++ )
+                        delete batch[i];
+                }
+            }
+
+#ifdef CPPLOG_THREADING
+            // The next file is created ahead of time (give it a moment).
+            string name;
+            unsigned long next = 0;
+            for( int tries = 0; tries < 200; tries++ )
+            {
+                next = 0;
+                while( SizeRotationNameFunc(next, name, NULL), fileExists(name) )
+                    next++;
+                SizeRotationNameFunc(next - 1, name, NULL);
+                if( next >= 2 && readFile(name.c_str()).empty() )
+                    break;
+                boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            }
+            if( next < 2 || !readFile(name.c_str()).empty() )
+            {
+                cerr << "Mismatch detected: the next file wasn't created ahead of time" << endl;
+                failed++;
+            }
+#endif
+        }
+
+        // Every file but the last one goes just over the limit.
+        vector<string> files;
+        string name;
+        while( SizeRotationNameFunc(files.size(), name, NULL), fileExists(name) )
+        {
+            files.push_back(readFile(name.c_str()));
+            remove(name.c_str());
+        }
+
+        string contents;
+        for( size_t i = 0; i < files.size(); i++ )
+        {
+            if( i + 1 < files.size() && (files[i].length() <= 1000 || files[i].length() > 1100) )
+            {
+                cerr << "Mismatch detected: file " << i << " has " << files[i].length() << " bytes" << endl;
+                failed++;
+            }
+            contents += files[i];
+        }
+
+        if( files.size() < 4 || contents != slog.getString() )
+        {
+            cerr << "Mismatch detected in rotated files (pass " << pass << "): " << files.size()
+                 << " files, " << contents.length() << " bytes, expected "
+                 << slog.getString().length() << endl;
+            failed++;
+        }
+    }
+
+    // With names that cycle, the two files hold the last two logs - and
+    // nothing else.
+    {
+        StringLogger slog;
+        {
+            SizeRotateFileLogger srlog(CyclicNameFunc, 1000);
+            TeeLogger tlog(srlog, slog);
+            for( int i = 0; i < 100; i++ )
+                LOG_INFO(tlog) << "Cycled message number " << i;
+        }
+
+        string first, second;
+        CyclicNameFunc(0, first, NULL);
+        CyclicNameFunc(1, second, NULL);
+        string one = readFile(first.c_str()), two = readFile(second.c_str());
+        remove(first.c_str());
+        remove(second.c_str());
+
+        const string& logged = slog.getString();
+        string oneTwo = one + two, twoOne = two + one;
+        bool matched = (!one.empty() && !two.empty() && oneTwo.length() > 1000 && oneTwo.length() <= logged.length()) &&
+                       (logged.compare(logged.length() - oneTwo.length(), oneTwo.length(), oneTwo) == 0 ||
+                        logged.compare(logged.length() - twoOne.length(), twoOne.length(), twoOne) == 0);
+        if( !matched )
+        {
+            cerr << "Mismatch detected in cycled files: " << one.length() << " and " << two.length()
+                 << " bytes" << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Also collects the names into "context", if given.
+void TimeRotationNameFunc(::tm* time, unsigned long logNumber,
+                          std::string& newFileName, void* context)
+{
+    std::ostringstream fileName;
+
+    fileName << "TimeRotation_test_" << logNumber << "_" << setfill('0')
+             << setw(2) << time->tm_hour << setw(2) << time->tm_min << setw(2) << time->tm_sec
+             << ".log";
+
+    newFileName = fileName.str();
+    if( context )
+        static_cast<vector<string>*>(context)->push_back(newFileName);
+}
+
+int TestTimeRotation()
+{
+    int failed = 0;
+
+    cout << "Testing time rotation... " << flush;
+
+    // The top of the next hour, and the one after.
+    time_t startTime = time(NULL);
+    tm timeInfo;
+    cpplog::helpers::slocaltime(&timeInfo, &startTime);
+    timeInfo.tm_min = 0;
+    timeInfo.tm_sec = 0;
+    timeInfo.tm_isdst = -1;
+    time_t firstBoundary = mktime(&timeInfo) + 3600;
+    time_t secondBoundary = firstBoundary + 3600;
+
+    vector<string> names;
+    {
+        TimeRotateFileLogger trlog(TimeRotationNameFunc, &names, 3600);
+
+        // Messages go by the time they were captured, and batches are
+        // split where they cross a boundary.
+        time_t times[] = { startTime, firstBoundary + 5, firstBoundary + 10, secondBoundary, secondBoundary + 1 };
+        LogData* messages[5];
+        for( int i = 0; i < 5; i++ )
+        {
+            messages[i] = new LogData(LL_INFO);
+            messages[i]->messageTime = times[i];
+            messages[i]->stream << "Message " << i << "\n";
+        }
+
+        trlog.sendLogMessage(messages[0]);
+        trlog.sendLogMessage(messages[1]);
+        trlog.sendLogMessages(&messages[2], 3);
+
+        for( int i = 0; i < 5; i++ )
+            delete messages[i];
+    }
+
+    // Later files are named after the hour they start.
+    string secondName, thirdName;
+    cpplog::helpers::slocaltime(&timeInfo, &firstBoundary);
+    TimeRotationNameFunc(&timeInfo, 1, secondName, NULL);
+    cpplog::helpers::slocaltime(&timeInfo, &secondBoundary);
+    TimeRotationNameFunc(&timeInfo, 2, thirdName, NULL);
+
+    if( names.size() != 3 || names[1] != secondName || names[2] != thirdName ||
+        readFile(names[0].c_str()) != "Message 0\n" ||
+        readFile(names[1].c_str()) != "Message 1\nMessage 2\n" ||
+        readFile(names[2].c_str()) != "Message 3\nMessage 4\n" )
+    {
+        cerr << "Mismatch detected in time-rotated files" << endl;
+        failed++;
+    }
+
+    for( size_t i = 0; i < names.size(); i++ )
+        remove(names[i].c_str());
+
+#ifndef _WIN32
+    // A daily log rotates at local midnight on the days the clocks change
+    // (23 and 25 hours long in New York), and catches up over long gaps.
+    const char* oldTz = getenv("TZ");
+    string savedTz = oldTz ? oldTz : "";
+    setenv("TZ", "America/New_York", 1);
+    tzset();
+
+    names.clear();
+    {
+        TimeRotateFileLogger trlog(TimeRotationNameFunc, &names, 24 * 60 * 60);
+
+        // Around 2037-03-08 (spring forward), then 2037-11-01 (fall back).
+        const int days[][3] = { { 2037, 3, 8 }, { 2037, 3, 8 }, { 2037, 3, 9 },
+                                { 2037, 11, 1 }, { 2037, 11, 1 }, { 2037, 11, 2 } };
+        const int hours[][2] = { { 12, 0 }, { 23, 30 }, { 0, 30 }, { 12, 0 }, { 23, 30 }, { 0, 30 } };
+        for( int i = 0; i < 6; i++ )
+        {
+            tm when = tm();
+            when.tm_year = days[i][0] - 1900;
+            when.tm_mon = days[i][1] - 1;
+            when.tm_mday = days[i][2];
+            when.tm_hour = hours[i][0];
+            when.tm_min = hours[i][1];
+            when.tm_isdst = -1;
+
+            LogData message(LL_INFO);
+            message.messageTime = mktime(&when);
+            message.stream << "Message " << i << "\n";
+            trlog.sendLogMessage(&message);
+        }
+    }
+
+    if( oldTz )
+        setenv("TZ", savedTz.c_str(), 1);
+    else
+        unsetenv("TZ");
+    tzset();
+
+    bool allMidnight = names.size() == 5;
+    for( size_t i = 1; allMidnight && i < names.size(); i++ )
+        allMidnight = names[i].find("_000000.log") != string::npos;
+
+    if( !allMidnight ||
+        readFile(names[1].c_str()) != "Message 0\nMessage 1\n" ||
+        readFile(names[2].c_str()) != "Message 2\n" ||
+        readFile(names[3].c_str()) != "Message 3\nMessage 4\n" ||
+        readFile(names[4].c_str()) != "Message 5\n" )
+    {
+        cerr << "Mismatch detected: daily log didn't rotate at midnight across DST" << endl;
+        failed++;
+    }
+
+    for( size_t i = 0; i < names.size(); i++ )
+        remove(names[i].c_str());
+#endif
+
+#ifdef CPPLOG_THREADING
+    // An idle log still rotates on time.
+    names.clear();
+    {
+        TimeRotateFileLogger trlog(TimeRotationNameFunc, &names, 1);
+        LOG_INFO(trlog) << "Before going idle";
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(2500));
+    }
+
+    if( names.size() < 2 )
+    {
+        cerr << "Mismatch detected: the idle log wasn't rotated" << endl;
+        failed++;
+    }
+
+    for( size_t i = 0; i < names.size(); i++ )
+        remove(names[i].c_str());
+#endif
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#endif
+
+// Counts how often the stream is flushed.
+class FlushCountingBuf : public stringbuf
+{
+public:
+    int flushes;
+
+    FlushCountingBuf() : flushes(0) { }
+
+protected:
+    virtual int sync()
+    {
+        flushes++;
+        return 0;
+    }
+};
+
+int TestFlushPolicy()
+{
+    int failed = 0;
+
+    cout << "Testing flush policies... ";
+
+#define CHECK_FLUSHES(expected)                                                                         \
+            if( buf.flushes != (expected) )                                                             \
+            {                                                                                           \
+                cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)          \
+                     << "(" << __LINE__ << "): " << buf.flushes << " flushes, expected "                \
+                     << (expected) << endl;                                                             \
+                failed++;                                                                               \
+            }                                                                                           \
+            buf.flushes = 0;
+
+    FlushCountingBuf buf;
+    ostream stream(&buf);
+    OstreamLogger olog(stream);
+
+    // By default, every message is flushed.
+    LOG_INFO(olog) << "One";
+    LOG_INFO(olog) << "Two";
+    CHECK_FLUSHES(2);
+
+    // Only once enough has been written.
+    olog.setFlushPolicy(FlushPolicy(1000));
+    for( int i = 0; i < 5; i++ )
+        LOG_INFO(olog) << string(90, 'x');
+    CHECK_FLUSHES(0);
+    for( int i = 0; i < 5; i++ )
+        LOG_INFO(olog) << string(90, 'x');
+    CHECK_FLUSHES(1);
+
+    // Errors go out right away.
+    olog.setFlushPolicy(FlushPolicy(1000, 0, LL_ERROR));
+    LOG_WARN(olog) << "Warning";
+    CHECK_FLUSHES(0);
+    LOG_ERROR(olog) << "Error";
+    CHECK_FLUSHES(1);
+
+    // Otherwise, only when asked.
+    olog.setFlushPolicy(FlushPolicy::manual());
+    for( int i = 0; i < 100; i++ )
+        LOG_ERROR(olog) << string(90, 'x');
+    CHECK_FLUSHES(0);
+    olog.flush();
+    CHECK_FLUSHES(1);
+
+#ifdef CPPLOG_THREADING
+    // The timer flushes while nothing is being logged...
+    olog.setFlushPolicy(FlushPolicy(0, 10));
+    LOG_INFO(olog) << "Timed";
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    CHECK_FLUSHES(1);
+
+    // ... but only if there's something to flush.
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    CHECK_FLUSHES(0);
+
+    olog.setFlushPolicy(FlushPolicy());
+#endif
+
+#undef CHECK_FLUSHES
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#ifdef CPPLOG_THREADING
+int TestBackgroundLogger()
+{
+    int failed = 0, line;
+    StringLogger slogger;
+    string expectedValue;
+
+    cout << "Testing BackgroundLogger... ";
+
+    // Scoped, such that when the object is destructed we wait for the log
+    // messages to be flushed to the StringLogger.
+    {
+        BackgroundLogger blog(slogger);
+        LOG_WARN(blog) << "Background message here." << endl;   line = __LINE__;
+
+        // Stop the logger...
+        blog.Stop();
+
+        // And send another message that doesn't get logged.
+        LOG_WARN(blog) << "This message will not get logged." << endl;
+    }
+
+    getLogHeader(expectedValue, LL_WARN, __FILE__, line);
+    expectedValue += "Background message here.\n";
+    if( expectedValue != slogger.getString() )
+    {
+        cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)
+             << "(" << line << ")" << endl;
+        failed++;
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+class CountingLogger : public BaseLogger
+{
+private:
+    int         m_logMessageCount;
+
+public:
+    CountingLogger()
+        : m_logMessageCount(0)
+    { }
+
+    virtual bool sendLogMessage(LogData* /* logData */)
+    {
+        m_logMessageCount++;
+        return true;
+    }
+
+    int getCount()
+    {
+        return m_logMessageCount;
+    }
+};
+
+// Sends "count" empty messages to "blog", counting those handed back.
+void sendWhileStopping(BackgroundLogger* blog, int count, boost::atomic<int>* handedBack)
+{
+    for( int i = 0; i < count; i++ )
+    {
+        LogData* logData = LogDataPool::acquire(LL_INFO);
+        if( blog->sendLogMessage(logData) )
+        {
+            handedBack->fetch_add(1);
+            LogDataPool::release(logData);
+        }
+    }
+}
+
+int TestBackgroundLoggerConcurrency()
+{
+    int failed = 0;
+    CountingLogger clog;
+    const int numMessages = 100000;
+
+    cout << "Testing BackgroundLogger for consistency... " << flush;
+
+    // Scoped!
+    {
+        BackgroundLogger blog(clog);
+
+        for( int i = 0; i < numMessages; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i << std::endl;
+        }
+    }
+
+    // Validate the number of messages sent.
+    if( clog.getCount() != numMessages )
+    {
+        cerr << "Mismatch detected!  Sent: " << numMessages << ", Received: " << clog.getCount() << endl;
+        failed++;
+    }
+
+    // Messages sent while stopping are either delivered or handed back.
+    const BackgroundLogger::QueueEngine engines[] =
+        { BackgroundLogger::QE_MUTEX, BackgroundLogger::QE_RING, BackgroundLogger::QE_PER_THREAD };
+    for( size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++ )
+    {
+        const int numProducers = 4, perProducer = 5000;
+        CountingLogger counted;
+        boost::atomic<int> handedBack(0);
+        {
+            BackgroundLogger blog(&counted, engines[e]);
+            boost::thread_group producers;
+            for( int i = 0; i < numProducers; i++ )
+                producers.create_thread(boost::bind(&sendWhileStopping, &blog, perProducer, &handedBack));
+
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            blog.Stop();
+            producers.join_all();
+        }
+
+        if( counted.getCount() + handedBack.load() != numProducers * perProducer )
+        {
+            cerr << "Engine " << e << ": " << counted.getCount() << " delivered and " << handedBack.load()
+                 << " handed back, of " << numProducers * perProducer << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+
+    return failed;
+}
+
+// Checks that every producer's messages arrive in the order they were sent.
+// Messages must look like "<producer> <sequence>".
+class OrderCheckingLogger : public BaseLogger
+{
+private:
+    std::vector<int>    m_nextSequence;
+    int                 m_received;
+    int                 m_outOfOrder;
+
+public:
+    OrderCheckingLogger(int numProducers)
+        : m_nextSequence(numProducers, 0), m_received(0), m_outOfOrder(0)
+    { }
+
+    virtual bool sendLogMessage(LogData* logData)
+    {
+        string text(logData->streamBuffer.data(), static_cast<size_t>(logData->streamBuffer.length()));
+        size_t body = text.find("): ");
+        int producer = -1, sequence = -1;
+
+        if( body == string::npos || sscanf(text.c_str() + body + 3, "%d %d", &producer, &sequence) != 2 ||
+            producer < 0 || producer >= static_cast<int>(m_nextSequence.size()) ||
+            m_nextSequence[producer] != sequence )
+        {
+            m_outOfOrder++;
+        }
+        else
+        {
+            m_nextSequence[producer]++;
+        }
+
+        m_received++;
+        return true;
+    }
+
+    int getCount()      { return m_received; }
+    int getOutOfOrder() { return m_outOfOrder; }
+};
+
+void ProduceMessages(BaseLogger* logger, int producer, int numMessages)
+{
+    for( int i = 0; i < numMessages; i++ )
+    {
+        LOG_INFO(*logger) << producer << " " << i;
+    }
+}
+
+int TestBackgroundLoggerRing()
+{
+    int failed = 0;
+    const int numProducers = 4;
+    const int numMessages = 25000;
+    OrderCheckingLogger olog(numProducers);
+
+    cout << "Testing BackgroundLogger with a ring queue... " << flush;
+
+    // Scoped!  A small ring makes sure producers hit the "full" case.
+    {
+        BackgroundLogger blog(olog, BackgroundLogger::QE_RING, 64);
+
+        boost::thread_group producers;
+        for( int p = 0; p < numProducers; p++ )
+            producers.create_thread(boost::bind(&ProduceMessages, &blog, p, numMessages));
+        producers.join_all();
+    }
+
+    if( olog.getCount() != numProducers * numMessages )
+    {
+        cerr << "Mismatch detected!  Sent: " << numProducers * numMessages
+             << ", Received: " << olog.getCount() << endl;
+        failed++;
+    }
+    if( olog.getOutOfOrder() != 0 )
+    {
+        cerr << olog.getOutOfOrder() << " messages arrived out of order" << endl;
+        failed++;
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+int TestBackgroundLoggerPerThread()
+{
+    int failed = 0;
+    const int numProducers = 4;
+    const int numMessages = 25000;
+    OrderCheckingLogger olog(2 * numProducers);
+
+    cout << "Testing BackgroundLogger with per-thread queues... " << flush;
+
+    // Scoped!  Small buffers make sure producers hit the "full" case.
+    {
+        BackgroundLogger blog(olog, BackgroundLogger::QE_PER_THREAD, 64);
+
+        // Two rounds of threads, so the first round's buffers are reclaimed
+        // while we're still running.
+        for( int round = 0; round < 2; round++ )
+        {
+            boost::thread_group producers;
+            for( int p = 0; p < numProducers; p++ )
+            {
+                producers.create_thread(boost::bind(&ProduceMessages, &blog,
+                                                    round * numProducers + p, numMessages));
+            }
+            producers.join_all();
+        }
+    }
+
+    if( olog.getCount() != 2 * numProducers * numMessages )
+    {
+        cerr << "Mismatch detected!  Sent: " << 2 * numProducers * numMessages
+             << ", Received: " << olog.getCount() << endl;
+        failed++;
+    }
+    if( olog.getOutOfOrder() != 0 )
+    {
+        cerr << olog.getOutOfOrder() << " messages arrived out of order" << endl;
+        failed++;
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#ifndef _WIN32
+int TestAsyncFileLogger()
+{
+    int failed = 0;
+
+    cout << "Testing AsyncFileLogger... " << flush;
+
+    // Once with io_uring (where we have it), and once with the thread pool.
+    for( int pass = 0; pass < 2; pass++ )
+    {
+        StringLogger slog;
+
+        // Tiny buffers, so that messages span them and we run out.
+        {
+            AsyncFileLogger alog("async.log", false, 4, 64, pass == 0);
+            TeeLogger tlog(alog, slog);
+            for( int i = 0; i < 2000; i++ )
+                LOG_INFO(tlog) << "Message number " << i;
+        }
+
+        // And appending, behind a BackgroundLogger.
+        {
+            AsyncFileLogger alog("async.log", true);
+            TeeLogger tlog(alog, slog);
+            BackgroundLogger blog(tlog);
+            for( int i = 0; i < 2000; i++ )
+                LOG_INFO(blog) << "Background message number " << i;
+        }
+
+        string contents = readFile("async.log");
+        if( contents != slog.getString() )
+        {
+            cerr << "Mismatch detected in async.log (pass " << pass << "): got " << contents.length()
+                 << " bytes, expected " << slog.getString().length() << endl;
+            failed++;
+        }
+    }
+
+    // A buffer that isn't full waits for the flush policy, not the next
+    // message.
+    {
+        AsyncFileLogger alog("async.log");
+        alog.setFlushPolicy(FlushPolicy::manual());
+        for( int i = 0; i < 20; i++ )
+            LOG_INFO(alog) << "Buffered message number " << i;
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        if( !readFile("async.log").empty() )
+        {
+            cerr << "AsyncFileLogger wrote a buffer that wasn't full" << endl;
+            failed++;
+        }
+
+        // An error is written straight away...
+        alog.setFlushPolicy(FlushPolicy(0, 0, LL_ERROR));
+        LOG_ERROR(alog) << "Urgent";
+        for( int i = 0; i < 100 && readFile("async.log").find("Urgent") == string::npos; i++ )
+            boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        if( readFile("async.log").find("Urgent") == string::npos )
+        {
+            cerr << "AsyncFileLogger didn't write an error straight away" << endl;
+            failed++;
+        }
+
+        // ...and the timer gets the rest.
+        alog.setFlushPolicy(FlushPolicy(0, 50));
+        LOG_INFO(alog) << "Timed";
+        for( int i = 0; i < 100 && readFile("async.log").find("Timed") == string::npos; i++ )
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        if( readFile("async.log").find("Timed") == string::npos )
+        {
+            cerr << "AsyncFileLogger's timer didn't write a partial buffer" << endl;
+            failed++;
+        }
+    }
+
+    // A file that can't be opened loses messages, but says so.
+    {
+        AsyncFileLogger alog("no-such-directory/async.log");
+        LOG_INFO(alog) << "Lost";
+        alog.Flush();
+
+        if( alog.is_open() || alog.failedWrites() != 1 )
+        {
+            cerr << "AsyncFileLogger without a file: open " << alog.is_open()
+                 << ", " << alog.failedWrites() << " failed writes" << endl;
+            failed++;
+        }
+
+#ifdef CPPLOG_METRICS
+        LoggerMetrics metrics;
+        alog.getMetrics(metrics);
+        if( metrics.writeErrors != 2 )
+        {
+            cerr << "AsyncFileLogger without a file: expected 2 write errors, got "
+                 << metrics.writeErrors << endl;
+            failed++;
+        }
+#endif
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#ifdef CPPLOG_WITH_ZLIB
+string readGzipFile(const char* path)
+{
+    string contents;
+    gzFile file = gzopen(path, "rb");
+    if( !file )
+        return contents;
+
+    char buffer[4096];
+    int length;
+    while( (length = gzread(file, buffer, sizeof(buffer))) > 0 )
+        contents.append(buffer, length);
+
+    gzclose(file);
+    return contents;
+}
+#endif
+
+void ArchiveNameFunc(unsigned long logNumber, std::string& newFileName, void* /* context */)
+{
+    std::ostringstream fileName;
+
+    fileName << "LogArchiver_test_" << logNumber << ".log";
+
+    newFileName = fileName.str();
+}
+
+int TestLogArchiver()
+{
+    int failed = 0;
+
+    cout << "Testing LogArchiver... " << flush;
+
+#ifdef CPPLOG_WITH_ZLIB
+    LogArchiver::Compression compression = LogArchiver::AC_GZIP;
+#else
+    LogArchiver::Compression compression = LogArchiver::AC_NONE;
+#endif
+
+    StringLogger slog;
+    LogArchiver archiver(compression, RetentionPolicy(3));
+    {
+        // Keeps the three newest logs.
+        SizeRotateFileLogger srlog(ArchiveNameFunc, 1000);
+        srlog.setArchiver(&archiver);
+
+        TeeLogger tlog(srlog, slog);
+        for( int i = 0; i < 200; i++ )
+            LOG_INFO(tlog) << "Archived message number " << i;
+    }
+    archiver.wait();
+
+    // The current log is the last one.
+    unsigned long current = 0;
+    string name;
+    for( unsigned long i = 0; i < 1000; i++ )
+    {
+        ArchiveNameFunc(i, name, NULL);
+        if( fileExists(name) || fileExists(name + archiver.extension()) )
+            current = i;
+    }
+
+    // What was kept (after decompressing), followed by the current log,
+    // should be the end of what was logged.
+    string kept;
+    for( unsigned long i = 0; i <= current; i++ )
+    {
+        ArchiveNameFunc(i, name, NULL);
+        if( i == current )
+        {
+            kept += readFile(name.c_str());
+        }
+        else if( fileExists(name + archiver.extension()) != (i + 3 >= current) )
+        {
+            cerr << "Mismatch detected: " << name << archiver.extension()
+                 << (i + 3 >= current ? " is missing" : " was kept") << endl;
+            failed++;
+        }
+        else if( i + 3 >= current )
+        {
+#ifdef CPPLOG_WITH_ZLIB
+            kept += readGzipFile((name + archiver.extension()).c_str());
+#else
+            kept += readFile(name.c_str());
+#endif
+        }
+        remove((name + archiver.extension()).c_str());
+        remove(name.c_str());
+    }
+
+    const string& logged = slog.getString();
+    if( current < 4 || kept.length() < 3000 || kept.length() > logged.length() ||
+        logged.compare(logged.length() - kept.length(), kept.length(), kept) != 0 )
+    {
+        cerr << "Mismatch detected in archived logs: " << current << " rotations, got "
+             << kept.length() << " bytes" << endl;
+        failed++;
+    }
+
+#ifdef CPPLOG_WITH_ZLIB
+    // A file big enough to be split across threads.
+    {
+        string original;
+        for( int i = 0; original.length() < 3 * LogArchiver::k_chunkSize + 1000; i++ )
+        {
+            ostringstream line;
+            line << "Line number " << i << " of a large log\n";
+            original += line.str();
+        }
+        {
+            ofstream large("LogArchiver_large.log", ios_base::out | ios_base::binary);
+            large << original;
+        }
+
+        LogArchiver archiver(LogArchiver::AC_GZIP, RetentionPolicy(), 2);
+        archiver.archive("LogArchiver_large.log");
+        archiver.wait();
+
+        if( fileExists("LogArchiver_large.log") || readGzipFile("LogArchiver_large.log.gz") != original )
+        {
+            cerr << "Mismatch detected in LogArchiver_large.log.gz" << endl;
+            failed++;
+        }
+        remove("LogArchiver_large.log.gz");
+    }
+#endif
+
+    cout << "done!" << endl;
+    return failed;
+}
+#endif
+
+int TestBatchDelivery()
+{
+    int failed = 0;
+    StringLogger slogger;
+    string expectedValue;
+
+    cout << "Testing batch delivery... " << flush;
+
+    // Directly...
+    LogData* batch[3];
+    for( int i = 0; i < 3; i++ )
+    {
+        batch[i] = LogDataPool::acquire(LL_INFO);
+        batch[i]->stream << "Batched " << i << "\n";
+        expectedValue += batch[i]->streamBuffer.c_str();
+    }
+
+    slogger.sendLogMessages(batch, 3);
+    for( int i = 0; i < 3; i++ )
+    {
+        // The logger doesn't keep messages, so we still own them.
+        if( !batch[i] )
+        {
+            cerr << "StringLogger took ownership of message " << i << endl;
+            failed++;
+            continue;
+        }
+        LogDataPool::release(batch[i]);
+    }
+
+    if( expectedValue != slogger.getString() )
+    {
+        cerr << "Mismatch detected: \"" << slogger.getString() << "\" != \""
+             << expectedValue << "\"" << endl;
+        failed++;
+    }
+    slogger.clear();
+
+    // ... and through a BackgroundLogger, which drains in batches.
+    expectedValue.clear();
+    {
+        BackgroundLogger blog(slogger);
+        for( int i = 0; i < 500; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i; int line = __LINE__;
+
+            string header;
+            ostringstream body;
+            getLogHeader(header, LL_INFO, __FILE__, line);
+            body << "Message " << i << "\n";
+            expectedValue += header + body.str();
+        }
+    }
+
+    if( expectedValue != slogger.getString() )
+    {
+        cerr << "Mismatch detected in background batch delivery" << endl;
+        failed++;
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Holds up every message until it is opened, and keeps a copy of each one.
+class GateLogger : public BaseLogger
+{
+private:
+    boost::mutex                m_mutex;
+    boost::condition_variable   m_condition;
+    bool                        m_open;
+    std::vector<string>         m_messages;
+
+public:
+    GateLogger()
+        : m_open(false)
+    { }
+
+    void open()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_open = true;
+        m_condition.notify_all();
+    }
+
+    virtual bool sendLogMessage(LogData* logData)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        while( !m_open )
+            m_condition.wait(lock);
+
+        m_messages.push_back(string(logData->streamBuffer.data(), static_cast<size_t>(logData->streamBuffer.length())));
+        return true;
+    }
+
+    const std::vector<string>& getMessages() { return m_messages; }
+
+    int count(const char* text)
+    {
+        int found = 0;
+        for( size_t i = 0; i < m_messages.size(); i++ )
+        {
+            if( m_messages[i].find(text) != string::npos )
+                found++;
+        }
+        return found;
+    }
+};
+
+void logOthers(BackgroundLogger* blog)
+{
+    for( int i = 0; i < 4; i++ )
+    {
+        LOG_INFO(blog) << "Other " << i;
+    }
+}
+
+int TestBoundedBackgroundLogger()
+{
+    int failed = 0;
+    const int numMessages = 50;
+
+    cout << "Testing bounded BackgroundLogger... " << flush;
+
+    // Drop the newest messages while the sink is stalled.
+    {
+        GateLogger glog;
+        unsigned long dropped;
+        {
+            BackgroundLogger blog(glog, BackgroundLogger::QE_MUTEX, 4);
+            blog.setOverflowPolicy(BackgroundLogger::OP_DROP_NEWEST);
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+
+            // Nothing is ever queued while the queue is full.
+            LogData* extra = LogDataPool::acquire(LL_INFO);
+            if( blog.trySendLogMessage(extra) )
+            {
+                cerr << "trySendLogMessage() queued a message into a full queue" << endl;
+                failed++;
+            }
+            else
+            {
+                LogDataPool::release(extra);
+            }
+
+            dropped = blog.getDroppedCount();
+            glog.open();
+        }
+
+        if( dropped == 0 || glog.count("Message ") + dropped != numMessages )
+        {
+            cerr << "Mismatch detected!  Sent: " << numMessages << ", Received: "
+                 << glog.count("Message ") << ", Dropped: " << dropped << endl;
+            failed++;
+        }
+        if( glog.count(" messages dropped") != 1 )
+        {
+            cerr << "Expected a single \"messages dropped\" record" << endl;
+            failed++;
+        }
+    }
+
+    // Drop the oldest - the last messages sent must all make it.  With a
+    // buffer per thread, only our own messages make room for ours.
+    const BackgroundLogger::QueueEngine engines[] = { BackgroundLogger::QE_RING, BackgroundLogger::QE_PER_THREAD };
+    for( size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++ )
+    {
+        GateLogger glog;
+        unsigned long dropped;
+        {
+            BackgroundLogger blog(&glog, engines[e], 8);
+            blog.setOverflowPolicy(BackgroundLogger::OP_DROP_OLDEST);
+
+            boost::thread other(boost::bind(&logOthers, &blog));
+            other.join();
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+            dropped = blog.getDroppedCount();
+            glog.open();
+        }
+
+        if( glog.count("Message 49") != 1 || glog.count("Message 42") != 1 )
+        {
+            cerr << "Engine " << e << ": newest messages were dropped" << endl;
+            failed++;
+        }
+        if( glog.count("Message ") + glog.count("Other ") + dropped != numMessages + 4 ||
+            (engines[e] == BackgroundLogger::QE_PER_THREAD && glog.count("Other ") != 4) )
+        {
+            cerr << "Engine " << e << ": received " << glog.count("Message ") << " and "
+                 << glog.count("Other ") << " others, dropped " << dropped << endl;
+            failed++;
+        }
+    }
+
+    // Drop informational messages, but keep errors.
+    {
+        GateLogger glog;
+        unsigned long dropped;
+        {
+            BackgroundLogger blog(glog, BackgroundLogger::QE_MUTEX, 4);
+            blog.setOverflowPolicy(BackgroundLogger::OP_DROP_BELOW_LEVEL, LL_ERROR);
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(blog) << "Info " << i;
+            }
+            dropped = blog.getDroppedCount();
+            glog.open();
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_ERROR(blog) << "Error " << i;
+            }
+        }
+
+        if( dropped == 0 || glog.count("Error ") != numMessages )
+        {
+            cerr << "Mismatch detected!  Sent: " << numMessages << ", Received: "
+                 << glog.count("Error ") << ", Dropped: " << dropped << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Counts lines containing "text" in what a StringLogger has logged so far.
+// Waits up to two seconds for there to be "expected" of them.
+int waitForLines(StringLogger& log, const char* text, int expected)
+{
+    int found = 0;
+    for( int tries = 0; tries < 200; tries++ )
+    {
+        string contents = log.getString();
+        found = 0;
+        for( size_t pos = contents.find(text); pos != string::npos; pos = contents.find(text, pos + 1) )
+            found++;
+
+        if( found >= expected )
+            break;
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+    return found;
+}
+
+int TestParallelMultiplex()
+{
+    int failed = 0;
+    const int numMessages = 50;
+
+    cout << "Testing parallel MultiplexLogger... " << flush;
+
+    // A stalled logger mustn't hold up the other one, or us.
+    {
+        GateLogger glog;
+        StringLogger slog;
+        unsigned long dropped;
+        {
+            MultiplexLogger mlog;
+            BackgroundLogger& stalled = mlog.addQueuedLogger(&glog, false, 4);
+            mlog.addQueuedLogger(&slog, false, numMessages);
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(mlog) << "Message " << i;
+            }
+
+            int received = waitForLines(slog, "Message ", numMessages);
+            if( received != numMessages )
+            {
+                cerr << "Fast logger got " << received << " of " << numMessages
+                     << " messages while the other was stalled" << endl;
+                failed++;
+            }
+
+            dropped = stalled.getDroppedCount();
+            glog.open();
+        }
+
+        if( dropped == 0 || glog.count("Message ") + dropped != numMessages )
+        {
+            cerr << "Mismatch detected!  Sent: " << numMessages << ", Received: "
+                 << glog.count("Message ") << ", Dropped: " << dropped << endl;
+            failed++;
+        }
+    }
+
+    // Several loggers keeping the same message each get it, and it's only
+    // freed once.
+    {
+        StringLogger slog1, slog2, slog3;
+        {
+            MultiplexLogger mlog(new BackgroundLogger(slog1), true, new BackgroundLogger(slog2), true);
+            mlog.addLogger(new BackgroundLogger(new FilteringLogger(LL_ERROR, slog3), true), true);
+
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(mlog) << "Shared " << i;
+            }
+            LOG_ERROR(mlog) << "Shared error";
+        }
+
+        if( waitForLines(slog1, "Shared ", numMessages + 1) != numMessages + 1 ||
+            waitForLines(slog2, "Shared ", numMessages + 1) != numMessages + 1 ||
+            waitForLines(slog3, "Shared ", 1) != 1 )
+        {
+            cerr << "Shared message went missing" << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Counts messages that reach it without a terminator already in place,
+// which c_str() would have to write into a shared buffer.
+class TerminationCheckingLogger : public BaseLogger
+{
+private:
+    boost::atomic<int>  m_unterminated;
+
+public:
+    TerminationCheckingLogger()
+        : m_unterminated(0)
+    { }
+
+    virtual bool sendLogMessage(LogData* logData)
+    {
+        if( logData->streamBuffer.data()[logData->streamBuffer.length()] != '\0' )
+            m_unterminated.fetch_add(1);
+        return true;
+    }
+
+    int getUnterminated()
+    {
+        return m_unterminated.load();
+    }
+};
+
+int TestSharedMessages()
+{
+    int failed = 0;
+    const int numMessages = 50;
+
+    cout << "Testing shared messages... " << flush;
+
+    // Both sides of a TeeLogger may keep the message.
+    {
+        StringLogger slog1, slog2;
+        {
+            TeeLogger tlog(new BackgroundLogger(slog1), true, new BackgroundLogger(slog2), true);
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(tlog) << "Tee " << i;
+            }
+        }
+
+        if( waitForLines(slog1, "Tee ", numMessages) != numMessages ||
+            waitForLines(slog2, "Tee ", numMessages) != numMessages )
+        {
+            cerr << "TeeLogger lost a shared message" << endl;
+            failed++;
+        }
+    }
+
+    // A batch fanned out to a logger that keeps it and one that doesn't.
+    {
+        StringLogger slog1, slog2;
+        {
+            MultiplexLogger* mlog = new MultiplexLogger(new BackgroundLogger(slog1), true);
+            mlog->addLogger(slog2);
+
+            BackgroundLogger blog(mlog, true);
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(blog) << "Batch " << i;
+            }
+#ifdef CPPLOG_DEFERRED_FORMAT
+            // Formatted before being shared.
+            LOGF(LL_INFO, blog, "Batch {}", "formatted");
+#endif
+        }
+
+        int expected = numMessages;
+#ifdef CPPLOG_DEFERRED_FORMAT
+        expected++;
+#endif
+        if( waitForLines(slog1, "Batch ", expected) != expected ||
+            waitForLines(slog2, "Batch ", expected) != expected )
+        {
+            cerr << "MultiplexLogger lost a message from a batch" << endl;
+            failed++;
+        }
+    }
+
+    // Messages are terminated before they're shared, long or short,
+    // formatted now or later.
+    {
+        TerminationCheckingLogger check1, check2;
+        {
+            BackgroundLogger blog(new TeeLogger(check1, check2), true);
+            TeeLogger tlog(check1, check2);
+            const std::string longText(3000, 'x');
+            for( int i = 0; i < numMessages; i++ )
+            {
+                LOG_INFO(tlog) << "Short " << i;
+                LOG_INFO(blog) << "Long " << longText << i;
+#ifdef CPPLOG_DEFERRED_FORMAT
+                LOGF(LL_INFO, blog, "Deferred {}", i);
+#endif
+            }
+        }
+
+        if( check1.getUnterminated() != 0 || check2.getUnterminated() != 0 )
+        {
+            cerr << (check1.getUnterminated() + check2.getUnterminated())
+                 << " shared messages weren't null-terminated" << endl;
+            failed++;
+        }
+    }
+
+#ifdef CPPLOG_LOGDATA_POOL
+    // Every message goes back to the pool once all loggers are done.
+    {
+        StringLogger slog1, slog2;
+        TeeLogger tlog(new BackgroundLogger(slog1), true, new BackgroundLogger(slog2), true);
+        for( int i = 0; i < 100; i++ )
+        {
+            LOG_INFO(tlog) << "Warm-up " << i;
+        }
+        waitForLines(slog2, "Warm-up ", 100);
+
+        unsigned long allocations = LogDataPool::allocations();
+        for( int round = 0; round < 10; round++ )
+        {
+            for( int i = 0; i < 10; i++ )
+            {
+                LOG_INFO(tlog) << "Pooled " << i;
+            }
+            waitForLines(slog1, "Pooled ", (round + 1) * 10);
+            waitForLines(slog2, "Pooled ", (round + 1) * 10);
+        }
+
+        if( LogDataPool::allocations() - allocations > 20 )
+        {
+            cerr << "Shared messages weren't returned to the pool ("
+                 << (LogDataPool::allocations() - allocations) << " allocations)" << endl;
+            failed++;
+        }
+    }
+#endif
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Stands in for a Scribe node.  Refuses the first "tryLater" batches it's
+// sent, and fails the first "failOpens" connection attempts.
+class StandInTransport : public BatchTransport
+{
+private:
+    boost::mutex                m_mutex;
+    std::deque<Batch>           m_unanswered;
+    std::vector<Batch>          m_delivered;
+    int                         m_tryLater;
+    int                         m_failOpens;
+    int                         m_sends;
+    size_t                      m_mostInFlight;
+    unsigned long               m_replyMillis;
+    bool                        m_down;
+    bool                        m_held;
+    boost::condition_variable   m_released;
+
+public:
+    StandInTransport(int tryLater = 0, int failOpens = 0, unsigned long replyMillis = 0)
+        : m_tryLater(tryLater), m_failOpens(failOpens), m_sends(0), m_mostInFlight(0),
+          m_replyMillis(replyMillis), m_down(false), m_held(false)
+    { }
+
+    // While held, open() waits, as if connecting took a long time.
+    void setHeld(bool held)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_held = held;
+        m_released.notify_all();
+    }
+
+    // While down, every open() fails, and nothing sent is answered.
+    void setDown(bool down)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_down = down;
+    }
+
+    virtual bool open()
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        while( m_held )
+            m_released.wait(lock);
+        return !m_down && m_failOpens-- <= 0;
+    }
+
+    virtual void close()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_unanswered.clear();
+    }
+
+    virtual bool send(const Batch& batch)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_unanswered.push_back(batch);
+        m_mostInFlight = std::max(m_mostInFlight, m_unanswered.size());
+        m_sends++;
+        return true;
+    }
+
+    virtual Result receive()
+    {
+        if( m_replyMillis )
+            boost::this_thread::sleep(boost::posix_time::milliseconds(m_replyMillis));
+
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        if( m_down || m_unanswered.empty() )
+            return BT_FAILED;
+
+        Batch batch = m_unanswered.front();
+        m_unanswered.pop_front();
+        if( m_tryLater != 0 )
+        {
+            if( m_tryLater > 0 )
+                m_tryLater--;
+            return BT_TRY_LATER;
+        }
+
+        m_delivered.push_back(batch);
+        return BT_OK;
+    }
+
+    // Messages delivered so far, in order.  Waits up to two seconds for
+    // there to be "expected" of them.
+    std::vector<string> delivered(size_t expected = 0)
+    {
+        std::vector<string> messages;
+        for( int tries = 0; tries < 200; tries++ )
+        {
+            messages.clear();
+            {
+                boost::lock_guard<boost::mutex> lock(m_mutex);
+                for( size_t i = 0; i < m_delivered.size(); i++ )
+                    messages.insert(messages.end(), m_delivered[i].messages.begin(), m_delivered[i].messages.end());
+            }
+
+            if( messages.size() >= expected )
+                break;
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+        }
+        return messages;
+    }
+
+    std::vector<size_t> batchSizes()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        std::vector<size_t> sizes;
+        for( size_t i = 0; i < m_delivered.size(); i++ )
+            sizes.push_back(m_delivered[i].messages.size());
+        return sizes;
+    }
+
+    int sends()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return m_sends;
+    }
+
+    size_t mostInFlight()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        return m_mostInFlight;
+    }
+};
+
+// Whether "messages" are "Message 0" to "Message <count - 1>", in order
+// (or, failing "ordered", in any order).
+bool inOrder(std::vector<string> messages, int count, bool ordered = true)
+{
+    if( messages.size() != static_cast<size_t>(count) )
+        return false;
+
+    std::vector<string> expected;
+    for( int i = 0; i < count; i++ )
+    {
+        std::ostringstream line;
+        line << "Message " << i << "\n";
+        expected.push_back(line.str());
+    }
+
+    for( int i = 0; i < count; i++ )
+    {
+        size_t header = messages[i].find("Message ");
+        if( header == string::npos )
+            return false;
+        messages[i].erase(0, header);
+    }
+
+    if( !ordered )
+    {
+        std::sort(expected.begin(), expected.end());
+        std::sort(messages.begin(), messages.end());
+    }
+    return messages == expected;
+}
+
+int TestBatchingLogger()
+{
+    int failed = 0;
+
+    cout << "Testing BatchingLogger... " << flush;
+
+    // Batches by count, with the last one sent on the way out.
+    {
+        StandInTransport transport;
+        {
+            BatchingLogger blog(&transport, false, "test", BatchPolicy(10, 1024 * 1024, 60000));
+            for( int i = 0; i < 35; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+
+            if( transport.delivered(30).size() != 30 )
+            {
+                cerr << "Full batches weren't sent" << endl;
+                failed++;
+            }
+        }
+
+        std::vector<size_t> sizes = transport.batchSizes();
+        if( !inOrder(transport.delivered(), 35) || sizes.size() != 4 || sizes[0] != 10 || sizes[3] != 5 )
+        {
+            cerr << "Expected batches of 10, 10, 10 and 5 messages, in order" << endl;
+            failed++;
+        }
+    }
+
+    // By bytes, and by time.
+    {
+        StandInTransport transport;
+        BatchingLogger blog(&transport, false, "test", BatchPolicy(1000, 100, 50));
+        for( int i = 0; i < 5; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i << " " << string(20, 'x');
+        }
+
+        // The last message sits alone until its batch is old enough.
+        if( transport.delivered(5).size() != 5 || transport.batchSizes().size() != 3 )
+        {
+            cerr << "Expected batches of 2, 2 and 1 messages, got " << transport.batchSizes().size()
+                 << " batches" << endl;
+            failed++;
+        }
+    }
+
+    // Several batches in flight at once.
+    {
+        StandInTransport transport(0, 0, 20);
+        {
+            BatchPolicy policy(5, 1024 * 1024, 60000);
+            policy.inFlight = 4;
+            BatchingLogger blog(&transport, false, "test", policy);
+            for( int i = 0; i < 40; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+        }
+
+        if( !inOrder(transport.delivered(), 40) || transport.mostInFlight() < 2 ||
+            transport.mostInFlight() > 4 )
+        {
+            cerr << "Pipelining went wrong: at most " << transport.mostInFlight() << " batches in flight" << endl;
+            failed++;
+        }
+    }
+
+    // Refused batches and failed connections are retried.  Batches sent
+    // behind a refused one may get there first.
+    {
+        StandInTransport transport(3, 2);
+        {
+            BatchPolicy policy(5, 1024 * 1024, 60000);
+            policy.retryMinMillis = 5;
+            BatchingLogger blog(&transport, false, "test", policy);
+            for( int i = 0; i < 20; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+            blog.Stop();
+
+            if( !inOrder(transport.delivered(), 20, false) || blog.getSentCount() != 4 || blog.getDroppedCount() != 0 )
+            {
+                cerr << "Retried batches went missing (" << transport.delivered().size()
+                     << " delivered, " << blog.getSentCount() << " batches sent, " << blog.getDroppedCount()
+                     << " dropped)" << endl;
+                failed++;
+            }
+        }
+
+        if( transport.sends() < 7 )
+        {
+            cerr << "Refused batches weren't sent again" << endl;
+            failed++;
+        }
+    }
+
+    // A node that never takes anything can only hold up shutdown so long.
+    {
+        StandInTransport transport(-1);
+        unsigned long dropped;
+        {
+            BatchPolicy policy(5, 1024 * 1024, 60000);
+            policy.retryMinMillis = 5;
+            policy.shutdownMillis = 100;
+            BatchingLogger blog(&transport, false, "test", policy);
+            for( int i = 0; i < 12; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+            blog.Stop();
+            dropped = blog.getDroppedCount();
+        }
+
+        if( dropped != 12 || !transport.delivered().empty() )
+        {
+            cerr << "Expected all 12 messages dropped, got " << dropped << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// A pool of one-connection endpoints named "a", "b", ..., for "transports".
+PooledTransport* makePool(std::vector<StandInTransport*>& transports, size_t count, const PoolPolicy& policy)
+{
+    PooledTransport* pool = new PooledTransport(policy);
+    for( size_t i = 0; i < count; i++ )
+    {
+        transports.push_back(new StandInTransport());
+        pool->addEndpoint(string(1, static_cast<char>('a' + i)), std::vector<BatchTransport*>(1, transports[i]));
+    }
+    return pool;
+}
+
+int TestPooledTransport()
+{
+    int failed = 0;
+
+    cout << "Testing PooledTransport... " << flush;
+
+    BatchPolicy policy(5, 1024 * 1024, 60000);
+    policy.retryMinMillis = 5;
+
+    // Batches are spread over every endpoint.
+    {
+        std::vector<StandInTransport*> transports;
+        PooledTransport* pool = makePool(transports, 3, PoolPolicy());
+        BatchingLogger blog(pool, true, "test", policy);
+        for( int i = 0; i < 60; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+        blog.Stop();
+
+        std::vector<string> all;
+        for( size_t i = 0; i < transports.size(); i++ )
+        {
+            std::vector<string> delivered = transports[i]->delivered();
+            if( delivered.empty() )
+            {
+                cerr << "Endpoint " << i << " got no batches" << endl;
+                failed++;
+            }
+            all.insert(all.end(), delivered.begin(), delivered.end());
+        }
+
+        if( !inOrder(all, 60, false) )
+        {
+            cerr << "Expected all 60 messages delivered, got " << all.size() << endl;
+            failed++;
+        }
+    }
+
+    // A failed endpoint is ejected, and brought back once it recovers.
+    {
+        PoolPolicy poolPolicy;
+        poolPolicy.probeMinMillis = poolPolicy.probeMaxMillis = 20;
+
+        std::vector<StandInTransport*> transports;
+        PooledTransport* pool = makePool(transports, 2, poolPolicy);
+        transports[1]->setDown(true);
+
+        BatchingLogger blog(pool, true, "test", policy);
+        for( int i = 0; i < 30; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+
+        if( !inOrder(transports[0]->delivered(30), 30) || !transports[1]->delivered().empty() )
+        {
+            cerr << "Batches weren't all sent to the healthy endpoint" << endl;
+            failed++;
+        }
+
+        transports[1]->setDown(false);
+        boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        for( int i = 0; i < 30; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+        blog.Stop();
+
+        if( transports[1]->delivered().empty() || pool->healthyEndpoints() != 2 ||
+            transports[0]->delivered().size() + transports[1]->delivered().size() != 60 )
+        {
+            cerr << "The recovered endpoint wasn't brought back (" << pool->healthyEndpoints()
+                 << " healthy)" << endl;
+            failed++;
+        }
+    }
+
+    // An ejected endpoint is only ever sent one probe at a time.
+    {
+        PoolPolicy poolPolicy;
+        poolPolicy.probeMinMillis = poolPolicy.probeMaxMillis = 20;
+        BatchPolicy quick = policy;
+        quick.shutdownMillis = 100;
+
+        StandInTransport* refusing = new StandInTransport(-1);
+        refusing->setDown(true);
+
+        PooledTransport* pool = new PooledTransport(poolPolicy);
+        pool->addEndpoint("refusing", std::vector<BatchTransport*>(1, refusing));
+
+        BatchingLogger blog(pool, true, "test", quick);
+        for( int i = 0; i < 30; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        refusing->setDown(false);
+        boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+
+        if( refusing->sends() == 0 || refusing->mostInFlight() != 1 )
+        {
+            cerr << "Expected one probe at a time, got " << refusing->mostInFlight()
+                 << " batches in flight" << endl;
+            failed++;
+        }
+    }
+
+    // By category, everything goes to one endpoint - the same one for the
+    // same names - and to just one other once that one fails.
+    {
+        int first = -1;
+        for( int run = 0; run < 3; run++ )
+        {
+            std::vector<StandInTransport*> transports;
+            PooledTransport* pool = makePool(transports, 4, PoolPolicy(true));
+            if( run == 2 )
+                transports[first]->setDown(true);
+
+            BatchingLogger blog(pool, true, "category", policy);
+            for( int i = 0; i < 20; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+            blog.Stop();
+
+            int used = -1, count = 0;
+            for( size_t i = 0; i < transports.size(); i++ )
+            {
+                if( !transports[i]->delivered().empty() )
+                {
+                    used = static_cast<int>(i);
+                    count++;
+                }
+            }
+
+            if( count != 1 || !inOrder(transports[used]->delivered(), 20) ||
+                (run == 1 && used != first) || (run == 2 && used == first) )
+            {
+                cerr << "Run " << run << ": expected one endpoint used, got " << count << endl;
+                failed++;
+                break;
+            }
+            if( run == 0 )
+                first = used;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+// Size of the file at "path", waiting up to two seconds for it to be
+// "expected" bytes.
+std::streamoff fileSize(const char* path)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    in.seekg(0, std::ios::end);
+    return in ? static_cast<std::streamoff>(in.tellg()) : -1;
+}
+
+std::streamoff waitForSize(const char* path, std::streamoff expected)
+{
+    std::streamoff size = -1;
+    for( int tries = 0; tries < 200 && size != expected; tries++ )
+    {
+        if( tries > 0 )
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+        size = fileSize(path);
+    }
+    return size;
+}
+
+// Leaves "Message 0" to "Message <count - 1>" in the spool at "path".
+void spoolMessages(const char* path, int count, const BatchPolicy& policy)
+{
+    StandInTransport down;
+    down.setDown(true);
+
+    BatchingLogger blog(&down, false, "test", policy);
+    blog.setSpool(path, 1024 * 1024);
+    for( int i = 0; i < count; i++ )
+    {
+        LOG_INFO(blog) << "Message " << i;
+    }
+    blog.Stop();
+}
+
+int TestBatchSpooling()
+{
+    int failed = 0;
+    const char* path = "spool_test.dat";
+
+    cout << "Testing batch spooling... " << flush;
+
+    BatchPolicy policy(5, 1024 * 1024, 60000);
+    policy.retryMinMillis = 5;
+    policy.retryMaxMillis = 20;
+    policy.shutdownMillis = 100;
+
+    // Batches are spooled during an outage, then replayed in order (and in
+    // fewer, bigger batches) afterwards, emptying the spool.
+    {
+        StandInTransport transport;
+        transport.setDown(true);
+
+        BatchingLogger blog(&transport, false, "test", policy);
+        if( !blog.setSpool(path, 1024 * 1024) )
+        {
+            cerr << "Couldn't open the spool" << endl;
+            failed++;
+        }
+
+        for( int i = 0; i < 30; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        if( !transport.delivered().empty() || waitForSize(path, 0) <= 0 )
+        {
+            cerr << "Nothing was spooled during the outage" << endl;
+            failed++;
+        }
+
+        transport.setDown(false);
+        if( !inOrder(transport.delivered(30), 30) || transport.batchSizes().size() != 1 )
+        {
+            cerr << "Spooled messages weren't replayed in order, in one batch (got "
+                 << transport.delivered().size() << " messages in " << transport.batchSizes().size()
+                 << " batches)" << endl;
+            failed++;
+        }
+
+        if( waitForSize(path, 0) != 0 || blog.getDroppedCount() != 0 )
+        {
+            cerr << "The spool wasn't emptied after replaying it" << endl;
+            failed++;
+        }
+    }
+
+    // Logging threads never write the spool themselves: while the sender
+    // is stuck connecting, new batches wait for it rather than going to
+    // disk, and are still replayed in order.
+    {
+        StandInTransport transport;
+        transport.setDown(true);
+
+        BatchingLogger blog(&transport, false, "test", policy);
+        blog.setSpool(path, 1024 * 1024);
+
+        for( int i = 0; i < 5; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+        for( int tries = 0; tries < 200 && fileSize(path) <= 0; tries++ )
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+        transport.setHeld(true);
+        boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        std::streamoff spooled = fileSize(path);
+
+        for( int i = 5; i < 15; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        if( spooled <= 0 || fileSize(path) != spooled )
+        {
+            cerr << "A logging thread wrote to the spool" << endl;
+            failed++;
+        }
+
+        transport.setDown(false);
+        transport.setHeld(false);
+        if( !inOrder(transport.delivered(15), 15) || blog.getDroppedCount() != 0 )
+        {
+            cerr << "Batches held for the spool weren't replayed in order (got "
+                 << transport.delivered().size() << " messages)" << endl;
+            failed++;
+        }
+    }
+    waitForSize(path, 0);
+
+    // What's left at shutdown stays in the spool, for the next logger.
+    {
+        StandInTransport down;
+        down.setDown(true);
+        {
+            BatchingLogger blog(&down, false, "test", policy);
+            blog.setSpool(path, 1024 * 1024);
+            for( int i = 0; i < 12; i++ )
+            {
+                LOG_INFO(blog) << "Message " << i;
+            }
+            blog.Stop();
+
+            if( blog.getDroppedCount() != 0 )
+            {
+                cerr << "Messages were dropped, not spooled, at shutdown" << endl;
+                failed++;
+            }
+        }
+
+        StandInTransport up;
+        BatchingLogger blog(&up, false, "test", policy);
+        blog.setSpool(path, 1024 * 1024);
+        if( !inOrder(up.delivered(12), 12) )
+        {
+            cerr << "The next logger didn't replay the spool (got " << up.delivered().size()
+                 << " messages)" << endl;
+            failed++;
+        }
+    }
+
+    // Spooled batches are replayed one at a time, so one that's refused is
+    // sent again before the next is sent at all.
+    {
+        spoolMessages(path, 30, policy);
+
+        StandInTransport refusing(2);
+        {
+            BatchingLogger blog(&refusing, false, "test", policy);
+            blog.setSpool(path, 1024 * 1024, 1);
+            refusing.delivered(30);
+        }
+
+        if( !inOrder(refusing.delivered(), 30) || refusing.mostInFlight() != 1 )
+        {
+            cerr << "Refused batches weren't replayed in order (got " << refusing.delivered().size()
+                 << " messages, " << refusing.mostInFlight() << " batches in flight)" << endl;
+            failed++;
+        }
+    }
+
+    // The next logger to open the spool starts after the last batch that
+    // got through.
+    {
+        spoolMessages(path, 30, policy);
+
+        StandInTransport partly(0, 0, 20);
+        {
+            BatchingLogger blog(&partly, false, "test", policy);
+            blog.setSpool(path, 1024 * 1024, 1);
+            partly.delivered(10);
+            partly.setDown(true);
+        }
+
+        std::vector<string> all = partly.delivered();
+        StandInTransport rest;
+        {
+            BatchingLogger blog(&rest, false, "test", policy);
+            blog.setSpool(path, 1024 * 1024);
+            rest.delivered(30 - all.size());
+        }
+
+        std::vector<string> more = rest.delivered();
+        all.insert(all.end(), more.begin(), more.end());
+        if( !inOrder(all, 30) || more.empty() )
+        {
+            cerr << "The spool wasn't picked up where it was left (got " << all.size()
+                 << " messages, " << more.size() << " from the next logger)" << endl;
+            failed++;
+        }
+    }
+
+    // Once the spool is full, the newest batches are dropped.
+    {
+        StandInTransport transport;
+        transport.setDown(true);
+
+        BatchingLogger blog(&transport, false, "test", policy);
+        blog.setSpool(path, 600);
+        for( int i = 0; i < 30; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        unsigned long dropped = blog.getDroppedCount();
+        transport.setDown(false);
+
+        int kept = 30 - static_cast<int>(dropped);
+        if( dropped == 0 || !inOrder(transport.delivered(kept), kept) )
+        {
+            cerr << "Expected the oldest messages kept and the rest dropped (" << dropped << " dropped, "
+                 << transport.delivered().size() << " delivered)" << endl;
+            failed++;
+        }
+    }
+
+    std::remove(path);
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+#ifdef CPPLOG_METRICS
+// A stream buffer that fails every write.
+class FailingBuf : public std::streambuf
+{
+protected:
+    virtual int_type overflow(int_type)                     { return traits_type::eof(); }
+    virtual std::streamsize xsputn(const char*, std::streamsize) { return 0; }
+};
+
+int TestLoggerMetrics()
+{
+    int failed = 0;
+    LoggerMetrics metrics;
+
+    cout << "Testing logger metrics... " << flush;
+
+    // Accepted and filtered messages.
+    {
+        StringLogger slog;
+        FilteringLogger flog(LL_WARN, &slog);
+
+        for( int i = 0; i < 3; i++ )
+        {
+            LOG_INFO(flog) << "Filtered " << i;
+        }
+        for( int i = 0; i < 2; i++ )
+        {
+            LOG_WARN(flog) << "Kept " << i;
+        }
+
+        flog.getMetrics(metrics);
+        if( metrics.messagesFiltered != 3 || metrics.messagesAccepted != 2 || metrics.hasQueue )
+        {
+            cerr << "FilteringLogger counted " << metrics.messagesAccepted << " accepted, "
+                 << metrics.messagesFiltered << " filtered" << endl;
+            failed++;
+        }
+
+        slog.getMetrics(metrics);
+        if( metrics.messagesAccepted != 2 || metrics.bytesAccepted != slog.getString().length() )
+        {
+            cerr << "StringLogger counted " << metrics.messagesAccepted << " messages, "
+                 << metrics.bytesAccepted << " bytes" << endl;
+            failed++;
+        }
+    }
+
+    // Write errors, after which the logger keeps trying.
+    {
+        FailingBuf buf;
+        std::ostream stream(&buf);
+        OstreamLogger olog(stream);
+
+        LOG_INFO(olog) << "Lost";
+        LOG_INFO(olog) << "Lost too";
+
+        olog.getMetrics(metrics);
+        if( metrics.writeErrors != 2 || !stream.good() )
+        {
+            cerr << "Expected 2 write errors, got " << metrics.writeErrors << endl;
+            failed++;
+        }
+    }
+
+    // Queue depth, drops and write latencies.
+    {
+        GateLogger glog;
+        BackgroundLogger blog(glog, BackgroundLogger::QE_MUTEX, 4);
+        blog.setOverflowPolicy(BackgroundLogger::OP_DROP_NEWEST);
+
+        for( int i = 0; i < 20; i++ )
+        {
+            LOG_INFO(blog) << "Message " << i;
+        }
+
+        blog.getMetrics(metrics);
+        if( !metrics.hasQueue || metrics.messagesAccepted != 20 || metrics.messagesDropped == 0 ||
+            metrics.queueDepth + metrics.messagesDropped != 20 )
+        {
+            cerr << "Stalled queue: " << metrics.messagesAccepted << " accepted, "
+                 << metrics.messagesDropped << " dropped, " << metrics.queueDepth << " queued" << endl;
+            failed++;
+        }
+
+        glog.open();
+        blog.Stop();
+
+        blog.getMetrics(metrics);
+        uint64_t bucketed = 0;
+        for( size_t i = 0; i < LoggerMetrics::k_latencyBuckets; i++ )
+            bucketed += metrics.writeLatency[i];
+
+        if( metrics.queueDepth != 0 || metrics.peakQueueDepth == 0 || metrics.writes == 0 ||
+            bucketed != metrics.writes )
+        {
+            cerr << "Drained queue: " << metrics.queueDepth << " queued, peak of "
+                 << metrics.peakQueueDepth << ", " << metrics.writes << " writes" << endl;
+            failed++;
+        }
+
+        // And the same, for Prometheus.
+        MetricsDumper dumper("metrics_test.prom");
+        dumper.add("queue", blog);
+        dumper.add("sink \"gated\"", glog);
+        if( !dumper.dump() )
+        {
+            cerr << "Couldn't write metrics_test.prom" << endl;
+            failed++;
+        }
+
+        std::ifstream in("metrics_test.prom");
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        in.close();
+        std::remove("metrics_test.prom");
+
+        std::ostringstream expected;
+        expected << "cpplog_messages_dropped_total{logger=\"queue\"} " << metrics.messagesDropped << "\n";
+        const string expectedLines[] = {
+            expected.str(),
+            "# TYPE cpplog_write_seconds histogram\n",
+            "cpplog_messages_accepted_total{logger=\"sink \\\"gated\\\"\"} ",
+            "cpplog_write_seconds_bucket{logger=\"queue\",le=\"1e-06\"} ",
+            "cpplog_write_seconds_bucket{logger=\"queue\",le=\"+Inf\"} ",
+            "cpplog_write_seconds_count{logger=\"queue\"} ",
+        };
+        for( size_t i = 0; i < sizeof(expectedLines) / sizeof(expectedLines[0]); i++ )
+        {
+            if( contents.str().find(expectedLines[i]) == string::npos )
+            {
+                cerr << "Missing \"" << expectedLines[i] << "\" in:\n" << contents.str() << endl;
+                failed++;
+            }
+        }
+        if( contents.str().find("cpplog_queue_depth{logger=\"sink") != string::npos )
+        {
+            cerr << "Queue depth reported for a logger without a queue" << endl;
+            failed++;
+        }
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+#endif
+#endif
+
+#if defined(CPPLOG_LOGDATA_POOL) && defined(CPPLOG_THREADING)
+// Sends two bursts of "burst" messages to "blog", waiting at "roundDone"
+// after each until the main thread has seen them delivered.
+void sendPoolBursts(BackgroundLogger* blog, int burst, boost::barrier* roundDone)
+{
+    std::vector<LogData*> messages(burst);
+    for( int round = 0; round < 2; round++ )
+    {
+        for( int i = 0; i < burst; i++ )
+            messages[i] = LogDataPool::acquire(LL_INFO);
+        for( int i = 0; i < burst; i++ )
+            blog->sendLogMessage(messages[i]);
+
+        roundDone->wait();
+        roundDone->wait();
+    }
+}
+
+int TestLogDataPool()
+{
+    int failed = 0;
+    StringLogger log;
+
+    cout << "Testing LogData pool... ";
+
+    // Warm the pool up.
+    for( int i = 0; i < 100; i++ )
+    {
+        LOG_INFO(log) << "Warm-up " << i;
+    }
+    log.clear();
+
+    // Steady-state logging should only ever reuse objects.
+    unsigned long allocations = LogDataPool::allocations();
+    for( int i = 0; i < 1000; i++ )
+    {
+        LOG_INFO(log) << "Steady state " << i;
+    }
+    log.clear();
+
+    if( LogDataPool::allocations() != allocations )
+    {
+        cerr << "Pool allocated " << (LogDataPool::allocations() - allocations)
+             << " objects in steady state" << endl;
+        failed++;
+    }
+
+    // A BackgroundLogger's thread hands back everything it was queued at
+    // once; the pool should keep all of it for the next burst.
+    const BackgroundLogger::QueueEngine engines[] = { BackgroundLogger::QE_MUTEX, BackgroundLogger::QE_RING };
+    for( size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++ )
+    {
+        const int burst = 4000;
+        CountingLogger counted;
+        BackgroundLogger blog(&counted, engines[e]);
+
+        std::vector<LogData*> messages(burst);
+        for( int round = 0; round < 2; round++ )
+        {
+            allocations = LogDataPool::allocations();
+            for( int i = 0; i < burst; i++ )
+                messages[i] = LogDataPool::acquire(LL_INFO);
+            for( int i = 0; i < burst; i++ )
+                blog.sendLogMessage(messages[i]);
+
+            while( counted.getCount() < (round + 1) * burst )
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+
+            // Let the last batch make it back to the pool.
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+        }
+
+        if( LogDataPool::allocations() - allocations > CPPLOG_POOL_THREAD_CACHE )
+        {
+            cerr << "Engine " << e << ": pool allocated " << (LogDataPool::allocations() - allocations)
+                 << " objects for a second burst of " << burst << endl;
+            failed++;
+        }
+    }
+
+    // With per-thread queues, the pool keeps enough for every thread's
+    // buffer.
+    {
+        const int numThreads = 4, burst = 800;
+        CountingLogger counted;
+        BackgroundLogger blog(&counted, BackgroundLogger::QE_PER_THREAD);
+
+        boost::barrier roundDone(numThreads + 1);
+        boost::thread_group producers;
+        for( int i = 0; i < numThreads; i++ )
+            producers.create_thread(boost::bind(&sendPoolBursts, &blog, burst, &roundDone));
+
+        for( int round = 0; round < 2; round++ )
+        {
+            roundDone.wait();
+            while( counted.getCount() < (round + 1) * numThreads * burst )
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+            boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+
+            if( round == 0 )
+                allocations = LogDataPool::allocations();
+            roundDone.wait();
+        }
+        producers.join_all();
+
+        if( LogDataPool::allocations() - allocations > (numThreads + 1) * CPPLOG_POOL_THREAD_CACHE )
+        {
+            cerr << "Pool allocated " << (LogDataPool::allocations() - allocations)
+                 << " objects for a second burst of " << numThreads << " x " << burst
+                 << " through per-thread queues" << endl;
+            failed++;
+        }
+    }
+
+    // Formatting state must not leak into the next message.
+    LOG_INFO(log) << hex << setw(6) << setfill('*') << showbase << 255;
+    log.clear();
+    LOG_INFO(log) << 255 << " " << 1.5; int line = __LINE__;
+
+    string expectedValue;
+    getLogHeader(expectedValue, LL_INFO, __FILE__, line);
+    expectedValue += "255 1.5\n";
+    if( expectedValue != log.getString() )
+    {
+        cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)
+             << "(" << line << "): \"" << log.getString() << "\" != \""
+             << expectedValue << "\"" << endl;
+        failed++;
+    }
+
+    cout << "done!" << endl;
+    return failed;
+}
+#endif
+
+void SizeNameFunc(unsigned long logNumber, std::string& newFileName, void* /* context */)
+{
+    std::ostringstream fileName;
+
+    fileName << "SizeRotateFileLogger_test_" << logNumber << ".log";
+
+    newFileName = fileName.str();
+}
+
+void TimeNameFunc(::tm* time, unsigned long /* logNumber */,
+                  std::string& newFileName, void* /* context */)
+{
+    std::ostringstream fileName;
+
+    fileName << "TimeRotateFileLogger_test_";
+
+    fileName << setfill('0');
+
+    fileName << setw(4) << (time->tm_year + 1900) << "-"
+             << setw(2) << time->tm_mon           << "-"
+             << setw(2) << time->tm_mday
+             << "_"
+             << setw(2) << time->tm_hour << "-"
+             << setw(2) << time->tm_min  << "-"
+             << setw(2) << time->tm_sec
+             << ".log";
+
+    newFileName = fileName.str();
+}
+
+int TestRotatingLoggers()
+{
+    int failed = 0;
+
+    cout << "Testing auto-rotating loggers... ";
+
+    // We rotate at 100 bytes.
+    cpplog::SizeRotateFileLogger srlog(SizeNameFunc, 200);
+
+    // Log two messages...
+    LOG_INFO(srlog) << "Size rotated 1";
+    LOG_INFO(srlog) << "Size rotated 2";
+
+    // ... and force a rotation.
+    LOG_INFO(srlog) << "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";        // 200 * 'a'
+
+    // Log to the new file.
+    LOG_INFO(srlog) << "After size rotation 1";
+    LOG_INFO(srlog) << "After size rotation 2";
+
+    // Rotate every 10 seconds.
+    cpplog::TimeRotateFileLogger trlog(TimeNameFunc, 10);
+
+    // Log two messages...
+    LOG_INFO(trlog) << "Time rotated 1";
+    LOG_INFO(trlog) << "Time rotated 2";
+
+    // ... and wait for 11 seconds (to eliminate the rare edge case).
+    cout << "(waiting) " << flush;
+    time_t startTime = time(NULL);
+    while( difftime(time(NULL), startTime) < 11.0 )
+    {
+        ;
+    }
+
+    // Log another two now.
+    LOG_WARN(trlog) << "After rotation 1";
+    LOG_WARN(trlog) << "After rotation 2";
+
+    // TODO: Verify that files exist with correct data.
+    cout << "done!" << endl;
+    return failed;
+}
+
+int TestOtherLogging()
+{
+    int failed = 0;
+    StringLogger log;
+#ifdef _DEBUG
+    bool debug = true;
+#else
+    bool debug = false;
+#endif
+
+    cout << "Testing other logging macros... ";
+
+#define TEST_EXPECTED(logged)                                                                           \
+            if( logged )                                                                                \
+            {                                                                                           \
+                if( log.getString().find("Assertion failed: ") == string::npos )                        \
+                {                                                                                       \
+                    cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)      \
+                         << "(" << __LINE__ << ")" << endl;                                             \
+                    failed++;                                                                           \
+                }                                                                                       \
+            } else                                                                                      \
+            {                                                                                           \
+                if( log.getString().length() > 0 )                                                      \
+                {                                                                                       \
+                    cerr << "Mismatch detected at " << cpplog::helpers::fileNameFromPath(__FILE__)      \
+                         << "(" << __LINE__ << ")" << endl;                                             \
+                    failed++;                                                                           \
+                }                                                                                       \
+            }                                                                                           \
+            log.clear();
+
+    LOG_ASSERT(log, 1 == 1);    TEST_EXPECTED(false);
+    LOG_ASSERT(log, 1 == 2);    TEST_EXPECTED(true);
+
+    DLOG_ASSERT(log, 1 == 1);   TEST_EXPECTED(false);
+    DLOG_ASSERT(log, 1 == 2);   TEST_EXPECTED(true && debug);
+
+    // Windows-only tests.
+#ifdef _WIN32
+    OutputDebugStringLogger dlog;
+
+    LOG_INFO(dlog) << "Test log to debug output" << endl;
+#endif
+
+    cout << "done!" << endl;
+    return failed;
+}
+
+int TestLogging()
+{
+    int totalFailures = 0;
+
+    totalFailures += TestLogLevels();
+    totalFailures += TestDebugLogLevels();
+    totalFailures += TestConditionMacros();
+#ifdef CPPLOG_HELPER_MACROS
+    totalFailures += TestCheckMacros();
+#endif
+    totalFailures += TestTeeLogger();
+    totalFailures += TestRuntimeFiltering();
+    totalFailures += TestTimestamps();
+    totalFailures += TestMessageSizes();
+#ifdef CPPLOG_SYSTEM_IDS
+    totalFailures += TestSystemIds();
+#endif
+#ifdef CPPLOG_DEFERRED_FORMAT
+    totalFailures += TestFormattedLogging();
+#endif
+    totalFailures += TestBinaryFileLogger();
+#ifndef _WIN32
+    totalFailures += TestMmapFileLogger();
+    totalFailures += TestSizeRotation();
+    totalFailures += TestTimeRotation();
+#endif
+    totalFailures += TestFlushPolicy();
+    totalFailures += TestRotatingLoggers();
+    totalFailures += TestOtherLogging();
+
+#ifdef CPPLOG_THREADING
+    totalFailures += TestBackgroundLogger();
+    totalFailures += TestBackgroundLoggerConcurrency();
+    totalFailures += TestBackgroundLoggerRing();
+    totalFailures += TestBackgroundLoggerPerThread();
+    totalFailures += TestBatchDelivery();
+    totalFailures += TestBoundedBackgroundLogger();
+    totalFailures += TestParallelMultiplex();
+    totalFailures += TestSharedMessages();
+    totalFailures += TestBatchingLogger();
+    totalFailures += TestBatchSpooling();
+    totalFailures += TestPooledTransport();
+#ifdef CPPLOG_METRICS
+    totalFailures += TestLoggerMetrics();
+#endif
+#ifndef _WIN32
+    totalFailures += TestAsyncFileLogger();
+    totalFailures += TestLogArchiver();
+#endif
+#endif
+
+#if defined(CPPLOG_LOGDATA_POOL) && defined(CPPLOG_THREADING)
+    totalFailures += TestLogDataPool();
 #endif
 
     return totalFailures;
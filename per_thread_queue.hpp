@@ -0,0 +1,368 @@
+#pragma once
+#ifndef _PER_THREAD_QUEUE_H
+#define _PER_THREAD_QUEUE_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+// Queue made of one bounded single-producer/single-consumer buffer per
+// producing thread.  A thread's buffer is created the first time it pushes,
+// after which a push only writes to that buffer, unless it has to wake a
+// sleeping consumer.  Consumers merge the buffers, popping whichever
+// waiting item comes first according to "Before" (a strict weak ordering
+// on Data).  Items are only ordered against what other threads have
+// already pushed; within a thread, they're always popped in the order they
+// were pushed.
+//
+// When a thread exits, its buffer is reclaimed once it has been drained.
+// Pops are serialized by a mutex, so there may be several consumers, but
+// there is usually only one.
+template<typename Data, typename Before>
+class per_thread_queue
+{
+public:
+    // Told the capacity of each buffer as it's added, and its negation as
+    // it's reclaimed - say, to size a pool of whatever fills them.
+    typedef void (*capacity_callback)(std::ptrdiff_t change);
+
+private:
+    static const size_t cache_line_size = 64;
+    static const int    spin_count      = 64;
+
+    struct buffer
+    {
+        // Written by the producer.
+        boost::atomic<size_t>   tail;
+        char                    pad0[cache_line_size - sizeof(boost::atomic<size_t>)];
+
+        // Written by the consumer.
+        boost::atomic<size_t>   head;
+        char                    pad1[cache_line_size - sizeof(boost::atomic<size_t>)];
+
+        // Both the producing thread and the queue hold a reference.
+        boost::atomic<int>      references;
+        boost::atomic<bool>     orphaned;       // The thread has exited.
+        boost::atomic<bool>     closed;         // The queue is gone.
+        size_t                  queue_id;
+        size_t                  mask;
+        Data*                   items;
+
+        buffer(size_t id, size_t capacity)
+            : tail(0), head(0), references(2), orphaned(false), closed(false),
+              queue_id(id), mask(capacity - 1), items(new Data[capacity])
+        { }
+
+        ~buffer()
+        {
+            delete[] items;
+        }
+
+        void release()
+        {
+            if( references.fetch_sub(1, boost::memory_order_acq_rel) == 1 )
+                delete this;
+        }
+    };
+
+    // A thread's buffers, one for each queue it has pushed to.  This is
+    // shared by all queues (rather than keyed by a queue's address, which
+    // may be reused), and released when the thread exits.
+    struct thread_buffers
+    {
+        std::vector<buffer*>    buffers;
+
+        ~thread_buffers()
+        {
+            for( size_t i = 0; i < buffers.size(); i++ )
+            {
+                buffers[i]->orphaned.store(true, boost::memory_order_release);
+                buffers[i]->release();
+            }
+        }
+    };
+
+    size_t                          the_id;
+    size_t                          the_capacity;
+    capacity_callback               the_capacity_changed;
+    Before                          the_before;
+
+    // Buffers registered since the consumer last looked.
+    boost::mutex                    the_registry_mutex;
+    std::vector<buffer*>            the_new_buffers;
+    boost::atomic<bool>             the_registry_changed;
+
+    // Only touched with the_mutex held.
+    std::vector<buffer*>            the_buffers;
+
+    boost::atomic<bool>             consumer_sleeping;
+    boost::mutex                    the_mutex;
+    boost::condition_variable       the_condition_variable;
+
+    // Not copyable.
+    per_thread_queue(const per_thread_queue&);
+    per_thread_queue& operator=(const per_thread_queue&);
+
+    static size_t round_up_pow2(size_t value)
+    {
+        size_t result = 2;
+        while( result < value )
+            result <<= 1;
+        return result;
+    }
+
+    static boost::thread_specific_ptr<thread_buffers>& local_buffers()
+    {
+        // Never destroyed, since threads may outlive it.
+        static boost::thread_specific_ptr<thread_buffers>* s_buffers =
+            new boost::thread_specific_ptr<thread_buffers>();
+        return *s_buffers;
+    }
+
+    static size_t next_id()
+    {
+        static boost::atomic<size_t> s_next_id(0);
+        return s_next_id.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    buffer* local_buffer()
+    {
+        thread_buffers* local = local_buffers().get();
+        if( !local )
+        {
+            local = new thread_buffers();
+            local_buffers().reset(local);
+        }
+
+        std::vector<buffer*>& buffers = local->buffers;
+        for( size_t i = 0; i < buffers.size(); i++ )
+        {
+            if( buffers[i]->queue_id == the_id )
+                return buffers[i];
+        }
+
+        // Let go of the buffers of any queues that have since gone away.
+        for( size_t i = 0; i < buffers.size(); )
+        {
+            if( buffers[i]->closed.load(boost::memory_order_acquire) )
+            {
+                buffers[i]->release();
+                buffers[i] = buffers.back();
+                buffers.pop_back();
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        buffer* b = new buffer(the_id, the_capacity);
+        if( the_capacity_changed )
+            the_capacity_changed(static_cast<std::ptrdiff_t>(the_capacity));
+        buffers.push_back(b);
+        {
+            boost::lock_guard<boost::mutex> lock(the_registry_mutex);
+            the_new_buffers.push_back(b);
+        }
+        the_registry_changed.store(true, boost::memory_order_release);
+        return b;
+    }
+
+    void wake_consumer()
+    {
+        // Pairs with the fence in wait_and_pop_all().
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if( consumer_sleeping.load(boost::memory_order_relaxed) )
+        {
+            boost::lock_guard<boost::mutex> lock(the_mutex);
+            the_condition_variable.notify_one();
+        }
+    }
+
+    // The following need the_mutex held.
+
+    void collect_new_buffers()
+    {
+        if( !the_registry_changed.load(boost::memory_order_acquire) )
+            return;
+
+        boost::lock_guard<boost::mutex> lock(the_registry_mutex);
+        the_buffers.insert(the_buffers.end(), the_new_buffers.begin(), the_new_buffers.end());
+        the_new_buffers.clear();
+        the_registry_changed.store(false, boost::memory_order_relaxed);
+    }
+
+    // Pops the first waiting item over all buffers.  Drained buffers of
+    // exited threads are dropped along the way.
+    bool pop_first(Data& popped_value)
+    {
+        buffer* first = NULL;
+        size_t first_head = 0;
+
+        for( size_t i = 0; i < the_buffers.size(); )
+        {
+            buffer* b = the_buffers[i];
+
+            // Check this before looking at the buffer, so that nothing
+            // pushed before the thread exited is missed.
+            bool orphaned = b->orphaned.load(boost::memory_order_acquire);
+
+            size_t head = b->head.load(boost::memory_order_relaxed);
+            if( head == b->tail.load(boost::memory_order_acquire) )
+            {
+                if( orphaned )
+                {
+                    the_buffers[i] = the_buffers.back();
+                    the_buffers.pop_back();
+                    b->release();
+                    if( the_capacity_changed )
+                        the_capacity_changed(-static_cast<std::ptrdiff_t>(the_capacity));
+                    continue;
+                }
+            }
+            else if( !first || the_before(b->items[head & b->mask], first->items[first_head & first->mask]) )
+            {
+                first = b;
+                first_head = head;
+            }
+            i++;
+        }
+
+        if( !first )
+            return false;
+
+        popped_value = first->items[first_head & first->mask];
+        first->head.store(first_head + 1, boost::memory_order_release);
+        return true;
+    }
+
+public:
+    // "capacity" is per thread.
+    explicit per_thread_queue(size_t capacity, capacity_callback capacity_changed = NULL)
+        : the_id(next_id()), the_capacity(round_up_pow2(capacity)),
+          the_capacity_changed(capacity_changed),
+          the_registry_changed(false), consumer_sleeping(false)
+    { }
+
+    ~per_thread_queue()
+    {
+        collect_new_buffers();
+        for( size_t i = 0; i < the_buffers.size(); i++ )
+        {
+            the_buffers[i]->closed.store(true, boost::memory_order_release);
+            the_buffers[i]->release();
+        }
+        if( the_capacity_changed )
+            the_capacity_changed(-static_cast<std::ptrdiff_t>(the_buffers.size() * the_capacity));
+    }
+
+    size_t capacity() const
+    {
+        return the_capacity;
+    }
+
+    bool try_push(Data const& data)
+    {
+        buffer* b = local_buffer();
+
+        size_t tail = b->tail.load(boost::memory_order_relaxed);
+        if( tail - b->head.load(boost::memory_order_acquire) > b->mask )
+            return false;
+
+        b->items[tail & b->mask] = data;
+        b->tail.store(tail + 1, boost::memory_order_release);
+
+        wake_consumer();
+        return true;
+    }
+
+    // Blocks (spinning) while this thread's buffer is full.
+    void push(Data const& data)
+    {
+        while( !try_push(data) )
+            boost::this_thread::yield();
+    }
+
+    // Pops the oldest item this thread pushed, if any - say, to make room
+    // in its own buffer.
+    bool try_pop_local(Data& popped_value)
+    {
+        buffer* b = local_buffer();
+
+        // Consumers only move the head with the_mutex held.
+        boost::lock_guard<boost::mutex> lock(the_mutex);
+        size_t head = b->head.load(boost::memory_order_relaxed);
+        if( head == b->tail.load(boost::memory_order_relaxed) )
+            return false;
+
+        popped_value = b->items[head & b->mask];
+        b->head.store(head + 1, boost::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(Data& popped_value)
+    {
+        boost::lock_guard<boost::mutex> lock(the_mutex);
+        collect_new_buffers();
+        return pop_first(popped_value);
+    }
+
+    void wait_and_pop(Data& popped_value)
+    {
+        std::vector<Data> popped;
+        wait_and_pop_all(popped, 1);
+        popped_value = popped[0];
+    }
+
+    // Waits for data, then pops everything available (up to "max" items).
+    template<typename Container>
+    void wait_and_pop_all(Container& popped_values, size_t max)
+    {
+        Data value;
+
+        for( int spin = 0; ; spin++ )
+        {
+            boost::unique_lock<boost::mutex> lock(the_mutex);
+            collect_new_buffers();
+
+            if( pop_first(value) )
+            {
+                popped_values.push_back(value);
+                while( --max > 0 && pop_first(value) )
+                    popped_values.push_back(value);
+                return;
+            }
+
+            if( spin < spin_count )
+            {
+                lock.unlock();
+                boost::this_thread::yield();
+                continue;
+            }
+
+            consumer_sleeping.store(true, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+
+            collect_new_buffers();
+            if( !pop_first(value) )
+            {
+                the_condition_variable.wait(lock);
+                consumer_sleeping.store(false, boost::memory_order_relaxed);
+                spin = 0;
+                continue;
+            }
+
+            consumer_sleeping.store(false, boost::memory_order_relaxed);
+            popped_values.push_back(value);
+            while( --max > 0 && pop_first(value) )
+                popped_values.push_back(value);
+            return;
+        }
+    }
+};
+
+#endif
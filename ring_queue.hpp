@@ -0,0 +1,229 @@
+#pragma once
+#ifndef _RING_QUEUE_H
+#define _RING_QUEUE_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+
+// Bounded, lock-free queue based on Dmitry Vyukov's bounded MPMC queue.
+// Producers never take a lock; the consumer only takes one when it has run
+// out of work and is about to go to sleep.  Every slot (and each of the two
+// positions) lives on its own cache line, so producers writing neighbouring
+// slots don't fight over the same line.
+template<typename Data>
+class ring_queue
+{
+private:
+    static const size_t cache_line_size = 64;
+    static const int    spin_count      = 64;
+
+    struct cell
+    {
+        boost::atomic<size_t>   sequence;
+        Data                    data;
+        char                    pad[cache_line_size -
+                                    (sizeof(boost::atomic<size_t>) + sizeof(Data)) % cache_line_size];
+    };
+
+    void*                       the_storage;
+    cell*                       the_buffer;
+    size_t                      the_mask;
+    char                        pad0[cache_line_size];
+
+    boost::atomic<size_t>       enqueue_pos;
+    char                        pad1[cache_line_size];
+
+    boost::atomic<size_t>       dequeue_pos;
+    char                        pad2[cache_line_size];
+
+    boost::atomic<bool>         consumer_sleeping;
+    boost::mutex                the_mutex;
+    boost::condition_variable   the_condition_variable;
+
+    // Not copyable.
+    ring_queue(const ring_queue&);
+    ring_queue& operator=(const ring_queue&);
+
+    static size_t round_up_pow2(size_t value)
+    {
+        size_t result = 2;
+        while( result < value )
+            result <<= 1;
+        return result;
+    }
+
+    void wake_consumer()
+    {
+        // Pairs with the fence in wait_and_pop(): either we see the consumer
+        // going to sleep, or it sees our item.
+        boost::atomic_thread_fence(boost::memory_order_seq_cst);
+        if( consumer_sleeping.load(boost::memory_order_relaxed) )
+        {
+            boost::lock_guard<boost::mutex> lock(the_mutex);
+            the_condition_variable.notify_one();
+        }
+    }
+
+public:
+    explicit ring_queue(size_t capacity)
+        : enqueue_pos(0), dequeue_pos(0), consumer_sleeping(false)
+    {
+        size_t count = round_up_pow2(capacity);
+
+        the_storage = std::malloc(count * sizeof(cell) + cache_line_size);
+        if( !the_storage )
+            throw std::bad_alloc();
+
+        the_buffer = reinterpret_cast<cell*>(
+                        (reinterpret_cast<size_t>(the_storage) + cache_line_size - 1) & ~(cache_line_size - 1)
+                     );
+        the_mask = count - 1;
+
+        // Initializing every slot also pre-faults the whole buffer, so no
+        // producer takes a page fault later on.
+        for( size_t i = 0; i < count; i++ )
+        {
+            new (&the_buffer[i]) cell();
+            the_buffer[i].sequence.store(i, boost::memory_order_relaxed);
+        }
+    }
+
+    ~ring_queue()
+    {
+        for( size_t i = 0; i <= the_mask; i++ )
+            the_buffer[i].~cell();
+        std::free(the_storage);
+    }
+
+    size_t capacity() const
+    {
+        return the_mask + 1;
+    }
+
+    bool try_push(Data const& data)
+    {
+        cell* c;
+        size_t pos = enqueue_pos.load(boost::memory_order_relaxed);
+
+        for( ;; )
+        {
+            c = &the_buffer[pos & the_mask];
+            size_t seq = c->sequence.load(boost::memory_order_acquire);
+            boost::intptr_t dif = static_cast<boost::intptr_t>(seq) - static_cast<boost::intptr_t>(pos);
+
+            if( dif == 0 )
+            {
+                if( enqueue_pos.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed) )
+                    break;
+            }
+            else if( dif < 0 )
+            {
+                // Full.
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos.load(boost::memory_order_relaxed);
+            }
+        }
+
+        c->data = data;
+        c->sequence.store(pos + 1, boost::memory_order_release);
+
+        wake_consumer();
+        return true;
+    }
+
+    // Blocks (spinning) while the queue is full.
+    void push(Data const& data)
+    {
+        while( !try_push(data) )
+            boost::this_thread::yield();
+    }
+
+    bool empty() const
+    {
+        return dequeue_pos.load(boost::memory_order_acquire) ==
+               enqueue_pos.load(boost::memory_order_acquire);
+    }
+
+    bool try_pop(Data& popped_value)
+    {
+        cell* c;
+        size_t pos = dequeue_pos.load(boost::memory_order_relaxed);
+
+        for( ;; )
+        {
+            c = &the_buffer[pos & the_mask];
+            size_t seq = c->sequence.load(boost::memory_order_acquire);
+            boost::intptr_t dif = static_cast<boost::intptr_t>(seq) - static_cast<boost::intptr_t>(pos + 1);
+
+            if( dif == 0 )
+            {
+                if( dequeue_pos.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed) )
+                    break;
+            }
+            else if( dif < 0 )
+            {
+                // Empty.
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(boost::memory_order_relaxed);
+            }
+        }
+
+        popped_value = c->data;
+        c->sequence.store(pos + the_mask + 1, boost::memory_order_release);
+        return true;
+    }
+
+    void wait_and_pop(Data& popped_value)
+    {
+        for( int spin = 0; ; spin++ )
+        {
+            if( try_pop(popped_value) )
+                return;
+
+            if( spin < spin_count )
+            {
+                boost::this_thread::yield();
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(the_mutex);
+            consumer_sleeping.store(true, boost::memory_order_relaxed);
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+
+            if( try_pop(popped_value) )
+            {
+                consumer_sleeping.store(false, boost::memory_order_relaxed);
+                return;
+            }
+
+            the_condition_variable.wait(lock);
+            consumer_sleeping.store(false, boost::memory_order_relaxed);
+            spin = 0;
+        }
+    }
+
+    // Waits for data, then pops everything available (up to "max" items).
+    template<typename Container>
+    void wait_and_pop_all(Container& popped_values, size_t max)
+    {
+        Data value;
+
+        wait_and_pop(value);
+        popped_values.push_back(value);
+
+        while( --max > 0 && try_pop(value) )
+            popped_values.push_back(value);
+    }
+};
+
+#endif
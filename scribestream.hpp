@@ -3,6 +3,7 @@
 #define _SCRIBE_STREAM_H
 
 #include <protocol/TBinaryProtocol.h>
+#include <protocol/TCompactProtocol.h>
 #include <transport/TSocket.h>
 #include <transport/TTransportUtils.h>
 
@@ -0,0 +1,425 @@
+// Benchmarks logging throughput, latency and allocations.
+//
+// Usage: cpplog-bench [-n messages] [-t threads] [-s sizes] [-l loggers]
+//      -n      Messages per run, split between the threads (default 100000).
+//      -t      Most producer threads to try (default: one per core).  Runs
+//              use 1, 2, 4, ... threads, up to this.
+//      -s      Comma-separated message sizes, in bytes (default 16,128,1024).
+//      -l      Comma-separated loggers to run (default: all of them).
+//
+// Loggers:
+//      string, file, size-rotate, multiplex
+//              One logger per producer thread, since these aren't
+//              thread-safe.  "multiplex" fans out to four loggers that
+//              discard what they get.
+//      background, background-ring, background-per-thread
+//              One BackgroundLogger (with the given queueing engine),
+//              shared by all producers, writing to a file.
+//
+// Prints one CSV line per run.  "seconds" (and so the rate) runs until
+// every message has been written, including a BackgroundLogger draining
+// its queue.  Latencies are per LOG statement, as seen by the producer.
+// Allocations are counted over all threads, through operator new.
+// Files are written to the current directory, and removed afterwards.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/atomic.hpp>
+
+#include "../cpplog.hpp"
+
+using namespace cpplog;
+
+// ------------------------------ ALLOCATIONS --------------------------------
+
+namespace
+{
+    // Each thread counts its own allocations, in a slot of its own.
+    struct alloc_counter
+    {
+        uint64_t    bytes;
+        uint64_t    count;
+        char        pad[64 - 2 * sizeof(uint64_t)];
+    };
+
+    const int               k_maxCounters = 1024;
+    alloc_counter           s_counters[k_maxCounters];
+    boost::atomic<int>      s_nextCounter(0);
+    CPPLOG_THREAD_LOCAL alloc_counter* t_counter = NULL;
+
+    void countAllocation(size_t size)
+    {
+        if( !t_counter )
+        {
+            int index = s_nextCounter.fetch_add(1, boost::memory_order_relaxed);
+            t_counter = &s_counters[index < k_maxCounters ? index : k_maxCounters - 1];
+        }
+
+        t_counter->bytes += size;
+        t_counter->count++;
+    }
+
+    void totalAllocations(uint64_t& bytes, uint64_t& count)
+    {
+        bytes = 0;
+        count = 0;
+        int used = std::min(s_nextCounter.load(), k_maxCounters);
+        for( int i = 0; i < used; i++ )
+        {
+            bytes += s_counters[i].bytes;
+            count += s_counters[i].count;
+        }
+    }
+
+    void* allocate(size_t size)
+    {
+        countAllocation(size);
+        void* p = std::malloc(size > 0 ? size : 1);
+        if( !p )
+            throw std::bad_alloc();
+        return p;
+    }
+}
+
+// GCC can't tell that these replace the defaults, and warns about
+// pairing operator new with free().
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+#if __cplusplus >= 201103L
+void* operator new(size_t size)             { return allocate(size); }
+void* operator new[](size_t size)           { return allocate(size); }
+void operator delete(void* p) noexcept      { std::free(p); }
+void operator delete[](void* p) noexcept    { std::free(p); }
+#if __cplusplus >= 201402L
+void operator delete(void* p, size_t) noexcept      { std::free(p); }
+void operator delete[](void* p, size_t) noexcept    { std::free(p); }
+#endif
+#else
+void* operator new(size_t size) throw(std::bad_alloc)   { return allocate(size); }
+void* operator new[](size_t size) throw(std::bad_alloc) { return allocate(size); }
+void operator delete(void* p) throw()                   { std::free(p); }
+void operator delete[](void* p) throw()                 { std::free(p); }
+#endif
+
+// -------------------------------- LOGGERS ----------------------------------
+
+namespace
+{
+    uint64_t nowNanos()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + static_cast<uint64_t>(ts.tv_nsec);
+    }
+
+    std::string fileName(const char* kind, unsigned long index, unsigned long number)
+    {
+        std::ostringstream name;
+        name << "cpplog_bench_" << kind << "_" << index << "_" << number << ".log";
+        return name.str();
+    }
+
+    void rotateName(unsigned long logNumber, std::string& newFileName, void* context)
+    {
+        newFileName = fileName("rotate", *static_cast<unsigned long*>(context), logNumber);
+    }
+
+    void removeFiles(const char* kind, unsigned long index)
+    {
+        for( unsigned long number = 0; std::remove(fileName(kind, index, number).c_str()) == 0; number++ )
+            ;
+    }
+
+    class DiscardLogger : public BaseLogger
+    {
+    public:
+        virtual bool sendLogMessage(LogData*)
+        {
+            return true;
+        }
+    };
+
+    bool isShared(const std::string& kind)
+    {
+        return kind.compare(0, 10, "background") == 0;
+    }
+
+    // A logger for one producer thread, along with whatever it logs to.
+    class thread_logger
+    {
+    private:
+        std::vector<BaseLogger*>    m_loggers;      // Destroyed in reverse.
+        unsigned long               m_index;
+
+    public:
+        thread_logger(const std::string& kind, unsigned long index)
+            : m_index(index)
+        {
+            if( kind == "string" )
+            {
+                m_loggers.push_back(new StringLogger());
+            }
+            else if( kind == "file" )
+            {
+                m_loggers.push_back(new FileLogger(fileName("file", index, 0)));
+            }
+            else if( kind == "size-rotate" )
+            {
+                m_loggers.push_back(new SizeRotateFileLogger(rotateName, &m_index, 4 * 1024 * 1024));
+            }
+            else if( kind == "multiplex" )
+            {
+                MultiplexLogger* multiplex = new MultiplexLogger();
+                for( int i = 0; i < 4; i++ )
+                    multiplex->addLogger(new DiscardLogger(), true);
+                m_loggers.push_back(multiplex);
+            }
+        }
+
+        ~thread_logger()
+        {
+            while( !m_loggers.empty() )
+            {
+                delete m_loggers.back();
+                m_loggers.pop_back();
+            }
+            removeFiles("file", m_index);
+            removeFiles("rotate", m_index);
+        }
+
+        BaseLogger* get()
+        {
+            return m_loggers.empty() ? NULL : m_loggers.back();
+        }
+    };
+
+    // A BackgroundLogger shared by all producers.
+    class shared_logger
+    {
+    private:
+        FileLogger*         m_file;
+        BackgroundLogger*   m_background;
+
+    public:
+        explicit shared_logger(const std::string& kind)
+            : m_file(new FileLogger(fileName("background", 0, 0)))
+        {
+            BackgroundLogger::QueueEngine engine = BackgroundLogger::QE_MUTEX;
+            if( kind == "background-ring" )
+                engine = BackgroundLogger::QE_RING;
+            else if( kind == "background-per-thread" )
+                engine = BackgroundLogger::QE_PER_THREAD;
+
+            m_background = new BackgroundLogger(m_file, engine);
+        }
+
+        // Waits for everything queued to be written.
+        ~shared_logger()
+        {
+            delete m_background;
+            delete m_file;
+            removeFiles("background", 0);
+        }
+
+        BaseLogger* get()
+        {
+            return m_background;
+        }
+    };
+}
+
+// -------------------------------- RUNNING ----------------------------------
+
+namespace
+{
+    struct producer
+    {
+        std::string             kind;
+        unsigned long           index;
+        size_t                  count;
+        const std::string*      payload;
+        BaseLogger*             shared;
+        boost::barrier*         start;
+        boost::barrier*         finish;
+        std::vector<uint32_t>   latencies;
+
+        void run()
+        {
+            thread_logger own(kind, index);
+            BaseLogger* logger = shared ? shared : own.get();
+
+            // Warm up (the LogData pool, the file, ...), then start together.
+            for( size_t i = 0; i < count / 100 + 10; i++ )
+                LOG_INFO(logger) << *payload;
+            latencies.reserve(count);
+            start->wait();
+
+            for( size_t i = 0; i < count; i++ )
+            {
+                uint64_t before = nowNanos();
+                LOG_INFO(logger) << *payload;
+                latencies.push_back(static_cast<uint32_t>(std::min<uint64_t>(nowNanos() - before, 0xFFFFFFFFu)));
+            }
+
+            // Stay around (with our logger) until every producer is done.
+            finish->wait();
+            finish->wait();
+        }
+    };
+
+    uint32_t percentile(std::vector<uint32_t>& values, double fraction)
+    {
+        if( values.empty() )
+            return 0;
+
+        size_t index = std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+
+    void runOne(const std::string& kind, size_t size, unsigned int threads, size_t messages)
+    {
+        std::string payload(size, 'x');
+        shared_logger* shared = isShared(kind) ? new shared_logger(kind) : NULL;
+
+        boost::barrier start(threads + 1);
+        boost::barrier finish(threads + 1);
+
+        std::vector<producer> producers(threads);
+        boost::thread_group group;
+        for( unsigned int i = 0; i < threads; i++ )
+        {
+            producer& p = producers[i];
+            p.kind = kind;
+            p.index = i;
+            p.count = messages / threads;
+            p.payload = &payload;
+            p.shared = shared ? shared->get() : NULL;
+            p.start = &start;
+            p.finish = &finish;
+        }
+        for( unsigned int i = 0; i < threads; i++ )
+            group.create_thread(boost::bind(&producer::run, &producers[i]));
+
+        start.wait();
+        uint64_t bytesBefore, countBefore;
+        totalAllocations(bytesBefore, countBefore);
+        uint64_t startTime = nowNanos();
+
+        // Everything's been logged...
+        finish.wait();
+        delete shared;
+
+        // ... and written.
+        uint64_t endTime = nowNanos();
+        uint64_t bytesAfter, countAfter;
+        totalAllocations(bytesAfter, countAfter);
+
+        finish.wait();
+        group.join_all();
+
+        std::vector<uint32_t> latencies;
+        size_t total = 0;
+        for( unsigned int i = 0; i < threads; i++ )
+        {
+            latencies.insert(latencies.end(), producers[i].latencies.begin(), producers[i].latencies.end());
+            total += producers[i].count;
+        }
+
+        double seconds = static_cast<double>(endTime - startTime) / 1e9;
+        std::printf("%s,%lu,%u,%lu,%.6f,%.0f,%u,%u,%u,%.1f,%.2f\n",
+                    kind.c_str(), static_cast<unsigned long>(size), threads,
+                    static_cast<unsigned long>(total), seconds, total / seconds,
+                    percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+                    static_cast<double>(bytesAfter - bytesBefore) / total,
+                    static_cast<double>(countAfter - countBefore) / total);
+        std::fflush(stdout);
+    }
+
+    std::vector<std::string> split(const std::string& list)
+    {
+        std::vector<std::string> items;
+        std::istringstream input(list);
+        std::string item;
+        while( std::getline(input, item, ',') )
+        {
+            if( !item.empty() )
+                items.push_back(item);
+        }
+        return items;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    static const char* const s_allLoggers[] =
+    {
+        "string", "file", "size-rotate", "multiplex",
+        "background", "background-ring", "background-per-thread"
+    };
+
+    size_t messages = 100000;
+    unsigned int maxThreads = std::max(1u, boost::thread::hardware_concurrency());
+    std::vector<std::string> sizes = split("16,128,1024");
+    std::vector<std::string> loggers(s_allLoggers, s_allLoggers + sizeof(s_allLoggers) / sizeof(s_allLoggers[0]));
+
+    for( int i = 1; i < argc; i++ )
+    {
+        if( i + 1 < argc && strcmp(argv[i], "-n") == 0 )
+            messages = std::strtoul(argv[++i], NULL, 10);
+        else if( i + 1 < argc && strcmp(argv[i], "-t") == 0 )
+            maxThreads = std::max(1ul, std::strtoul(argv[++i], NULL, 10));
+        else if( i + 1 < argc && strcmp(argv[i], "-s") == 0 )
+            sizes = split(argv[++i]);
+        else if( i + 1 < argc && strcmp(argv[i], "-l") == 0 )
+            loggers = split(argv[++i]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [-n messages] [-t threads] [-s sizes] [-l loggers]" << std::endl;
+            return 2;
+        }
+    }
+
+    for( size_t i = 0; i < loggers.size(); i++ )
+    {
+        const char* const* end = s_allLoggers + sizeof(s_allLoggers) / sizeof(s_allLoggers[0]);
+        if( std::find(s_allLoggers, end, loggers[i]) == end )
+        {
+            std::cerr << argv[0] << ": unknown logger " << loggers[i] << std::endl;
+            return 2;
+        }
+    }
+
+    std::printf("logger,message_size,threads,messages,seconds,messages_per_sec,"
+                "p50_ns,p99_ns,p999_ns,bytes_allocated_per_message,allocations_per_message\n");
+
+    for( size_t l = 0; l < loggers.size(); l++ )
+    {
+        for( size_t s = 0; s < sizes.size(); s++ )
+        {
+            size_t size = std::strtoul(sizes[s].c_str(), NULL, 10);
+            for( unsigned int threads = 1; ; threads *= 2 )
+            {
+                threads = std::min(threads, maxThreads);
+                runOne(loggers[l], size, threads, messages);
+                if( threads == maxThreads )
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
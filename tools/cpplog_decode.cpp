@@ -0,0 +1,53 @@
+// Turns files written by BinaryFileLogger back into text.
+//
+// Usage: cpplog-decode [-t] <file>...
+//      -t      Start each message with its (UTC) time.
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include "../binarylogreader.hpp"
+
+int main(int argc, char* argv[])
+{
+    bool withTime = false;
+    int firstFile = 1;
+
+    if( argc > 1 && strcmp(argv[1], "-t") == 0 )
+    {
+        withTime = true;
+        firstFile++;
+    }
+
+    if( firstFile >= argc )
+    {
+        std::cerr << "Usage: " << argv[0] << " [-t] <file>..." << std::endl;
+        return 2;
+    }
+
+    int result = 0;
+    for( int i = firstFile; i < argc; i++ )
+    {
+        std::ifstream input(argv[i], std::ios_base::in | std::ios_base::binary);
+        if( !input )
+        {
+            std::cerr << argv[0] << ": unable to open " << argv[i] << std::endl;
+            result = 1;
+            continue;
+        }
+
+        cpplog::BinaryLogReader reader(input);
+        std::string text;
+        while( reader.next(text, withTime) )
+            std::cout << text;
+
+        if( reader.failed() )
+        {
+            std::cerr << argv[0] << ": " << argv[i] << " is damaged or truncated" << std::endl;
+            result = 1;
+        }
+    }
+
+    return result;
+}